@@ -0,0 +1,465 @@
+/*
+ This program takes one command line argument: the name of an ext2 formatted virtual disk (see ext2_genimg to build one). It times the ext2_utils primitives on that image: ialloc, dalloc, get_inode_number_by_name, get_inode_number_by_path, copy_to_inode_datablock, remove_from_dir_entry, restore_from_dir_entry and each_checker_rec. Lookups and removes pick files of the image at random.
+ The image is opened read only (mapped private, or with "--io=pread" changed blocks are kept in the buffer cache), nothing is written back to it. Every change a primitive makes is undone before the next one is timed (allocations freed, removed files restored), so each primitive sees the image as generated.
+ Optional flags, after the disk image argument:
+ "-n N"  operations per primitive (default 10000, each_checker_rec runs N / 100 times)
+ "-s N"  bytes copied per copy_to_inode_datablock (default 4096)
+ "-S N"  random seed (default 1)
+ "-t N"  threads, if more than 1 ialloc and dalloc are also timed with N threads allocating at once, and with 1 thread in the same harness as the base for scaling ("ialloc_1t", "ialloc_Nt", ...). Threads are started before timing and run in rounds no bigger than the free inodes or blocks, freed between rounds; ops/sec is then from the wall time of the allocations only
+ For each primitive the program prints one tab separated line: name, operations, ops/sec, p50/p90/p99/max latency in microseconds, the peak RSS in kb so far and the minor/major page faults taken during the primitive. The first line, "open", times opening the image (mapping and metadata prefault or load), so the "--map=" and "--io=" options can be compared on startup and faults.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "ext2.h"
+
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include "ext2_utils.h"
+#include "ext2_io.h"
+
+unsigned char *disk;
+
+struct ext2_super_block *sb;
+struct ext2_group_desc *gdt;
+unsigned char *block_bitmap;
+unsigned char *inode_bitmap;
+struct ext2_inode *inode_table;
+
+struct bench_file {
+    int  parent_inode_num;
+    char name[EXT2_NAME_LEN + 1];
+    char *path;
+};
+
+struct bench_files {
+    struct bench_file *files;
+    int num_files;
+    int cap;
+};
+
+/*
+ *  Monotonic clock in nanoseconds.
+ */
+long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ *  Collect every regular file under dir, with its absolute path.
+ */
+void collect_files(int dir_inode_num, char *dir_path, struct bench_files *out) {
+    struct ext2_inode *dir_inode = inode_table + dir_inode_num - 1;
+    int *block_array = read_i_block_into_array(dir_inode);
+    int i;
+    
+    prefetch_block_array(block_array);
+    for (i = 0; block_array[i] != -1; i++) {
+        unsigned char *block = ext2_block_get(block_array[i]);
+        int off = 0;
+        
+        while (off < EXT2_BLOCK_SIZE) {
+            struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(block + off);
+            if (entry->rec_len == 0) {
+                break;
+            }
+            off += entry->rec_len;
+            if (entry->inode == 0 ||
+                (entry->name_len == 1 && entry->name[0] == '.') ||
+                (entry->name_len == 2 && entry->name[0] == '.' && entry->name[1] == '.')) {
+                continue;
+            }
+            
+            char name[EXT2_NAME_LEN + 1];
+            memcpy(name, entry->name, entry->name_len);
+            name[entry->name_len] = '\0';
+            char *path = malloc(strlen(dir_path) + entry->name_len + 2);
+            sprintf(path, "%s/%s", strcmp(dir_path, "/") == 0 ? "" : dir_path, name);
+            
+            if (entry->file_type == EXT2_FT_DIR) {
+                collect_files(entry->inode, path, out);
+                free(path);
+            } else if (entry->file_type == EXT2_FT_REG_FILE) {
+                if (out->num_files == out->cap) {
+                    out->cap = out->cap ? out->cap * 2 : 256;
+                    out->files = realloc(out->files, sizeof(struct bench_file) * out->cap);
+                }
+                struct bench_file *file = out->files + out->num_files++;
+                file->parent_inode_num = dir_inode_num;
+                strcpy(file->name, name);
+                file->path = path;
+            } else {
+                free(path);
+            }
+        }
+        ext2_block_put(block_array[i], 0);
+    }
+    free(block_array);
+}
+
+int compare_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Page faults counted up to the last report
+struct rusage last_usage;
+
+/*
+ *  Print one result line from latencies of num_ops operations, ops/sec
+ *      from wall_ns or if 0 from sum of latencies.
+ */
+void report_wall(const char *name, long long *lat, int num_ops, long long wall_ns) {
+    struct rusage usage;
+    long long total = wall_ns;
+    int i;
+    
+    getrusage(RUSAGE_SELF, &usage);
+    long minflt = usage.ru_minflt - last_usage.ru_minflt;
+    long majflt = usage.ru_majflt - last_usage.ru_majflt;
+    last_usage = usage;
+    if (num_ops == 0) {
+        printf("%s\t0\t-\t-\t-\t-\t-\t%ld\t%ld/%ld\n", name, usage.ru_maxrss, minflt, majflt);
+        return;
+    }
+    for (i = 0; i < num_ops && wall_ns == 0; i++) {
+        total += lat[i];
+    }
+    qsort(lat, num_ops, sizeof(long long), compare_ll);
+    printf("%s\t%d\t%.0f\t%.2f\t%.2f\t%.2f\t%.2f\t%ld\t%ld/%ld\n", name, num_ops,
+           total ? num_ops * 1e9 / total : 0,
+           lat[(num_ops - 1) * 50 / 100] / 1e3,
+           lat[(num_ops - 1) * 90 / 100] / 1e3,
+           lat[(num_ops - 1) * 99 / 100] / 1e3,
+           lat[num_ops - 1] / 1e3,
+           usage.ru_maxrss, minflt, majflt);
+}
+
+void report(const char *name, long long *lat, int num_ops) {
+    report_wall(name, lat, num_ops, 0);
+}
+
+// Parallel allocation run, workers go round after round in lock step
+struct alloc_run {
+    int              (*alloc)(void);
+    pthread_barrier_t  barrier;
+    int                stop;
+};
+
+// One thread of a parallel allocation run
+struct alloc_worker {
+    pthread_t         thread;
+    struct alloc_run *run;
+    int               num_ops;    /* this round */
+    long long        *lat;
+    int              *allocated;
+    int               done;
+    long long         start;      /* first and last allocation of round */
+    long long         end;
+};
+
+void *alloc_worker_run(void *arg) {
+    struct alloc_worker *worker = arg;
+    
+    for (;;) {
+        // round set up by bench_parallel_alloc()
+        pthread_barrier_wait(&worker->run->barrier);
+        if (worker->run->stop) {
+            break;
+        }
+        worker->start = now_ns();
+        for (worker->done = 0; worker->done < worker->num_ops; worker->done++) {
+            long long start = now_ns();
+            int num = worker->run->alloc();
+            worker->lat[worker->done] = now_ns() - start;
+            if (num < 0) {
+                break;
+            }
+            worker->allocated[worker->done] = num;
+        }
+        worker->end = now_ns();
+        pthread_barrier_wait(&worker->run->barrier);
+    }
+    return NULL;
+}
+
+/*
+ *  Time num_ops allocations spread over num_threads threads. Threads are
+ *      started once, then go in rounds no bigger than what count_free()
+ *      reports free, so no thread runs out. Only allocations are timed:
+ *      wall time of a round is from the first thread starting it to the
+ *      last one done, everything allocated is freed between rounds.
+ */
+void bench_parallel_alloc(const char *name, int (*alloc)(void), void (*release)(int),
+                          int (*count_free)(void), int num_ops, int num_threads,
+                          long long *lat, int *allocated) {
+    struct alloc_worker *workers = calloc(num_threads, sizeof(struct alloc_worker));
+    struct alloc_run run;
+    long long wall = 0;
+    int done = 0;
+    int t;
+    int i;
+    
+    run.alloc = alloc;
+    run.stop = 0;
+    pthread_barrier_init(&run.barrier, NULL, num_threads + 1);
+    for (t = 0; t < num_threads; t++) {
+        workers[t].run = &run;
+        pthread_create(&workers[t].thread, NULL, alloc_worker_run, workers + t);
+    }
+    
+    while (done < num_ops) {
+        int round = num_ops - done;
+        if (round > count_free()) {
+            round = count_free();
+        }
+        int per_thread = round / num_threads;
+        if (per_thread == 0) {
+            break;
+        }
+        for (t = 0; t < num_threads; t++) {
+            workers[t].num_ops = per_thread;
+            workers[t].lat = lat + done + t * per_thread;
+            workers[t].allocated = allocated + t * per_thread;
+        }
+        pthread_barrier_wait(&run.barrier);
+        // round running
+        pthread_barrier_wait(&run.barrier);
+        
+        long long first = workers[0].start;
+        long long last = workers[0].end;
+        int round_done = 0;
+        for (t = 0; t < num_threads; t++) {
+            first = workers[t].start < first ? workers[t].start : first;
+            last = workers[t].end > last ? workers[t].end : last;
+            for (i = 0; i < workers[t].done; i++) {
+                release(workers[t].allocated[i]);
+                // packed in front, failed allocations dropped
+                lat[done + round_done++] = workers[t].lat[i];
+            }
+        }
+        ext2_counters_fold();
+        wall += last - first;
+        done += round_done;
+        if (round_done < per_thread * num_threads) {
+            break;
+        }
+    }
+    
+    run.stop = 1;
+    pthread_barrier_wait(&run.barrier);
+    for (t = 0; t < num_threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+    }
+    pthread_barrier_destroy(&run.barrier);
+    
+    char label[64];
+    snprintf(label, sizeof(label), "%s_%dt", name, num_threads);
+    report_wall(label, lat, done, wall);
+    free(workers);
+}
+
+int main(int argc, const char * argv[]) {
+    // "--stats" prints hot path counters on exit
+    ext2_stats_parse_flag(&argc, argv);
+    // primitives are timed on files picked at random
+    ext2_io_set_access(EXT2_IO_ACCESS_RANDOM);
+    // "--io=", "--cache=", "--access=" and "--map=" set up the block backend
+    if (ext2_io_parse_flags(&argc, argv)) {
+        fprintf(stderr, "Invalid --io, --cache, --access or --map value\n");
+        exit(1);
+    }
+    
+    int num_ops = 10000;
+    int copy_size = 4096;
+    unsigned int seed = 1;
+    int num_threads = 1;
+    int arg_idx;
+    
+    if (argc < 2 || (argc % 2) != 0) {
+        fprintf(stderr, "Usage: <image file name> [-n ops] [-s copy bytes] [-S seed] [-t threads]\n");
+        exit(1);
+    }
+    for (arg_idx = 2; arg_idx < argc; arg_idx += 2) {
+        if (strcmp("-n", argv[arg_idx]) == 0) {
+            num_ops = atoi(argv[arg_idx + 1]);
+        } else if (strcmp("-s", argv[arg_idx]) == 0) {
+            copy_size = atoi(argv[arg_idx + 1]);
+        } else if (strcmp("-S", argv[arg_idx]) == 0) {
+            seed = (unsigned int)atoi(argv[arg_idx + 1]);
+        } else if (strcmp("-t", argv[arg_idx]) == 0) {
+            num_threads = atoi(argv[arg_idx + 1]);
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[arg_idx]);
+            exit(1);
+        }
+    }
+    if (num_ops <= 0 || copy_size < 0 || num_threads < 1) {
+        fprintf(stderr, "Invalid option value\n");
+        exit(1);
+    }
+    srand(seed);
+    // open disk img through block backend, changes stay private so
+    //      the image is never changed
+    getrusage(RUSAGE_SELF, &last_usage);
+    long long open_start = now_ns();
+    if (ext2_io_open(argv[1], 0)) {
+        perror(argv[1]);
+        exit(1);
+    }
+    long long open_lat = now_ns() - open_start;
+    
+    struct bench_files found = {NULL, 0, 0};
+    collect_files(EXT2_ROOT_INO, "/", &found);
+    
+    long long *lat = malloc(sizeof(long long) * num_ops);
+    long long *lat2 = malloc(sizeof(long long) * num_ops);
+    int *allocated = malloc(sizeof(int) * num_ops);
+    unsigned char *copy_buf = malloc(copy_size + 1);
+    long long start;
+    int done;
+    int i;
+    
+    for (i = 0; i < copy_size; i++) {
+        copy_buf[i] = (unsigned char)rand();
+    }
+    
+    printf("primitive\tops\tops/sec\tp50_us\tp90_us\tp99_us\tmax_us\tmaxrss_kb\tfaults_min/maj\n");
+    report("open", &open_lat, 1);
+    
+    // ialloc, in rounds bounded by free inodes
+    for (done = 0; done < num_ops; ) {
+        int round = 0;
+        while (done + round < num_ops) {
+            start = now_ns();
+            int inode_num = ialloc();
+            lat[done + round] = now_ns() - start;
+            if (inode_num < 0) {
+                break;
+            }
+            allocated[round++] = inode_num;
+        }
+        for (i = 0; i < round; i++) {
+            ifree(allocated[i]);
+        }
+        done += round;
+        if (round == 0) {
+            break;
+        }
+    }
+    report("ialloc", lat, done);
+    
+    // dalloc, same
+    for (done = 0; done < num_ops; ) {
+        int round = 0;
+        while (done + round < num_ops) {
+            start = now_ns();
+            int block_num = dalloc();
+            lat[done + round] = now_ns() - start;
+            if (block_num < 0) {
+                break;
+            }
+            allocated[round++] = block_num;
+        }
+        for (i = 0; i < round; i++) {
+            dfree(allocated[i]);
+        }
+        done += round;
+        if (round == 0) {
+            break;
+        }
+    }
+    report("dalloc", lat, done);
+    
+    if (num_threads > 1) {
+        // same harness with 1 thread, the base scaling is measured from
+        bench_parallel_alloc("ialloc", ialloc, ifree, count_inode_bitmap, num_ops, 1, lat, allocated);
+        bench_parallel_alloc("ialloc", ialloc, ifree, count_inode_bitmap, num_ops, num_threads, lat, allocated);
+        bench_parallel_alloc("dalloc", dalloc, dfree, count_block_bitmap, num_ops, 1, lat, allocated);
+        bench_parallel_alloc("dalloc", dalloc, dfree, count_block_bitmap, num_ops, num_threads, lat, allocated);
+    }
+    
+    done = found.num_files ? num_ops : 0;
+    for (i = 0; i < done; i++) {
+        struct bench_file *file = found.files + rand() % found.num_files;
+        start = now_ns();
+        get_inode_number_by_name(file->parent_inode_num, file->name);
+        lat[i] = now_ns() - start;
+    }
+    report("get_inode_number_by_name", lat, done);
+    
+    for (i = 0; i < done; i++) {
+        struct bench_file *file = found.files + rand() % found.num_files;
+        start = now_ns();
+        get_inode_number_by_path(file->path);
+        lat[i] = now_ns() - start;
+    }
+    report("get_inode_number_by_path", lat, done);
+    
+    // copy into a fresh inode, freed again right after
+    for (done = 0; done < num_ops; done++) {
+        int inode_num = new_inode(0, EXT2_S_IFREG, copy_size);
+        if (inode_num < 0) {
+            break;
+        }
+        start = now_ns();
+        int rs = copy_to_inode_datablock(inode_table + inode_num - 1, copy_buf, copy_size);
+        lat[done] = now_ns() - start;
+        free_inode(inode_num);
+        if (rs) {
+            break;
+        }
+    }
+    report("copy_to_inode_datablock", lat, done);
+    
+    // remove a file then restore it, file that can't come back is dropped
+    for (done = 0; done < num_ops && found.num_files > 0; done++) {
+        int idx = rand() % found.num_files;
+        struct bench_file *file = found.files + idx;
+        struct ext2_inode *parent_inode = inode_table + file->parent_inode_num - 1;
+        start = now_ns();
+        remove_from_dir_entry(parent_inode, file->name);
+        lat[done] = now_ns() - start;
+        start = now_ns();
+        int rs = restore_from_dir_entry(parent_inode, file->name);
+        lat2[done] = now_ns() - start;
+        if (rs) {
+            free(file->path);
+            found.files[idx] = found.files[--found.num_files];
+        }
+    }
+    report("remove_from_dir_entry", lat, done);
+    report("restore_from_dir_entry", lat2, done);
+    
+    done = num_ops / 100 ? num_ops / 100 : 1;
+    for (i = 0; i < done; i++) {
+        unsigned char root_ft_type = EXT2_FT_DIR;
+        start = now_ns();
+        each_checker_rec(EXT2_ROOT_INO, EXT2_ROOT_INO, &root_ft_type);
+        lat[i] = now_ns() - start;
+    }
+    report("each_checker_rec", lat, done);
+    
+    for (i = 0; i < found.num_files; i++) {
+        free(found.files[i].path);
+    }
+    free(found.files);
+    free(copy_buf);
+    free(allocated);
+    free(lat2);
+    free(lat);
+    
+    return 0;
+}
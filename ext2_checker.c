@@ -5,6 +5,7 @@
  c,for each file, directory or symlink, you must check that its inode is marked as allocated in the inode bitmap. If it isn't, then the inode bitmap must be updated to indicate that the inode is in use. You should also update the corresponding counters in the block group and superblock (they should be consistent with the bitmap at this point). Once such an inconsistency is repaired, your program should output the following message: "Fixed: inode [I] not marked as in-use", where I is the inode number. Each inconsistency counts towards to total number of fixes.
  d,for each file, directory, or symlink, you must check that its inode's i_dtime is set to 0. If it isn't, you must reset (to 0), to indicate that the file should not be marked for removal. Once such an inconsistency is repaired, your program should output the following message: "Fixed: valid inode marked for deletion: [I]", where I is the inode number. Each inconsistency counts towards to total number of fixes.
  e,for each file, directory, or symlink, you must check that all its data blocks are allocated in the data bitmap. If any of its blocks is not allocated, you must fix this by updating the data bitmap. You should also update the corresponding counters in the block group and superblock, (they should be consistent with the bitmap at this point). Once such an inconsistency is fixed, your program should output the following message: "Fixed: D in-use data blocks not marked in data bitmap for inode: [I]", where D is the number of data blocks fixed, and I is the inode number. Each inconsistency counts towards to total number of fixes.
+ f,if the image has a dedup index ("<image>.dedup", see ext2_cp -d), the reference count of each shared block must match the number of live files using it. If it does not, trust the inodes and fix the count. Once such an inconsistency is fixed, your program should output the following message: "Fixed: dedup reference count of block [B] was off by Z", where B is the block number and Z the difference. Each inconsistency counts towards to total number of fixes.
  Your program must count all the fixed inconsistencies, and produce one last message: either "N file system inconsistencies repaired!", where N is the number of fixes made, or "No file system inconsistencies detected!".
  You may limit your consistency checks to only regular files, directories and symlinks.
  Hint: You might want to fix the counters based on the bitmaps, as a one-time step before attempting to fix any other type of inconsistency. Even if initially trusting the bitmaps may not be the way to go (since they could be corrupted), the counters should get readjusted in the later steps anyway, whenever the bitmaps get updated. The Z values from point a) should be added to the tally of fixes, but do not include any further superblock or block group counter adjustments from points c) and e) (since technically these may be just correcting the adjustments made in point a)).
@@ -23,6 +24,7 @@
 #include <string.h>
 #include <errno.h>
 #include "ext2_utils.h"
+#include "ext2_io.h"
 
 unsigned char *disk;
 
@@ -33,21 +35,32 @@ unsigned char *inode_bitmap;
 struct ext2_inode *inode_table;
 
 int main(int argc, const char * argv[]) {
+    // "--stats" prints hot path counters on exit
+    ext2_stats_parse_flag(&argc, argv);
+    // "--io=", "--cache=", "--access=" and "--map=" set up the block backend
+    if (ext2_io_parse_flags(&argc, argv)) {
+        fprintf(stderr, "Invalid --io, --cache, --access or --map value\n");
+        exit(1);
+    }
+    
     if(argc != 2) {
         fprintf(stderr, "Usage: <image file name>\n");
         exit(1);
     }
-    int fd = open(argv[1], O_RDWR);
-    
-    // map disk img into memory
-    disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if(disk == MAP_FAILED) {
-        perror("mmap");
+    // stale counters are to be found and reported here, not recomputed
+    //      silently on open
+    ext2_io_set_recount(0);
+    // open disk img through block backend, written back on exit
+    if (ext2_io_open(argv[1], 1)) {
+        perror(argv[1]);
         exit(1);
     }
     
-    // Init utils
-    ext2_utils_init();
+    // keep reference counts of shared blocks correct
+    if (dedup_load(argv[1], 0)) {
+        fprintf(stderr, "Invalid dedup index\n");
+        exit(1);
+    }
     
     // varible
     int num_fixed = 0;
@@ -127,6 +140,10 @@ int main(int argc, const char * argv[]) {
     unsigned char root_ft_type = EXT2_FT_DIR;
     num_fixed += each_checker_rec(2, 2, &root_ft_type);
     
+    // check if reference count of each dedup shared block
+    //      match the number of inodes using it
+    num_fixed += dedup_check_refs();
+    
     // output summary
     if (num_fixed) {
         printf("%d file system inconsistencies repaired!\n", num_fixed);
@@ -0,0 +1,87 @@
+/*
+ This program takes two command line arguments. The first is the name of an ext2 formatted virtual disk, and the second is an absolute path to a directory on that disk. The program repacks the live entries of the directory densely into the fewest data blocks and frees the trailing blocks, undoing the dead space left in directories by rm/cp churn. If the directory does not exist, the program returns ENOENT; if the path is not a directory, ENOTDIR.
+ Optional flags, after the disk image argument:
+ "-r" compacts every directory under the specified one as well; use "/" to compact the whole image.
+ "-k" keeps deleted entries that can still be restored (their inode and data blocks are unused) in the gaps, so ext2_restore still finds them.
+ The program prints the number of data blocks freed.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "ext2.h"
+
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include "ext2_utils.h"
+#include "ext2_io.h"
+
+unsigned char *disk;
+
+struct ext2_super_block *sb;
+struct ext2_group_desc *gdt;
+unsigned char *block_bitmap;
+unsigned char *inode_bitmap;
+struct ext2_inode *inode_table;
+
+int main(int argc, const char * argv[]) {
+    // "--stats" prints hot path counters on exit
+    ext2_stats_parse_flag(&argc, argv);
+    // "--io=", "--cache=", "--access=" and "--map=" set up the block backend
+    if (ext2_io_parse_flags(&argc, argv)) {
+        fprintf(stderr, "Invalid --io, --cache, --access or --map value\n");
+        exit(1);
+    }
+    
+    // if -r flag set, this will be set to 1
+    int recursive = 0;
+    // if -k flag set, this will be set to 1
+    int keep_deleted = 0;
+    int arg_idx = 2;
+    
+    while (arg_idx < argc && argv[arg_idx][0] == '-') {
+        if (strcmp("-r", argv[arg_idx]) == 0) {
+            recursive = 1;
+        } else if (strcmp("-k", argv[arg_idx]) == 0) {
+            keep_deleted = 1;
+        } else {
+            break;
+        }
+        arg_idx++;
+    }
+    
+    if(argc < 2 || argc - arg_idx != 1) {
+        fprintf(stderr, "Usage: <image file name> [-r] [-k] <absolute path of dir>\n");
+        exit(1);
+    }
+    // open disk img through block backend, written back on exit
+    if (ext2_io_open(argv[1], 1)) {
+        perror(argv[1]);
+        exit(1);
+    }
+    
+    // find out dir inode
+    int dir_inode_num = get_inode_number_by_path_follow(EXT2_ROOT_INO, (char *)argv[arg_idx], 1);
+    if (dir_inode_num < 0) {
+        return ENOENT;
+    }
+    struct ext2_inode *dir_inode = inode_table + dir_inode_num - 1;
+    if ((dir_inode->i_mode & 0xF000) != EXT2_S_IFDIR) {
+        return ENOTDIR;
+    }
+    
+    int num_freed;
+    if (recursive) {
+        num_freed = compact_dir_rec(dir_inode_num, keep_deleted);
+    } else {
+        num_freed = compact_dir(dir_inode_num, keep_deleted);
+    }
+    printf("%d data blocks freed\n", num_freed);
+    
+    return 0;
+}
@@ -4,6 +4,9 @@
  Please read the specifications of ext2 carefully, some things you will not need to worry about (like permissions, gid, uid, etc.), while setting other information in the inodes may be important (e.g., i_dtime).
  When you allocate a new inode or data block, you *must use the next one available* from the corresponding bitmap (excluding reserved inodes, of course). Failure to do so will result in deductions, so please be careful about this requirement.
  Be careful to consider trailing slashes in paths. These will show up during testing so it's your responsibility to make your code as robust as possible by capturing corner cases.
+ Dedup mode: with "-d" (or "--dedup") after the disk image argument, each data block whose content is already stored in the image is shared instead of copied again. Shared blocks are tracked in a persistent index next to the image ("<image>.dedup") with a reference count per block, which ext2_rm, ext2_restore and ext2_checker keep up to date.
+ Overwrite and append modes: with "--overwrite" an existing target file gets the src content in place, its blocks are reused, only changed blocks are written and only the size difference is allocated or freed. With "--append" the src content is added at the end of the target, filling the slack of its last block first. Either mode creates the target if it does not exist. A block the target shares through dedup is copied before it is changed, blocks written in these modes are not shared.
+ Locality mode: with "--locality", new inodes and blocks are placed by locality instead of taking the next one available: a dir made in root goes to the least used region of the image, anything else next to its parent, and file blocks follow the region of their inode and each other.
  */
 
 #include <stdio.h>
@@ -19,6 +22,7 @@
 #include <errno.h>
 #include <string.h>
 #include "ext2_utils.h"
+#include "ext2_io.h"
 
 unsigned char *disk;
 
@@ -29,23 +33,53 @@ unsigned char *inode_bitmap;
 struct ext2_inode *inode_table;
 
 int main(int argc, const char * argv[]) {
-    if(argc != 4) {
-        fprintf(stderr, "Usage: <image file name> <src> <dst>\n");
+    // "--stats" prints hot path counters on exit
+    ext2_stats_parse_flag(&argc, argv);
+    // "--locality" places new inodes and blocks near their parent
+    ext2_alloc_parse_flag(&argc, argv);
+    // copy writes a whole file in block order
+    ext2_io_set_access(EXT2_IO_ACCESS_SEQUENTIAL);
+    // "--io=", "--cache=", "--access=" and "--map=" set up the block backend
+    if (ext2_io_parse_flags(&argc, argv)) {
+        fprintf(stderr, "Invalid --io, --cache, --access or --map value\n");
         exit(1);
     }
-    int fd = open(argv[1], O_RDWR);
-    int src_fd = open(argv[2], O_RDWR);
     
-    // map disk img into memory
-    disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if(disk == MAP_FAILED) {
-        perror("mmap");
+    // if -d flag set, this will be set to 1
+    int dedup = 0;
+    int overwrite = 0;
+    int append = 0;
+    int arg_idx = 2;
+    
+    for (; arg_idx < argc && argv[arg_idx][0] == '-'; arg_idx++) {
+        if (strcmp("-d", argv[arg_idx]) == 0 || strcmp("--dedup", argv[arg_idx]) == 0) {
+            dedup = 1;
+        } else if (strcmp("--overwrite", argv[arg_idx]) == 0) {
+            overwrite = 1;
+        } else if (strcmp("--append", argv[arg_idx]) == 0) {
+            append = 1;
+        } else {
+            break;
+        }
+    }
+    
+    if(argc != arg_idx + 2 || (overwrite && append)) {
+        fprintf(stderr, "Usage: <image file name> [-d] [--overwrite | --append] <src> <dst>\n");
+        exit(1);
+    }
+    const char *src_arg = argv[arg_idx];
+    const char *dst_arg = argv[arg_idx + 1];
+    int src_fd = open(src_arg, O_RDWR);
+    
+    // open disk img through block backend, written back on exit
+    if (ext2_io_open(argv[1], 1)) {
+        perror(argv[1]);
         exit(1);
     }
     
     // map src file into memory
     struct stat src_stat;
-    if (lstat(argv[2], &src_stat) == -1) {
+    if (lstat(src_arg, &src_stat) == -1) {
         return ENOENT;
     }
     int src_file_size = (int)src_stat.st_size;
@@ -54,40 +88,62 @@ int main(int argc, const char * argv[]) {
         perror("mmap");
         exit(1);
     }
-    // Init utils
-    ext2_utils_init();
+    // shared blocks of a target written in place must be known
+    if ((dedup || overwrite || append) && dedup_load(argv[1], dedup)) {
+        fprintf(stderr, "Invalid dedup index\n");
+        exit(1);
+    }
     
     
     char dst_path[PATH_MAX];
     char dst_file_name[EXT2_NAME_LEN];
     char dst_file_parent[PATH_MAX];
-    strcpy(dst_path, argv[3]);
+    strcpy(dst_path, dst_arg);
     clear_end_slash(dst_path);
     cut_path(dst_path, dst_file_parent, dst_file_name);
     
     
     // find out dst file parent dir inode
-    int dst_file_parent_inode_num = get_inode_number_by_path(dst_file_parent);
+    int dst_file_parent_inode_num = get_inode_number_by_path_follow(EXT2_ROOT_INO, dst_file_parent, 1);
     // check if dst file parent exist
     if (dst_file_parent_inode_num < 0) {
         return ENOENT;
     }
     // check if there is a file in dst dir has same name as src file
-    if (get_inode_number_by_name(dst_file_parent_inode_num, dst_file_name) > 0) {
-        return EEXIST;
+    int dst_file_inode_num = get_inode_number_by_name(dst_file_parent_inode_num, dst_file_name);
+    if (dst_file_inode_num > 0) {
+        struct ext2_inode *dst_file_inode = inode_table + dst_file_inode_num - 1;
+        if (!overwrite && !append) {
+            return EEXIST;
+        }
+        if ((dst_file_inode->i_mode & 0xF000) == EXT2_S_IFDIR) {
+            return EISDIR;
+        }
+        if ((dst_file_inode->i_mode & 0xF000) != EXT2_S_IFREG) {
+            return EEXIST;
+        }
+        // reuse blocks of existing file, write only what changed
+        return write_to_inode_datablock(dst_file_inode, src_file, src_file_size, append);
     }
     struct ext2_inode *dst_file_parent_inode = inode_table + (dst_file_parent_inode_num - 1);
     
     // create inode for dst_file
-    int dst_file_inode_num = new_inode(EXT2_S_IFREG, src_file_size);
+    dst_file_inode_num = new_inode(dst_file_parent_inode_num, EXT2_S_IFREG, src_file_size);
+    if (dst_file_inode_num < 0) {
+        return ENOSPC;
+    }
     struct ext2_inode *dst_file_inode = inode_table + dst_file_inode_num - 1;
     
     
     /* -- copy datablock -- */
-    copy_to_inode_datablock(dst_file_inode, src_file, src_file_size);
+    if (dedup) {
+        copy_to_inode_datablock_dedup(dst_file_inode, src_file, src_file_size);
+    } else {
+        copy_to_inode_datablock(dst_file_inode, src_file, src_file_size);
+    }
     
     // add new file entry to dst parent dir entry
     add_to_dir_entry(dst_file_parent_inode, dst_file_inode_num, dst_file_name, EXT2_FT_REG_FILE);
-
+    
     
 }
@@ -0,0 +1,129 @@
+/*
+ This program takes one command line argument: the name of an ext2 formatted virtual disk. The program defragments the image offline: for each file, directory or symlink whose data blocks are scattered, it moves all of them into one contiguous run of free blocks (the indirect block placed right after the 12th data block), rewriting i_block[] and the indirect block, and frees the old blocks. Targets are picked best-fit from a map of free block runs built from the block bitmap. Passes are repeated while blocks freed by the previous pass let more files move.
+ Files sharing blocks through the dedup index (see ext2_cp -d) are left in place.
+ With "-n" (after the disk image argument) nothing is moved, the fragmented files are only reported.
+ The program outputs "Defragmented: inode [I] N extents" for each file moved (or "Fragmented: inode [I] N extents" with "-n"), then "X files defragmented, Y still fragmented".
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "ext2.h"
+
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include "ext2_utils.h"
+#include "ext2_io.h"
+
+// Max number of defrag passes over inode table
+#define DEFRAG_MAX_PASSES 4
+
+unsigned char *disk;
+
+struct ext2_super_block *sb;
+struct ext2_group_desc *gdt;
+unsigned char *block_bitmap;
+unsigned char *inode_bitmap;
+struct ext2_inode *inode_table;
+
+/*
+ *  Check if inode is a live file, dir or symlink worth defragmenting.
+ */
+int is_live_inode(int inode_num) {
+    struct ext2_inode *inode = inode_table + inode_num - 1;
+    int bit = inode_num - 1;
+    
+    if (inode_num != EXT2_ROOT_INO && inode_num < EXT2_GOOD_OLD_FIRST_INO) {
+        return 0;
+    }
+    if (!(inode_bitmap[bit / 8] >> (bit % 8) & 1) || inode->i_dtime != 0) {
+        return 0;
+    }
+    return (inode->i_mode & 0xF000) == EXT2_S_IFREG ||
+           (inode->i_mode & 0xF000) == EXT2_S_IFDIR ||
+           (inode->i_mode & 0xF000) == EXT2_S_IFLNK;
+}
+
+int main(int argc, const char * argv[]) {
+    // "--stats" prints hot path counters on exit
+    ext2_stats_parse_flag(&argc, argv);
+    // files are read and rewritten in block order
+    ext2_io_set_access(EXT2_IO_ACCESS_SEQUENTIAL);
+    // "--io=", "--cache=", "--access=" and "--map=" set up the block backend
+    if (ext2_io_parse_flags(&argc, argv)) {
+        fprintf(stderr, "Invalid --io, --cache, --access or --map value\n");
+        exit(1);
+    }
+    
+    // if -n flag set, this will be set to 1
+    int report_only = 0;
+    
+    if (argc == 3 && strcmp("-n", argv[2]) == 0) {
+        report_only = 1;
+    }
+    
+    if(argc != 2 + report_only) {
+        fprintf(stderr, "Usage: <image file name> [-n]\n");
+        exit(1);
+    }
+    // open disk img through block backend, written back on exit
+    if (ext2_io_open(argv[1], 1)) {
+        perror(argv[1]);
+        exit(1);
+    }
+    
+    // shared blocks must stay in place
+    if (dedup_load(argv[1], 0)) {
+        fprintf(stderr, "Invalid dedup index\n");
+        exit(1);
+    }
+    
+    int num_moved = 0;
+    int num_fragmented = 0;
+    int inode_num;
+    int pass;
+    
+    for (pass = 0; pass < DEFRAG_MAX_PASSES; pass++) {
+        struct free_extent *extents;
+        int num_extents = build_free_extents(&extents);
+        int num_moved_pass = 0;
+        num_fragmented = 0;
+        
+        for (inode_num = 1; inode_num <= sb->s_inodes_count; inode_num++) {
+            if (!is_live_inode(inode_num)) {
+                continue;
+            }
+            int num_file_extents = count_extents(inode_table + inode_num - 1);
+            if (report_only) {
+                if (num_file_extents > 1) {
+                    printf("Fragmented: inode [%d] %d extents\n", inode_num, num_file_extents);
+                    num_fragmented++;
+                }
+                continue;
+            }
+            
+            int rs = defrag_inode(inode_num, extents, num_extents);
+            if (rs == 1) {
+                printf("Defragmented: inode [%d] %d extents\n", inode_num, num_file_extents);
+                num_moved_pass++;
+            } else if (rs < 0) {
+                num_fragmented++;
+            }
+        }
+        
+        free(extents);
+        num_moved += num_moved_pass;
+        if (report_only || num_moved_pass == 0 || num_fragmented == 0) {
+            break;
+        }
+    }
+    
+    printf("%d files defragmented, %d still fragmented\n", num_moved, num_fragmented);
+    
+    return 0;
+}
@@ -0,0 +1,364 @@
+/*
+ This program replicates an image as the blocks that changed since a base copy. "ext2_delta create <base image> <new image> > delta" writes to stdout the blocks needed to turn base into new: metadata blocks (superblock up to end of inode table) that differ, and blocks allocated in new whose content differs from base. Blocks free in new are never read nor sent, so the delta is proportional to what changed. With "-c" (or "--checksum") after "create", each block is followed by a checksum, verified on apply. "ext2_delta apply <base image> <delta>" ("-" for stdin) checks the delta was made against this base (a fingerprint of its metadata blocks) and is complete, then writes the blocks in place and flushes them. Nothing is written if any check fails. Free blocks of the result may differ from new, the file system in them is the same. Images must have the same geometry. With "--stats" (anywhere) the blocks read and sent (or applied) are printed to stderr on exit.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "ext2.h"
+
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/resource.h>
+
+#define DELTA_MAGIC    "EXT2DLTA"
+#define DELTA_CHECKSUM 0x1          /* flags: a checksum follows each block */
+#define DELTA_END      0xFFFFFFFFu  /* block_num of last record */
+
+struct delta_header {
+    char               magic[8];
+    unsigned int       block_size;
+    unsigned int       blocks_count;
+    unsigned int       flags;
+    unsigned int       meta_blocks;     // blocks 0 up to end of inode table
+    unsigned long long base_hash;       // of base metadata blocks
+};
+
+/*
+ *  A run of num_blocks blocks from block_num on, followed by their
+ *      content (and checksums). Last record is DELTA_END with the
+ *      number of blocks in the delta as num_blocks.
+ */
+struct delta_record {
+    unsigned int block_num;
+    unsigned int num_blocks;
+};
+
+/* Counters printed on exit with "--stats" */
+struct delta_stats {
+    unsigned long blocks_read;      /* image blocks compared, or delta blocks read */
+    unsigned long blocks_sent;      /* blocks written to delta */
+    unsigned long blocks_written;   /* blocks written in place by apply */
+    unsigned long records;          /* runs of blocks in delta */
+};
+static struct delta_stats delta_stats;
+static struct rusage delta_start_usage;
+
+/* One image mapped read only */
+struct delta_image {
+    unsigned char           *disk;
+    size_t                   size;
+    struct ext2_super_block *sb;
+    struct ext2_group_desc  *gdt;
+    unsigned char           *block_bitmap;
+    int                      meta_blocks;
+};
+
+int delta_image_open(struct delta_image *image, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    
+    if (fd < 0 || fstat(fd, &st) == -1) {
+        return -1;
+    }
+    if (st.st_size < 3 * EXT2_BLOCK_SIZE) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    image->size = st.st_size;
+    image->disk = mmap(NULL, image->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image->disk == MAP_FAILED) {
+        return -1;
+    }
+    // read front to back, once
+    madvise(image->disk, image->size, MADV_SEQUENTIAL);
+    
+    image->sb = (struct ext2_super_block *)(image->disk + EXT2_BLOCK_SIZE);
+    image->gdt = (struct ext2_group_desc *)(image->disk + EXT2_BLOCK_SIZE + sizeof(struct ext2_super_block));
+    if (image->sb->s_magic != 0xEF53 ||
+        (size_t)image->sb->s_blocks_count * EXT2_BLOCK_SIZE > image->size) {
+        errno = EINVAL;
+        return -1;
+    }
+    image->block_bitmap = image->disk + image->gdt->bg_block_bitmap * EXT2_BLOCK_SIZE;
+    image->meta_blocks = image->gdt->bg_inode_table +
+        (image->sb->s_inodes_count * sizeof(struct ext2_inode) + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    if (image->meta_blocks > image->sb->s_blocks_count) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ *  FNV-1a over 64 bits words, seeded with hash.
+ */
+unsigned long long delta_hash(unsigned long long hash, unsigned char *data, size_t len) {
+    unsigned long long *words = (unsigned long long *)data;
+    size_t i;
+    
+    for (i = 0; i < len / 8; i++) {
+        hash = (hash ^ words[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ *  Check if a block is to be sent: metadata that differs, or allocated
+ *      in new and different in base.
+ */
+int block_changed(struct delta_image *base, struct delta_image *new, int block_num) {
+    int bit = block_num - new->sb->s_first_data_block;
+    
+    if (block_num >= new->meta_blocks &&
+        !(new->block_bitmap[bit / 8] >> (bit % 8) & 1)) {
+        return 0;
+    }
+    size_t off = (size_t)block_num * EXT2_BLOCK_SIZE;
+    delta_stats.blocks_read++;
+    return memcmp(base->disk + off, new->disk + off, EXT2_BLOCK_SIZE) != 0;
+}
+
+int delta_create(const char *base_path, const char *new_path, int checksum) {
+    struct delta_image base, new;
+    struct delta_header header;
+    struct delta_record record;
+    unsigned int num_sent = 0;
+    int block_num;
+    
+    if (delta_image_open(&base, base_path)) {
+        perror(base_path);
+        return 1;
+    }
+    if (delta_image_open(&new, new_path)) {
+        perror(new_path);
+        return 1;
+    }
+    if (base.sb->s_blocks_count != new.sb->s_blocks_count ||
+        base.sb->s_first_data_block != new.sb->s_first_data_block ||
+        base.meta_blocks != new.meta_blocks) {
+        fprintf(stderr, "Images differ in geometry\n");
+        return 1;
+    }
+    
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DELTA_MAGIC, 8);
+    header.block_size = EXT2_BLOCK_SIZE;
+    header.blocks_count = new.sb->s_blocks_count;
+    header.flags = checksum ? DELTA_CHECKSUM : 0;
+    header.meta_blocks = new.meta_blocks;
+    header.base_hash = delta_hash(0xcbf29ce484222325ULL, base.disk, (size_t)base.meta_blocks * EXT2_BLOCK_SIZE);
+    fwrite(&header, sizeof(header), 1, stdout);
+    
+    block_num = 0;
+    while (block_num < new.sb->s_blocks_count) {
+        int bit = block_num - new.sb->s_first_data_block;
+        // skip a whole word of bits free in new
+        if (block_num >= new.meta_blocks && bit % 32 == 0 &&
+            block_num + 32 <= new.sb->s_blocks_count &&
+            ((unsigned int *)new.block_bitmap)[bit / 32] == 0) {
+            block_num += 32;
+            continue;
+        }
+        if (!block_changed(&base, &new, block_num)) {
+            block_num++;
+            continue;
+        }
+        
+        // one record per run of changed blocks
+        int run_end = block_num + 1;
+        while (run_end < new.sb->s_blocks_count && block_changed(&base, &new, run_end)) {
+            run_end++;
+        }
+        record.block_num = block_num;
+        record.num_blocks = run_end - block_num;
+        fwrite(&record, sizeof(record), 1, stdout);
+        fwrite(new.disk + (size_t)block_num * EXT2_BLOCK_SIZE, EXT2_BLOCK_SIZE, record.num_blocks, stdout);
+        if (checksum) {
+            for (; block_num < run_end; block_num++) {
+                unsigned long long hash = delta_hash(0xcbf29ce484222325ULL,
+                                                     new.disk + (size_t)block_num * EXT2_BLOCK_SIZE, EXT2_BLOCK_SIZE);
+                fwrite(&hash, sizeof(hash), 1, stdout);
+            }
+        }
+        num_sent += record.num_blocks;
+        delta_stats.blocks_sent += record.num_blocks;
+        delta_stats.records++;
+        block_num = run_end;
+    }
+    
+    record.block_num = DELTA_END;
+    record.num_blocks = num_sent;
+    fwrite(&record, sizeof(record), 1, stdout);
+    if (fflush(stdout) == EOF || ferror(stdout)) {
+        perror("write");
+        return 1;
+    }
+    fprintf(stderr, "%u of %u blocks changed\n", num_sent, new.sb->s_blocks_count);
+    return 0;
+}
+
+int delta_apply(const char *base_path, const char *delta_path) {
+    struct delta_image base;
+    struct delta_header header;
+    struct delta_record record;
+    FILE *delta = strcmp(delta_path, "-") == 0 ? stdin : fopen(delta_path, "r");
+    unsigned char *blocks = NULL;
+    size_t blocks_cap = 0;
+    size_t num_blocks = 0;
+    struct delta_record *records = NULL;
+    int num_records = 0;
+    int records_cap = 0;
+    int i;
+    
+    if (delta == NULL) {
+        perror(delta_path);
+        return 1;
+    }
+    if (delta_image_open(&base, base_path)) {
+        perror(base_path);
+        return 1;
+    }
+    if (fread(&header, sizeof(header), 1, delta) != 1 ||
+        memcmp(header.magic, DELTA_MAGIC, 8) != 0 ||
+        header.block_size != EXT2_BLOCK_SIZE) {
+        fprintf(stderr, "Invalid delta\n");
+        return 1;
+    }
+    if (header.blocks_count != base.sb->s_blocks_count ||
+        header.meta_blocks != base.meta_blocks ||
+        header.base_hash != delta_hash(0xcbf29ce484222325ULL, base.disk, (size_t)base.meta_blocks * EXT2_BLOCK_SIZE)) {
+        fprintf(stderr, "Delta was not made against this image\n");
+        return 1;
+    }
+    
+    // whole delta read and checked before a block is written
+    for (;;) {
+        if (fread(&record, sizeof(record), 1, delta) != 1) {
+            fprintf(stderr, "Delta is truncated\n");
+            return 1;
+        }
+        if (record.block_num == DELTA_END) {
+            break;
+        }
+        if (record.num_blocks == 0 || record.block_num >= header.blocks_count ||
+            record.num_blocks > header.blocks_count - record.block_num) {
+            fprintf(stderr, "Invalid delta\n");
+            return 1;
+        }
+        if (num_records == records_cap) {
+            records_cap = records_cap * 2 + 64;
+            records = realloc(records, sizeof(struct delta_record) * records_cap);
+        }
+        records[num_records++] = record;
+        
+        if ((num_blocks + record.num_blocks) * EXT2_BLOCK_SIZE > blocks_cap) {
+            blocks_cap = (num_blocks + record.num_blocks) * EXT2_BLOCK_SIZE * 2;
+            blocks = realloc(blocks, blocks_cap);
+        }
+        unsigned char *data = blocks + num_blocks * EXT2_BLOCK_SIZE;
+        if (fread(data, EXT2_BLOCK_SIZE, record.num_blocks, delta) != record.num_blocks) {
+            fprintf(stderr, "Delta is truncated\n");
+            return 1;
+        }
+        if (header.flags & DELTA_CHECKSUM) {
+            for (i = 0; i < record.num_blocks; i++) {
+                unsigned long long hash;
+                if (fread(&hash, sizeof(hash), 1, delta) != 1) {
+                    fprintf(stderr, "Delta is truncated\n");
+                    return 1;
+                }
+                if (hash != delta_hash(0xcbf29ce484222325ULL, data + (size_t)i * EXT2_BLOCK_SIZE, EXT2_BLOCK_SIZE)) {
+                    fprintf(stderr, "Checksum mismatch on block %u\n", record.block_num + i);
+                    return 1;
+                }
+            }
+        }
+        num_blocks += record.num_blocks;
+        delta_stats.blocks_read += record.num_blocks;
+        delta_stats.records++;
+    }
+    if (record.num_blocks != num_blocks) {
+        fprintf(stderr, "Delta is truncated\n");
+        return 1;
+    }
+    
+    /* -- write in place -- */
+    int fd = open(base_path, O_RDWR);
+    if (fd < 0) {
+        perror(base_path);
+        return 1;
+    }
+    unsigned char *data = blocks;
+    for (i = 0; i < num_records; i++) {
+        size_t len = (size_t)records[i].num_blocks * EXT2_BLOCK_SIZE;
+        if (pwrite(fd, data, len, (off_t)records[i].block_num * EXT2_BLOCK_SIZE) != (ssize_t)len) {
+            perror("pwrite");
+            return 1;
+        }
+        delta_stats.blocks_written += records[i].num_blocks;
+        data += len;
+    }
+    if (fdatasync(fd) == -1) {
+        perror("fdatasync");
+        return 1;
+    }
+    close(fd);
+    fprintf(stderr, "%zu blocks applied\n", num_blocks);
+    return 0;
+}
+
+void delta_stats_print_at_exit(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    
+    fprintf(stderr, "%-28s%lu\n", "blocks read:", delta_stats.blocks_read);
+    fprintf(stderr, "%-28s%lu\n", "blocks sent:", delta_stats.blocks_sent);
+    fprintf(stderr, "%-28s%lu\n", "blocks written:", delta_stats.blocks_written);
+    fprintf(stderr, "%-28s%lu\n", "records:", delta_stats.records);
+    fprintf(stderr, "%-28s%ld/%ld\n", "page faults (minor/major):",
+            usage.ru_minflt - delta_start_usage.ru_minflt,
+            usage.ru_majflt - delta_start_usage.ru_majflt);
+}
+
+int main(int argc, const char * argv[]) {
+    int stats = 0;
+    int i;
+    int j = 1;
+    
+    // "--stats" prints counters on exit
+    for (i = 1; i < argc; i++) {
+        if (strcmp("--stats", argv[i]) == 0) {
+            stats = 1;
+        } else {
+            argv[j++] = argv[i];
+        }
+    }
+    argc = j;
+    if (stats) {
+        getrusage(RUSAGE_SELF, &delta_start_usage);
+        atexit(delta_stats_print_at_exit);
+    }
+    
+    if (argc >= 2 && strcmp(argv[1], "create") == 0) {
+        int checksum = argc == 5 && (strcmp(argv[2], "-c") == 0 || strcmp(argv[2], "--checksum") == 0);
+        if (argc != 4 + checksum) {
+            fprintf(stderr, "Usage: create [-c] [--stats] <base image> <new image> > <delta>\n");
+            exit(1);
+        }
+        return delta_create(argv[2 + checksum], argv[3 + checksum], checksum);
+    }
+    if (argc == 4 && strcmp(argv[1], "apply") == 0) {
+        return delta_apply(argv[2], argv[3]);
+    }
+    fprintf(stderr, "Usage: create [-c] [--stats] <base image> <new image> > <delta>\n"
+                    "       apply [--stats] <base image> <delta>\n");
+    exit(1);
+}
@@ -0,0 +1,445 @@
+/*
+ This program takes two command line arguments: the names of two ext2 formatted virtual disks, usually snapshots of one image taken at different times. It lists the files added, removed and modified from the first image to the second, one per line, sorted by path: "A <path>" for added, "D <path>" for removed, "M <path>" for modified, dirs with a trailing '/'. A file whose path now names another inode is listed as modified. A dir whose only change is its entries is not listed, the entries are.
+ Both images are mapped read only. Block bitmaps and inode tables are compared first, then only blocks allocated in both images are compared, in runs of consecutive blocks, so free space is never read. Changed blocks are mapped back to the inodes holding them, and inodes to paths by walking the directory tree of each image. Images must have the same geometry.
+ Exit status is 0 if no file differs, 1 if some do, 2 on error. With "--stats" (anywhere) the blocks and inodes compared are printed to stderr on exit.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "ext2.h"
+
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/resource.h>
+
+/* Counters printed on exit with "--stats" */
+struct diff_stats {
+    unsigned long blocks_compared;  /* blocks memcmp'd, per image */
+    unsigned long blocks_changed;   /* allocated in both, content differs */
+    unsigned long inodes_compared;  /* inodes used in either image */
+    unsigned long inodes_changed;
+};
+static struct diff_stats diff_stats;
+static struct rusage diff_start_usage;
+
+/* One image mapped read only */
+struct diff_image {
+    unsigned char            *disk;
+    size_t                    size;
+    struct ext2_super_block  *sb;
+    struct ext2_group_desc   *gdt;
+    unsigned char            *block_bitmap;
+    unsigned char            *inode_bitmap;
+    struct ext2_inode        *inode_table;
+};
+
+/* A path found walking the tree of an image */
+struct diff_path {
+    char *path;
+    int   inode_num;
+    int   is_dir;
+};
+
+struct diff_paths {
+    struct diff_path *paths;
+    int               num_paths;
+    int               cap;
+};
+
+/*
+ *  Map image at path read only and set up pointers to its metadata.
+ *  Return: int
+ *      -1 if image can't be opened or isn't ext2
+ *       0 if success
+ */
+int diff_image_open(struct diff_image *image, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    
+    if (fd < 0 || fstat(fd, &st) == -1) {
+        return -1;
+    }
+    if (st.st_size < 3 * EXT2_BLOCK_SIZE) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    image->size = st.st_size;
+    image->disk = mmap(NULL, image->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image->disk == MAP_FAILED) {
+        return -1;
+    }
+    // read front to back, once
+    madvise(image->disk, image->size, MADV_SEQUENTIAL);
+    
+    image->sb = (struct ext2_super_block *)(image->disk + EXT2_BLOCK_SIZE);
+    image->gdt = (struct ext2_group_desc *)(image->disk + EXT2_BLOCK_SIZE + sizeof(struct ext2_super_block));
+    if (image->sb->s_magic != 0xEF53 ||
+        (size_t)image->sb->s_blocks_count * EXT2_BLOCK_SIZE > image->size) {
+        errno = EINVAL;
+        return -1;
+    }
+    image->block_bitmap = image->disk + image->gdt->bg_block_bitmap * EXT2_BLOCK_SIZE;
+    image->inode_bitmap = image->disk + image->gdt->bg_inode_bitmap * EXT2_BLOCK_SIZE;
+    image->inode_table = (struct ext2_inode *)(image->disk + image->gdt->bg_inode_table * EXT2_BLOCK_SIZE);
+    return 0;
+}
+
+int bit_is_set(unsigned char *bitmap, int bit) {
+    return bitmap[bit / 8] >> (bit % 8) & 1;
+}
+
+int inode_is_used(struct diff_image *image, int inode_num) {
+    return bit_is_set(image->inode_bitmap, inode_num - 1) &&
+           image->inode_table[inode_num - 1].i_dtime == 0;
+}
+
+/*
+ *  Put datablocks of an inode in blocks, indirect block last. Block
+ *      numbers out of image are dropped.
+ *  Return: int
+ *      number of blocks put
+ */
+int inode_blocks(struct diff_image *image, int inode_num, int *blocks) {
+    struct ext2_inode *inode = image->inode_table + inode_num - 1;
+    int total_blocks = inode->i_blocks / 2;
+    int num_data_blocks = total_blocks > 12 ? total_blocks - 1 : total_blocks;
+    int num_blocks = 0;
+    int i;
+    
+    for (i = 0; i < num_data_blocks && i < 12; i++) {
+        blocks[num_blocks++] = inode->i_block[i];
+    }
+    if (num_data_blocks > 12 && inode->i_block[12] < image->sb->s_blocks_count) {
+        unsigned int *indirect_block = (unsigned int *)(image->disk + (size_t)inode->i_block[12] * EXT2_BLOCK_SIZE);
+        for (i = 12; i < num_data_blocks && i - 12 < EXT2_BLOCK_SIZE / 4; i++) {
+            blocks[num_blocks++] = indirect_block[i - 12];
+        }
+        blocks[num_blocks++] = inode->i_block[12];
+    }
+    
+    // drop garbage, a broken image shouldn't take us past the mapping
+    int num_valid = 0;
+    for (i = 0; i < num_blocks; i++) {
+        if (blocks[i] > 0 && blocks[i] < image->sb->s_blocks_count) {
+            blocks[num_valid++] = blocks[i];
+        }
+    }
+    return num_valid;
+}
+
+void paths_add(struct diff_paths *paths, const char *path, int inode_num, int is_dir) {
+    if (paths->num_paths == paths->cap) {
+        paths->cap = paths->cap * 2 + 64;
+        paths->paths = realloc(paths->paths, sizeof(struct diff_path) * paths->cap);
+    }
+    struct diff_path *entry = paths->paths + paths->num_paths++;
+    entry->path = strdup(path);
+    entry->inode_num = inode_num;
+    entry->is_dir = is_dir;
+}
+
+/*
+ *  Add path of every entry under dir to paths, recursively. visited
+ *      marks dirs already walked, so a corrupt tree can't loop.
+ */
+void walk_dir(struct diff_image *image, int dir_inode_num, char *path, int path_len,
+              unsigned char *visited, struct diff_paths *paths) {
+    int blocks[12 + EXT2_BLOCK_SIZE / 4 + 1];
+    int num_blocks = inode_blocks(image, dir_inode_num, blocks);
+    struct ext2_inode *dir_inode = image->inode_table + dir_inode_num - 1;
+    int i;
+    
+    visited[dir_inode_num] = 1;
+    // indirect block is no dir block
+    if (dir_inode->i_blocks / 2 > 12) {
+        num_blocks--;
+    }
+    for (i = 0; i < num_blocks; i++) {
+        unsigned char *block = image->disk + (size_t)blocks[i] * EXT2_BLOCK_SIZE;
+        int off = 0;
+        
+        while (off < EXT2_BLOCK_SIZE) {
+            struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(block + off);
+            if (entry->rec_len == 0) {
+                break;
+            }
+            off += entry->rec_len;
+            if (entry->inode == 0 || entry->inode > image->sb->s_inodes_count ||
+                (entry->name_len == 1 && entry->name[0] == '.') ||
+                (entry->name_len == 2 && entry->name[0] == '.' && entry->name[1] == '.') ||
+                path_len + 1 + entry->name_len >= PATH_MAX) {
+                continue;
+            }
+            
+            path[path_len] = '/';
+            memcpy(path + path_len + 1, entry->name, entry->name_len);
+            path[path_len + 1 + entry->name_len] = '\0';
+            int is_dir = entry->file_type == EXT2_FT_DIR;
+            paths_add(paths, path, entry->inode, is_dir);
+            if (is_dir && !visited[entry->inode]) {
+                walk_dir(image, entry->inode, path, path_len + 1 + entry->name_len, visited, paths);
+            }
+        }
+    }
+    path[path_len] = '\0';
+}
+
+int compare_path(const void *a, const void *b) {
+    return strcmp(((const struct diff_path *)a)->path, ((const struct diff_path *)b)->path);
+}
+
+void collect_paths(struct diff_image *image, struct diff_paths *paths) {
+    char path[PATH_MAX] = "";
+    unsigned char *visited = calloc(image->sb->s_inodes_count + 1, 1);
+    
+    memset(paths, 0, sizeof(struct diff_paths));
+    walk_dir(image, EXT2_ROOT_INO, path, 0, visited, paths);
+    qsort(paths->paths, paths->num_paths, sizeof(struct diff_path), compare_path);
+    free(visited);
+}
+
+/*
+ *  Mark in changed every block allocated in both images whose content
+ *      differs. Consecutive blocks allocated in both are compared as
+ *      one run, block by block only when the run differs. Metadata
+ *      blocks (up to end of inode table) are skipped, they are compared
+ *      as inodes.
+ */
+void compare_blocks(struct diff_image *a, struct diff_image *b, unsigned char *changed) {
+    int first_data_block = a->sb->s_first_data_block;
+    int inode_table_blocks = (a->sb->s_inodes_count * sizeof(struct ext2_inode) + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    int block_num = a->gdt->bg_inode_table + inode_table_blocks;
+    
+    while (block_num < a->sb->s_blocks_count) {
+        int bit = block_num - first_data_block;
+        // skip a whole word of bits free in either image
+        if (bit % 32 == 0 && block_num + 32 <= a->sb->s_blocks_count &&
+            (((unsigned int *)a->block_bitmap)[bit / 32] & ((unsigned int *)b->block_bitmap)[bit / 32]) == 0) {
+            block_num += 32;
+            continue;
+        }
+        if (!bit_is_set(a->block_bitmap, bit) || !bit_is_set(b->block_bitmap, bit)) {
+            block_num++;
+            continue;
+        }
+        
+        int run_end = block_num + 1;
+        while (run_end < a->sb->s_blocks_count &&
+               bit_is_set(a->block_bitmap, run_end - first_data_block) &&
+               bit_is_set(b->block_bitmap, run_end - first_data_block)) {
+            run_end++;
+        }
+        size_t off = (size_t)block_num * EXT2_BLOCK_SIZE;
+        size_t len = (size_t)(run_end - block_num) * EXT2_BLOCK_SIZE;
+        diff_stats.blocks_compared += run_end - block_num;
+        if (memcmp(a->disk + off, b->disk + off, len) != 0) {
+            for (; block_num < run_end; block_num++, off += EXT2_BLOCK_SIZE) {
+                if (memcmp(a->disk + off, b->disk + off, EXT2_BLOCK_SIZE) != 0) {
+                    changed[block_num] = 1;
+                    diff_stats.blocks_changed++;
+                }
+            }
+        }
+        block_num = run_end;
+    }
+}
+
+/*
+ *  Check if content of an inode is the same in both images, its blocks
+ *      may have moved (defrag). Blocks at same place are only read if
+ *      marked in changed_blocks.
+ */
+int same_content(struct diff_image *a, struct diff_image *b, int inode_num,
+                 unsigned char *changed_blocks) {
+    int blocks_a[12 + EXT2_BLOCK_SIZE / 4 + 1];
+    int blocks_b[12 + EXT2_BLOCK_SIZE / 4 + 1];
+    int num_blocks_a = inode_blocks(a, inode_num, blocks_a);
+    int num_blocks_b = inode_blocks(b, inode_num, blocks_b);
+    int i;
+    
+    if (num_blocks_a != num_blocks_b) {
+        return 0;
+    }
+    // indirect block, last, is compared through the blocks it maps
+    if (b->inode_table[inode_num - 1].i_blocks / 2 > 12) {
+        num_blocks_b--;
+    }
+    for (i = 0; i < num_blocks_b; i++) {
+        if (blocks_a[i] == blocks_b[i] && !changed_blocks[blocks_b[i]]) {
+            continue;
+        }
+        diff_stats.blocks_compared++;
+        if (memcmp(a->disk + (size_t)blocks_a[i] * EXT2_BLOCK_SIZE,
+                   b->disk + (size_t)blocks_b[i] * EXT2_BLOCK_SIZE, EXT2_BLOCK_SIZE) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ *  Mark in changed every inode whose bitmap bit, inode fields or
+ *      content differ between the images. An inode whose blocks only
+ *      moved isn't changed.
+ */
+void compare_inodes(struct diff_image *a, struct diff_image *b,
+                    unsigned char *changed_blocks, unsigned char *changed) {
+    int inode_num;
+    
+    for (inode_num = 1; inode_num <= a->sb->s_inodes_count; inode_num++) {
+        int used_a = inode_is_used(a, inode_num);
+        int used_b = inode_is_used(b, inode_num);
+        if (!used_a && !used_b) {
+            continue;
+        }
+        diff_stats.inodes_compared++;
+        if (used_a != used_b) {
+            changed[inode_num] = 1;
+            continue;
+        }
+        
+        // fields but block map first
+        struct ext2_inode inode_a = a->inode_table[inode_num - 1];
+        struct ext2_inode inode_b = b->inode_table[inode_num - 1];
+        int same_map = memcmp(inode_a.i_block, inode_b.i_block, sizeof(inode_a.i_block)) == 0;
+        memset(inode_a.i_block, 0, sizeof(inode_a.i_block));
+        memset(inode_b.i_block, 0, sizeof(inode_b.i_block));
+        if (memcmp(&inode_a, &inode_b, sizeof(struct ext2_inode)) != 0) {
+            changed[inode_num] = 1;
+            continue;
+        }
+        // fast symlink keeps its target in block map
+        if ((inode_b.i_mode & 0xF000) == EXT2_S_IFLNK && inode_b.i_blocks == 0) {
+            changed[inode_num] = !same_map;
+            continue;
+        }
+        if (!same_content(a, b, inode_num, changed_blocks)) {
+            changed[inode_num] = 1;
+        }
+    }
+}
+
+void print_path(char status, struct diff_path *entry) {
+    printf("%c %s%s\n", status, entry->path, entry->is_dir ? "/" : "");
+}
+
+void diff_stats_print_at_exit(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    
+    fprintf(stderr, "%-28s%lu\n", "blocks compared:", diff_stats.blocks_compared);
+    fprintf(stderr, "%-28s%lu\n", "blocks changed:", diff_stats.blocks_changed);
+    fprintf(stderr, "%-28s%lu\n", "inodes compared:", diff_stats.inodes_compared);
+    fprintf(stderr, "%-28s%lu\n", "inodes changed:", diff_stats.inodes_changed);
+    fprintf(stderr, "%-28s%ld/%ld\n", "page faults (minor/major):",
+            usage.ru_minflt - diff_start_usage.ru_minflt,
+            usage.ru_majflt - diff_start_usage.ru_majflt);
+}
+
+int main(int argc, const char * argv[]) {
+    struct diff_image a, b;
+    int stats = 0;
+    int i;
+    int j = 1;
+    
+    // "--stats" prints counters on exit
+    for (i = 1; i < argc; i++) {
+        if (strcmp("--stats", argv[i]) == 0) {
+            stats = 1;
+        } else {
+            argv[j++] = argv[i];
+        }
+    }
+    argc = j;
+    if (stats) {
+        getrusage(RUSAGE_SELF, &diff_start_usage);
+        atexit(diff_stats_print_at_exit);
+    }
+    
+    if (argc != 3) {
+        fprintf(stderr, "Usage: <image file name> <image file name>\n");
+        exit(2);
+    }
+    if (diff_image_open(&a, argv[1])) {
+        perror(argv[1]);
+        exit(2);
+    }
+    if (diff_image_open(&b, argv[2])) {
+        perror(argv[2]);
+        exit(2);
+    }
+    if (a.sb->s_blocks_count != b.sb->s_blocks_count ||
+        a.sb->s_inodes_count != b.sb->s_inodes_count ||
+        a.sb->s_first_data_block != b.sb->s_first_data_block ||
+        a.gdt->bg_block_bitmap != b.gdt->bg_block_bitmap ||
+        a.gdt->bg_inode_bitmap != b.gdt->bg_inode_bitmap ||
+        a.gdt->bg_inode_table != b.gdt->bg_inode_table) {
+        fprintf(stderr, "Images differ in geometry\n");
+        exit(2);
+    }
+    
+    /* -- changed blocks, then inodes holding them -- */
+    unsigned char *changed_blocks = calloc(a.sb->s_blocks_count, 1);
+    unsigned char *changed_inodes = calloc(a.sb->s_inodes_count + 1, 1);
+    compare_blocks(&a, &b, changed_blocks);
+    compare_inodes(&a, &b, changed_blocks, changed_inodes);
+    
+    // a changed entry changes its dir inode, no tree walk needed if none
+    int inode_num;
+    for (inode_num = 1; inode_num <= a.sb->s_inodes_count; inode_num++) {
+        diff_stats.inodes_changed += changed_inodes[inode_num];
+    }
+    if (diff_stats.inodes_changed == 0) {
+        return 0;
+    }
+    
+    /* -- paths of both trees, merged in path order -- */
+    struct diff_paths paths_a, paths_b;
+    collect_paths(&a, &paths_a);
+    collect_paths(&b, &paths_b);
+    
+    int num_diffs = 0;
+    i = 0;
+    j = 0;
+    while (i < paths_a.num_paths || j < paths_b.num_paths) {
+        int cmp;
+        if (i == paths_a.num_paths) {
+            cmp = 1;
+        } else if (j == paths_b.num_paths) {
+            cmp = -1;
+        } else {
+            cmp = strcmp(paths_a.paths[i].path, paths_b.paths[j].path);
+        }
+        
+        if (cmp < 0) {
+            print_path('D', paths_a.paths + i++);
+            num_diffs++;
+        } else if (cmp > 0) {
+            print_path('A', paths_b.paths + j++);
+            num_diffs++;
+        } else {
+            struct diff_path *entry_a = paths_a.paths + i++;
+            struct diff_path *entry_b = paths_b.paths + j++;
+            if (entry_a->is_dir != entry_b->is_dir) {
+                // type changed, old one gone and new one there
+                print_path('D', entry_a);
+                print_path('A', entry_b);
+                num_diffs++;
+            } else if (!entry_b->is_dir &&
+                       (entry_a->inode_num != entry_b->inode_num || changed_inodes[entry_b->inode_num])) {
+                print_path('M', entry_b);
+                num_diffs++;
+            }
+        }
+    }
+    
+    return num_diffs ? 1 : 0;
+}
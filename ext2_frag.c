@@ -0,0 +1,326 @@
+/*
+ This program takes one command line argument: the name of an ext2 formatted virtual disk. The program makes one pass over the inode table and the bitmaps and reports the layout quality of the image: free/used counts, extents per file, a histogram of free block run lengths, directory block utilization (bytes taken by live entries over bytes in directory blocks), the locality of top level subtrees (blocks spanned from lowest to highest block of each subtree over blocks it uses, 1.00 if packed) and the most fragmented files. Nothing is written to the image.
+ With "--json" (after the disk image argument) the report is printed as one JSON object, listing every file with its inode number, type, allocated blocks and extents.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "ext2.h"
+
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include "ext2_utils.h"
+#include "ext2_io.h"
+
+// Number of files listed as worst fragmented
+#define FRAG_WORST_COUNT 10
+// Number of power of two buckets in free run histogram
+#define FRAG_HIST_BUCKETS 16
+
+unsigned char *disk;
+
+struct ext2_super_block *sb;
+struct ext2_group_desc *gdt;
+unsigned char *block_bitmap;
+unsigned char *inode_bitmap;
+struct ext2_inode *inode_table;
+
+struct file_layout {
+    int  inode_num;
+    char type;
+    int  num_blocks;
+    int  num_extents;
+};
+
+/*
+ *  Type char of inode, 0 if it is not a file, dir or symlink.
+ */
+char inode_type_char(struct ext2_inode *inode) {
+    switch (inode->i_mode & 0xF000) {
+        case EXT2_S_IFREG:
+            return 'f';
+        case EXT2_S_IFDIR:
+            return 'd';
+        case EXT2_S_IFLNK:
+            return 'l';
+        default:
+            return 0;
+    }
+}
+
+/*
+ *  Add bytes taken by live entries in each datablock of dir to used_bytes,
+ *      and number of datablocks to num_blocks.
+ */
+void dir_utilization(struct ext2_inode *dir_inode, long *used_bytes, long *num_blocks) {
+    int *block_array = read_i_block_into_array(dir_inode);
+    int i;
+    
+    prefetch_block_array(block_array);
+    for (i = 0; block_array[i] != -1; i++) {
+        unsigned char *block = ext2_block_get(block_array[i]);
+        int off = 0;
+        
+        while (off < EXT2_BLOCK_SIZE) {
+            struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(block + off);
+            if (entry->rec_len == 0) {
+                break;
+            }
+            if (entry->inode != 0) {
+                *used_bytes += EXT2_DIR_REC_LEN(entry->name_len);
+            }
+            off += entry->rec_len;
+        }
+        ext2_block_put(block_array[i], 0);
+        (*num_blocks)++;
+    }
+    free(block_array);
+}
+
+/*
+ *  Widen [*min_block, *max_block] over datablocks of inode and, for a
+ *      dir, of everything under it, adding their number to num_blocks.
+ */
+void subtree_span(int inode_num, int *min_block, int *max_block, long *num_blocks) {
+    struct ext2_inode *inode = inode_table + inode_num - 1;
+    int is_dir = (inode->i_mode & 0xF000) == EXT2_S_IFDIR;
+    int i;
+    
+    if (is_fast_symlink(inode)) {
+        return;
+    }
+    int *block_array = read_i_block_into_array(inode);
+    prefetch_block_array(block_array);
+    for (i = 0; block_array[i] != -1; i++) {
+        if (*min_block < 0 || block_array[i] < *min_block) {
+            *min_block = block_array[i];
+        }
+        if (block_array[i] > *max_block) {
+            *max_block = block_array[i];
+        }
+        (*num_blocks)++;
+        if (!is_dir) {
+            continue;
+        }
+        
+        unsigned char *block = ext2_block_get(block_array[i]);
+        int off = 0;
+        while (off < EXT2_BLOCK_SIZE) {
+            struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(block + off);
+            if (entry->rec_len == 0) {
+                break;
+            }
+            int is_dot = entry->name[0] == '.' &&
+                         (entry->name_len == 1 || (entry->name_len == 2 && entry->name[1] == '.'));
+            if (entry->inode != 0 && !is_dot) {
+                subtree_span(entry->inode, min_block, max_block, num_blocks);
+            }
+            off += entry->rec_len;
+        }
+        ext2_block_put(block_array[i], 0);
+    }
+    free(block_array);
+}
+
+/*
+ *  Sort most extents first, ties by more blocks first.
+ */
+int compare_fragmentation(const void *a, const void *b) {
+    const struct file_layout *fa = a;
+    const struct file_layout *fb = b;
+    
+    if (fa->num_extents != fb->num_extents) {
+        return fb->num_extents - fa->num_extents;
+    }
+    return fb->num_blocks - fa->num_blocks;
+}
+
+int main(int argc, const char * argv[]) {
+    // "--stats" prints hot path counters on exit
+    ext2_stats_parse_flag(&argc, argv);
+    // "--io=", "--cache=", "--access=" and "--map=" set up the block backend
+    if (ext2_io_parse_flags(&argc, argv)) {
+        fprintf(stderr, "Invalid --io, --cache, --access or --map value\n");
+        exit(1);
+    }
+    
+    // if --json flag set, this will be set to 1
+    int json = 0;
+    
+    if (argc == 3 && strcmp("--json", argv[2]) == 0) {
+        json = 1;
+    }
+    
+    if(argc != 2 + json) {
+        fprintf(stderr, "Usage: <image file name> [--json]\n");
+        exit(1);
+    }
+    // open disk img through block backend, never written
+    if (ext2_io_open(argv[1], 0)) {
+        perror(argv[1]);
+        exit(1);
+    }
+    
+    // One pass over inode table
+    struct file_layout *files = malloc(sizeof(struct file_layout) * sb->s_inodes_count);
+    int num_files = 0;
+    int num_fragmented = 0;
+    long total_extents = 0;
+    long dir_used_bytes = 0;
+    long dir_num_blocks = 0;
+    int inode_num;
+    
+    for (inode_num = 1; inode_num <= sb->s_inodes_count; inode_num++) {
+        struct ext2_inode *inode = inode_table + inode_num - 1;
+        int bit = inode_num - 1;
+        
+        if (inode_num != EXT2_ROOT_INO && inode_num < EXT2_GOOD_OLD_FIRST_INO) {
+            continue;
+        }
+        if (!(inode_bitmap[bit / 8] >> (bit % 8) & 1) || inode->i_dtime != 0) {
+            continue;
+        }
+        char type = inode_type_char(inode);
+        if (type == 0) {
+            continue;
+        }
+        
+        struct file_layout *file = files + num_files++;
+        file->inode_num = inode_num;
+        file->type = type;
+        file->num_blocks = is_fast_symlink(inode) ? 0 : inode->i_blocks / 2;
+        file->num_extents = count_extents(inode);
+        total_extents += file->num_extents;
+        if (file->num_extents > 1) {
+            num_fragmented++;
+        }
+        if (type == 'd') {
+            dir_utilization(inode, &dir_used_bytes, &dir_num_blocks);
+        }
+    }
+    
+    // Free runs, bucket i holds runs of length [2^i, 2^(i+1))
+    struct free_extent *extents;
+    int num_free_runs = build_free_extents(&extents);
+    int histogram[FRAG_HIST_BUCKETS] = {0};
+    int largest_free_run = 0;
+    int i;
+    
+    for (i = 0; i < num_free_runs; i++) {
+        int bucket = 31 - __builtin_clz(extents[i].len);
+        if (bucket >= FRAG_HIST_BUCKETS) {
+            bucket = FRAG_HIST_BUCKETS - 1;
+        }
+        histogram[bucket]++;
+        if (extents[i].len > largest_free_run) {
+            largest_free_run = extents[i].len;
+        }
+    }
+    free(extents);
+    
+    // Locality of each dir under root
+    int num_subtrees = 0;
+    long subtree_spanned = 0;
+    long subtree_blocks = 0;
+    int *root_blocks = read_i_block_into_array(inode_table + EXT2_ROOT_INO - 1);
+    for (i = 0; root_blocks[i] != -1; i++) {
+        unsigned char *block = ext2_block_get(root_blocks[i]);
+        int off = 0;
+        while (off < EXT2_BLOCK_SIZE) {
+            struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(block + off);
+            if (entry->rec_len == 0) {
+                break;
+            }
+            int is_dot = entry->name[0] == '.' &&
+                         (entry->name_len == 1 || (entry->name_len == 2 && entry->name[1] == '.'));
+            if (entry->inode != 0 && entry->file_type == EXT2_FT_DIR && !is_dot) {
+                int min_block = -1;
+                int max_block = -1;
+                long num_blocks = 0;
+                subtree_span(entry->inode, &min_block, &max_block, &num_blocks);
+                if (num_blocks) {
+                    num_subtrees++;
+                    subtree_spanned += max_block - min_block + 1;
+                    subtree_blocks += num_blocks;
+                }
+            }
+            off += entry->rec_len;
+        }
+        ext2_block_put(root_blocks[i], 0);
+    }
+    free(root_blocks);
+    double subtree_spread = subtree_blocks ? (double)subtree_spanned / subtree_blocks : 0;
+    
+    int num_free_blocks = count_block_bitmap();
+    int num_free_inodes = count_inode_bitmap();
+    double dir_utilization_ratio = dir_num_blocks ? (double)dir_used_bytes / (dir_num_blocks * EXT2_BLOCK_SIZE) : 0;
+    double avg_extents = num_files ? (double)total_extents / num_files : 0;
+    int last_bucket = FRAG_HIST_BUCKETS - 1;
+    while (last_bucket > 0 && histogram[last_bucket] == 0) {
+        last_bucket--;
+    }
+    
+    // Print report in file order, then sort for worst list
+    if (json) {
+        printf("{\"blocks\":{\"total\":%u,\"free\":%d},", sb->s_blocks_count, num_free_blocks);
+        printf("\"inodes\":{\"total\":%u,\"free\":%d},", sb->s_inodes_count, num_free_inodes);
+        printf("\"files\":[");
+        for (i = 0; i < num_files; i++) {
+            printf("%s{\"inode\":%d,\"type\":\"%c\",\"blocks\":%d,\"extents\":%d}",
+                   i ? "," : "", files[i].inode_num, files[i].type,
+                   files[i].num_blocks, files[i].num_extents);
+        }
+        printf("],\"fragmented_files\":%d,\"avg_extents\":%.2f,", num_fragmented, avg_extents);
+        printf("\"free_runs\":{\"count\":%d,\"largest\":%d,\"histogram\":[", num_free_runs, largest_free_run);
+        for (i = 0; i <= last_bucket; i++) {
+            printf("%s{\"min\":%d,\"max\":%d,\"count\":%d}", i ? "," : "",
+                   1 << i, i == FRAG_HIST_BUCKETS - 1 ? INT_MAX : (1 << (i + 1)) - 1, histogram[i]);
+        }
+        printf("]},\"directories\":{\"blocks\":%ld,\"used_bytes\":%ld,\"utilization\":%.4f},",
+               dir_num_blocks, dir_used_bytes, dir_utilization_ratio);
+        printf("\"subtrees\":{\"count\":%d,\"blocks\":%ld,\"spanned\":%ld,\"spread\":%.2f},",
+               num_subtrees, subtree_blocks, subtree_spanned, subtree_spread);
+    } else {
+        printf("Blocks: %u total, %d free\n", sb->s_blocks_count, num_free_blocks);
+        printf("Inodes: %u total, %d free\n", sb->s_inodes_count, num_free_inodes);
+        printf("Files: %d, fragmented: %d, extents: %ld (%.2f per file)\n",
+               num_files, num_fragmented, total_extents, avg_extents);
+        printf("Free runs: %d, largest: %d blocks\n", num_free_runs, largest_free_run);
+        for (i = 0; i <= last_bucket && num_free_runs; i++) {
+            printf("  %5d - %-5d : %d\n", 1 << i, (1 << (i + 1)) - 1, histogram[i]);
+        }
+        printf("Directory blocks: %ld, utilization: %.1f%%\n", dir_num_blocks, dir_utilization_ratio * 100);
+        printf("Top level subtrees: %d, %ld blocks spanning %ld (spread %.2f)\n",
+               num_subtrees, subtree_blocks, subtree_spanned, subtree_spread);
+    }
+        
+    qsort(files, num_files, sizeof(struct file_layout), compare_fragmentation);
+    int num_worst = 0;
+    while (num_worst < num_files && num_worst < FRAG_WORST_COUNT && files[num_worst].num_extents > 1) {
+        num_worst++;
+    }
+        
+    if (json) {
+        printf("\"worst\":[");
+        for (i = 0; i < num_worst; i++) {
+            printf("%s%d", i ? "," : "", files[i].inode_num);
+        }
+        printf("]}\n");
+    } else if (num_worst) {
+        printf("Worst fragmented:\n");
+        for (i = 0; i < num_worst; i++) {
+            printf("  inode [%d] %c %d blocks, %d extents\n", files[i].inode_num,
+                   files[i].type, files[i].num_blocks, files[i].num_extents);
+        }
+    }
+    
+    free(files);
+    
+    return 0;
+}
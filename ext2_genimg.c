@@ -0,0 +1,391 @@
+/*
+ This program builds a synthetic ext2 image for benchmarking. It takes the name of the image file to create followed by optional flags:
+ "-b N"  blocks in the image (1kb blocks, single group, 64 to 8192, default 8192)
+ "-i N"  inodes in the image (default blocks / 4)
+ "-f N"  sub dirs in each dir (directory fan-out, default 4)
+ "-d N"  depth of the dir tree under root (default 2)
+ "-n N"  number of files, spread round-robin over every dir (default 1000)
+ "-s D"  file size distribution, one of "fixed:BYTES", "uniform:MIN:MAX", "exp:MEAN" (default exp:4096); sizes are capped to what a single indirect block can map
+ "-F P"  fragmentation, remove P percent of the files at random once the tree is populated and write as many new files, which land scattered over the holes (default 0)
+ "-S N"  random seed (default 1)
+ The image is formatted by the program itself (superblock, group descriptor, bitmaps, inode table, root and lost+found), then populated through ext2_utils. Population stops early when the image is out of inodes or blocks. The program prints the number of dirs and files created and the blocks used.
+ Locality mode: with "--locality", new inodes and blocks are placed by locality instead of taking the next one available: a dir made in root goes to the least used region of the image, anything else next to its parent, and file blocks follow the region of their inode and each other.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "ext2.h"
+
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include "ext2_utils.h"
+#include "ext2_io.h"
+
+// Largest file a single indirect block can map
+#define GENIMG_MAX_FILE_SIZE ((12 + EXT2_BLOCK_SIZE / 4) * EXT2_BLOCK_SIZE)
+#define GENIMG_INODE_SIZE 128
+#define GENIMG_FEATURE_INCOMPAT_FILETYPE 0x0002
+
+unsigned char *disk;
+
+struct ext2_super_block *sb;
+struct ext2_group_desc *gdt;
+unsigned char *block_bitmap;
+unsigned char *inode_bitmap;
+struct ext2_inode *inode_table;
+
+enum size_dist { SIZE_FIXED, SIZE_UNIFORM, SIZE_EXP };
+
+struct size_spec {
+    enum size_dist dist;
+    int a;
+    int b;
+};
+
+struct gen_file {
+    int  parent_inode_num;
+    char name[16];
+};
+
+/*
+ *  Parse "-s" argument into spec.
+ *  Return: int
+ *      -1 if invalid
+ *       0 if success
+ */
+int parse_size_spec(const char *arg, struct size_spec *spec) {
+    if (sscanf(arg, "fixed:%d", &spec->a) == 1) {
+        spec->dist = SIZE_FIXED;
+    } else if (sscanf(arg, "uniform:%d:%d", &spec->a, &spec->b) == 2 && spec->a <= spec->b) {
+        spec->dist = SIZE_UNIFORM;
+    } else if (sscanf(arg, "exp:%d", &spec->a) == 1) {
+        spec->dist = SIZE_EXP;
+    } else {
+        return -1;
+    }
+    return spec->a < 0 ? -1 : 0;
+}
+
+/*
+ *  Draw a file size from spec.
+ */
+int draw_size(struct size_spec *spec) {
+    int size;
+    double u;
+    
+    switch (spec->dist) {
+        case SIZE_FIXED:
+            size = spec->a;
+            break;
+        case SIZE_UNIFORM:
+            size = spec->a + (int)((double)rand() / ((double)RAND_MAX + 1) * (spec->b - spec->a + 1));
+            break;
+        default:
+            // inverse of exponential cdf, u in (0, 1]
+            u = ((double)rand() + 1) / ((double)RAND_MAX + 1);
+            size = (int)(-spec->a * log(u));
+            break;
+    }
+    return size > GENIMG_MAX_FILE_SIZE ? GENIMG_MAX_FILE_SIZE : size;
+}
+
+/*
+ *  Set bit of a bitmap.
+ */
+void set_bit(unsigned char *bitmap, int bit) {
+    bitmap[bit / 8] |= 1 << (bit % 8);
+}
+
+/*
+ *  Lay out an empty single group ext2 fs on disk: boot block, superblock,
+ *      group descriptor, block bitmap, inode bitmap, inode table, then
+ *      root and lost+found datablocks. Padding bits at the end of both
+ *      bitmaps are marked used as mke2fs does.
+ */
+void format_image(int num_blocks, int num_inodes) {
+    int inode_table_blocks = (num_inodes * GENIMG_INODE_SIZE + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    int first_free_block = 5 + inode_table_blocks;
+    int root_block = first_free_block;
+    int lost_found_block = first_free_block + 1;
+    int i;
+    
+    memset(disk, 0, (size_t)num_blocks * EXT2_BLOCK_SIZE);
+    sb = (struct ext2_super_block *)(disk + EXT2_BLOCK_SIZE);
+    gdt = (struct ext2_group_desc *)(disk + 2 * EXT2_BLOCK_SIZE);
+    
+    sb->s_inodes_count      = num_inodes;
+    sb->s_blocks_count      = num_blocks;
+    sb->s_first_data_block  = 1;
+    sb->s_log_block_size    = 0;
+    sb->s_log_frag_size     = 0;
+    sb->s_blocks_per_group  = 8192;
+    sb->s_frags_per_group   = 8192;
+    sb->s_inodes_per_group  = num_inodes;
+    sb->s_wtime             = (unsigned int)time(NULL);
+    sb->s_max_mnt_count     = 0xFFFF;
+    sb->s_magic             = 0xEF53;
+    sb->s_state             = 1;
+    sb->s_errors            = 1;
+    sb->s_rev_level         = 1;
+    sb->s_first_ino         = EXT2_GOOD_OLD_FIRST_INO;
+    sb->s_inode_size        = GENIMG_INODE_SIZE;
+    sb->s_feature_incompat  = GENIMG_FEATURE_INCOMPAT_FILETYPE;
+    
+    gdt->bg_block_bitmap    = 3;
+    gdt->bg_inode_bitmap    = 4;
+    gdt->bg_inode_table     = 5;
+    gdt->bg_used_dirs_count = 2;
+    
+    ext2_utils_init();
+    
+    // metadata blocks, root and lost+found, bit 0 is block 1
+    for (i = 1; i <= lost_found_block; i++) {
+        set_bit(block_bitmap, i - 1);
+    }
+    for (i = num_blocks - 1; i < EXT2_BLOCK_SIZE * 8; i++) {
+        set_bit(block_bitmap, i);
+    }
+    // reserved inodes and lost+found
+    for (i = 1; i <= EXT2_GOOD_OLD_FIRST_INO; i++) {
+        set_bit(inode_bitmap, i - 1);
+    }
+    for (i = num_inodes; i < EXT2_BLOCK_SIZE * 8; i++) {
+        set_bit(inode_bitmap, i);
+    }
+    sb->s_free_blocks_count = gdt->bg_free_blocks_count = num_blocks - 1 - lost_found_block;
+    sb->s_free_inodes_count = gdt->bg_free_inodes_count = num_inodes - EXT2_GOOD_OLD_FIRST_INO;
+    
+    // root and lost+found inodes
+    struct ext2_inode *root_inode = inode_table + EXT2_ROOT_INO - 1;
+    struct ext2_inode *lost_found_inode = inode_table + EXT2_GOOD_OLD_FIRST_INO - 1;
+    root_inode->i_mode = EXT2_S_IFDIR | 0755;
+    root_inode->i_size = EXT2_BLOCK_SIZE;
+    root_inode->i_blocks = 2;
+    root_inode->i_block[0] = root_block;
+    lost_found_inode->i_mode = EXT2_S_IFDIR | 0700;
+    lost_found_inode->i_size = EXT2_BLOCK_SIZE;
+    lost_found_inode->i_blocks = 2;
+    lost_found_inode->i_block[0] = lost_found_block;
+    
+    init_dir_entry(disk + EXT2_BLOCK_SIZE * lost_found_block, EXT2_GOOD_OLD_FIRST_INO, EXT2_ROOT_INO);
+    init_dir_entry(disk + EXT2_BLOCK_SIZE * root_block, EXT2_ROOT_INO, EXT2_ROOT_INO);
+    // init_dir_entry leaves ".." spanning the block, cut it for lost+found
+    struct ext2_dir_entry *dotdot = (struct ext2_dir_entry *)(disk + EXT2_BLOCK_SIZE * root_block + 12);
+    struct ext2_dir_entry *lost_found_entry;
+    dotdot->rec_len = 12;
+    lost_found_entry = (struct ext2_dir_entry *)((unsigned char *)dotdot + 12);
+    lost_found_entry->inode = EXT2_GOOD_OLD_FIRST_INO;
+    lost_found_entry->rec_len = EXT2_BLOCK_SIZE - 24;
+    lost_found_entry->name_len = 10;
+    lost_found_entry->file_type = EXT2_FT_DIR;
+    memcpy(lost_found_entry->name, "lost+found", 10);
+    // init_dir_entry counted "." and "..", links set here in full
+    root_inode->i_links_count = 3;
+    lost_found_inode->i_links_count = 2;
+}
+
+/*
+ *  Create a file of size bytes with random content in parent dir.
+ *  Return: int
+ *      -1 if out of inodes or blocks
+ *       0 if success
+ */
+int gen_file(int parent_inode_num, char *name, int size, unsigned char *buf) {
+    int i;
+    
+    if ((size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE + 1 > ext2_free_blocks_count()) {
+        return -1;
+    }
+    int inode_num = new_inode(parent_inode_num, EXT2_S_IFREG, size);
+    if (inode_num < 0) {
+        return -1;
+    }
+    for (i = 0; i < size; i++) {
+        buf[i] = (unsigned char)rand();
+    }
+    if (copy_to_inode_datablock(inode_table + inode_num - 1, buf, size)) {
+        free_inode(inode_num);
+        return -1;
+    }
+    add_to_dir_entry(inode_table + parent_inode_num - 1, inode_num, name, EXT2_FT_REG_FILE);
+    return 0;
+}
+
+int main(int argc, const char * argv[]) {
+    // "--stats" prints hot path counters on exit
+    ext2_stats_parse_flag(&argc, argv);
+    // "--locality" places new inodes and blocks near their parent
+    ext2_alloc_parse_flag(&argc, argv);
+    // files are written whole, in block order
+    ext2_io_set_access(EXT2_IO_ACCESS_SEQUENTIAL);
+    // "--io=", "--cache=", "--access=" and "--map=" set up the block backend
+    if (ext2_io_parse_flags(&argc, argv)) {
+        fprintf(stderr, "Invalid --io, --cache, --access or --map value\n");
+        exit(1);
+    }
+    
+    int num_blocks = 8192;
+    int num_inodes = 0;
+    int fanout = 4;
+    int depth = 2;
+    int num_files = 1000;
+    int frag_percent = 0;
+    unsigned int seed = 1;
+    struct size_spec size_spec = {SIZE_EXP, 4096, 0};
+    int arg_idx;
+    
+    if (argc < 2 || (argc % 2) != 0) {
+        fprintf(stderr, "Usage: <image file name> [-b blocks] [-i inodes] [-f fanout] [-d depth] [-n files] [-s fixed:N|uniform:MIN:MAX|exp:MEAN] [-F frag%%] [-S seed]\n");
+        exit(1);
+    }
+    for (arg_idx = 2; arg_idx < argc; arg_idx += 2) {
+        const char *val = argv[arg_idx + 1];
+        if (strcmp("-b", argv[arg_idx]) == 0) {
+            num_blocks = atoi(val);
+        } else if (strcmp("-i", argv[arg_idx]) == 0) {
+            num_inodes = atoi(val);
+        } else if (strcmp("-f", argv[arg_idx]) == 0) {
+            fanout = atoi(val);
+        } else if (strcmp("-d", argv[arg_idx]) == 0) {
+            depth = atoi(val);
+        } else if (strcmp("-n", argv[arg_idx]) == 0) {
+            num_files = atoi(val);
+        } else if (strcmp("-s", argv[arg_idx]) == 0) {
+            if (parse_size_spec(val, &size_spec)) {
+                fprintf(stderr, "Invalid size distribution: %s\n", val);
+                exit(1);
+            }
+        } else if (strcmp("-F", argv[arg_idx]) == 0) {
+            frag_percent = atoi(val);
+        } else if (strcmp("-S", argv[arg_idx]) == 0) {
+            seed = (unsigned int)atoi(val);
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[arg_idx]);
+            exit(1);
+        }
+    }
+    if (num_inodes == 0) {
+        num_inodes = num_blocks / 4;
+    }
+    // inode count rounded up to fill inode table blocks
+    num_inodes = (num_inodes + 7) / 8 * 8;
+    if (num_blocks < 64 || num_blocks > 8192 || num_inodes < 16 || num_inodes > 8192 ||
+        num_inodes * GENIMG_INODE_SIZE / EXT2_BLOCK_SIZE + 8 > num_blocks ||
+        fanout < 0 || depth < 0 || num_files < 0 || frag_percent < 0 || frag_percent > 100) {
+        fprintf(stderr, "Invalid geometry\n");
+        exit(1);
+    }
+    srand(seed);
+    
+    int fd = open(argv[1], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || ftruncate(fd, (off_t)num_blocks * EXT2_BLOCK_SIZE) == -1) {
+        perror(argv[1]);
+        exit(1);
+    }
+    
+    // map disk img into memory
+    disk = mmap(NULL, (size_t)num_blocks * EXT2_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(disk == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    
+    format_image(num_blocks, num_inodes);
+    munmap(disk, (size_t)num_blocks * EXT2_BLOCK_SIZE);
+    close(fd);
+    
+    // reopen formatted image through the picked block backend
+    if (ext2_io_open(argv[1], 1)) {
+        perror(argv[1]);
+        exit(1);
+    }
+    
+    // dir tree, level by level, dirs[] holds every dir inode including root
+    int max_dirs = 1;
+    int level_size = 1;
+    int i;
+    for (i = 0; i < depth && max_dirs < num_inodes; i++) {
+        level_size *= fanout;
+        max_dirs += level_size;
+    }
+    if (max_dirs > num_inodes) {
+        max_dirs = num_inodes;
+    }
+    int *dirs = malloc(sizeof(int) * max_dirs);
+    int num_dirs = 1;
+    int level_start = 0;
+    int level_end = 1;
+    dirs[0] = EXT2_ROOT_INO;
+    
+    for (i = 0; i < depth; i++) {
+        int parent_idx;
+        for (parent_idx = level_start; parent_idx < level_end; parent_idx++) {
+            int child;
+            for (child = 0; child < fanout && num_dirs < max_dirs; child++) {
+                char name[16];
+                snprintf(name, sizeof(name), "d%d", child);
+                if (ext2_free_inodes_count() == 0 || ext2_free_blocks_count() < 2) {
+                    break;
+                }
+                int dir_inode_num = inode_mkdir(dirs[parent_idx], name);
+                if (dir_inode_num < 0) {
+                    break;
+                }
+                dirs[num_dirs++] = dir_inode_num;
+            }
+        }
+        level_start = level_end;
+        level_end = num_dirs;
+    }
+    
+    // files round-robin over dirs
+    struct gen_file *files = malloc(sizeof(struct gen_file) * (num_files + 1));
+    unsigned char *buf = malloc(GENIMG_MAX_FILE_SIZE);
+    int num_created = 0;
+    int next_name = 0;
+    
+    for (i = 0; i < num_files; i++) {
+        struct gen_file *file = files + num_created;
+        file->parent_inode_num = dirs[i % num_dirs];
+        snprintf(file->name, sizeof(file->name), "f%d", next_name++);
+        if (gen_file(file->parent_inode_num, file->name, draw_size(&size_spec), buf)) {
+            break;
+        }
+        num_created++;
+    }
+    
+    // punch holes, then refill them
+    int num_holes = num_created * frag_percent / 100;
+    for (i = 0; i < num_holes; i++) {
+        int victim = rand() % num_created;
+        struct gen_file *file = files + victim;
+        remove_from_dir_entry(inode_table + file->parent_inode_num - 1, file->name);
+        files[victim] = files[--num_created];
+    }
+    for (i = 0; i < num_holes; i++) {
+        struct gen_file *file = files + num_created;
+        file->parent_inode_num = dirs[rand() % num_dirs];
+        snprintf(file->name, sizeof(file->name), "f%d", next_name++);
+        if (gen_file(file->parent_inode_num, file->name, draw_size(&size_spec), buf)) {
+            break;
+        }
+        num_created++;
+    }
+    
+    printf("%d dirs, %d files, %u/%u blocks used\n", num_dirs, num_created,
+           sb->s_blocks_count - ext2_free_blocks_count(), sb->s_blocks_count);
+    
+    free(buf);
+    free(files);
+    free(dirs);
+    
+    return 0;
+}
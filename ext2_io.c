@@ -0,0 +1,1193 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "ext2_io.h"
+#include "ext2_utils.h"
+
+extern unsigned char *disk;
+extern struct ext2_super_block *sb;
+
+// Buffer of one cached block
+struct io_buf {
+    int            block_num;
+    int            pins;
+    int            dirty;
+    struct io_buf *lru_prev;    // only evictable buffers are on lru list
+    struct io_buf *lru_next;
+    struct io_buf *hash_next;
+    unsigned char  data[EXT2_BLOCK_SIZE];
+};
+
+// One read or write of a batch, num_blocks contiguous blocks
+struct io_req {
+    int            write;
+    int            block_num;
+    int            num_blocks;
+    unsigned char *buf;
+    int            rs;          // 0 or -1
+};
+
+static int io_backend = EXT2_IO_MMAP;
+static int io_cache_blocks = EXT2_IO_DEFAULT_CACHE_BLOCKS;
+static int io_access = EXT2_IO_ACCESS_NORMAL;
+static int io_map_flags;
+static int io_fd = -1;
+static int io_writable;
+static int io_durable;
+static int io_journal;
+static int io_was_valid;     // s_state gets EXT2_VALID_FS back on close
+static int io_recount = 1;
+static char io_journal_path[PATH_MAX];
+
+// --sync: one bit per block written back since last flush (or changed
+//      in the mapping with mmap backend), flushed in coalesced ranges.
+//      --journal with mmap backend: one bit per block changed in the
+//      private mapping, also set in io_dirty_meta if it's metadata
+static unsigned char *io_dirty;
+static unsigned char *io_dirty_meta;
+
+// blocks [0, io_meta_blocks) are metadata: prefaulted with mmap backend,
+//      resident behind disk with a clean copy to find the ones changed
+//      with cached backends (and with mmap backend under --sync)
+static int io_meta_blocks;
+static unsigned char *io_meta_clean;
+
+// cached backends: cache, lru head is most recently used
+static struct io_buf **io_hash;
+static int io_hash_mask;
+static struct io_buf **io_bufs;
+static int io_num_bufs;
+static int io_bufs_cap;
+static struct io_buf *io_lru_head;
+static struct io_buf *io_lru_tail;
+
+// uring backend: rings shared with kernel
+static int io_ring_fd = -1;
+static unsigned int io_sq_entries;
+static unsigned int *io_sq_tail;
+static unsigned int *io_sq_mask;
+static unsigned int *io_sq_array;
+static struct io_uring_sqe *io_sqes;
+static unsigned int *io_cq_head;
+static unsigned int *io_cq_tail;
+static unsigned int *io_cq_mask;
+static struct io_uring_cqe *io_cqes;
+
+// threads backend: workers take requests of the current batch in order
+static pthread_mutex_t io_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t io_pool_done = PTHREAD_COND_INITIALIZER;
+static struct io_req *io_pool_reqs;
+static int io_pool_next;
+static int io_pool_num;
+static int io_pool_pending;
+
+
+int ext2_io_parse_flags(int *argc,
+                        const char *argv[])
+{
+    int rs = 0;
+    int i;
+    int j = 1;
+    
+    for (i = 1; i < *argc; i++) {
+        if (strcmp("--io=mmap", argv[i]) == 0) {
+            io_backend = EXT2_IO_MMAP;
+        } else if (strcmp("--io=pread", argv[i]) == 0) {
+            io_backend = EXT2_IO_PREAD;
+        } else if (strcmp("--io=uring", argv[i]) == 0) {
+            io_backend = EXT2_IO_URING;
+        } else if (strcmp("--io=threads", argv[i]) == 0) {
+            io_backend = EXT2_IO_THREADS;
+        } else if (strncmp("--io=", argv[i], 5) == 0) {
+            rs = -1;
+        } else if (strcmp("--access=normal", argv[i]) == 0) {
+            io_access = EXT2_IO_ACCESS_NORMAL;
+        } else if (strcmp("--access=random", argv[i]) == 0) {
+            io_access = EXT2_IO_ACCESS_RANDOM;
+        } else if (strcmp("--access=sequential", argv[i]) == 0) {
+            io_access = EXT2_IO_ACCESS_SEQUENTIAL;
+        } else if (strncmp("--access=", argv[i], 9) == 0) {
+            rs = -1;
+        } else if (strcmp("--map=populate", argv[i]) == 0) {
+            io_map_flags |= EXT2_IO_MAP_POPULATE;
+        } else if (strcmp("--map=hugepage", argv[i]) == 0) {
+            io_map_flags |= EXT2_IO_MAP_HUGEPAGE;
+        } else if (strncmp("--map=", argv[i], 6) == 0) {
+            rs = -1;
+        } else if (strcmp("--sync", argv[i]) == 0) {
+            io_durable = 1;
+        } else if (strcmp("--journal", argv[i]) == 0) {
+            io_journal = 1;
+        } else if (strncmp("--cache=", argv[i], 8) == 0) {
+            io_cache_blocks = atoi(argv[i] + 8);
+            if (io_cache_blocks < 1) {
+                rs = -1;
+            }
+        } else {
+            argv[j++] = argv[i];
+        }
+    }
+    *argc = j;
+    argv[j] = NULL;
+    return rs;
+}
+
+void ext2_io_set_access(int access)
+{
+    io_access = access;
+}
+
+void ext2_io_set_recount(int recount)
+{
+    io_recount = recount;
+}
+
+/*
+ *  pread/pwrite all of len bytes, reads past end of image are zero filled.
+ */
+static int io_pread_full(unsigned char *buf,
+                         size_t len,
+                         off_t off)
+{
+    size_t done = 0;
+    
+    while (done < len) {
+        ssize_t n = pread(io_fd, buf + done, len - done, off + done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            memset(buf + done, 0, len - done);
+            break;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static int io_pwrite_full(unsigned char *buf,
+                          size_t len,
+                          off_t off)
+{
+    size_t done = 0;
+    
+    while (done < len) {
+        ssize_t n = pwrite(io_fd, buf + done, len - done, off + done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/*
+ *  Do one request synchronously.
+ */
+static void io_req_do(struct io_req *req)
+{
+    size_t len = (size_t)req->num_blocks * EXT2_BLOCK_SIZE;
+    off_t off = (off_t)req->block_num * EXT2_BLOCK_SIZE;
+    
+    if (req->write) {
+        req->rs = io_pwrite_full(req->buf, len, off);
+    } else {
+        req->rs = io_pread_full(req->buf, len, off);
+    }
+}
+
+/*
+ *  Set up a ring of EXT2_IO_QUEUE_DEPTH entries.
+ */
+static int io_uring_init(void)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    
+    int fd = syscall(__NR_io_uring_setup, EXT2_IO_QUEUE_DEPTH, &params);
+    if (fd < 0) {
+        return -1;
+    }
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    }
+    
+    unsigned char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    unsigned char *cq = sq;
+    if (sq != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    io_sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || io_sqes == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    
+    io_sq_entries = params.sq_entries;
+    io_sq_tail    = (unsigned int *)(sq + params.sq_off.tail);
+    io_sq_mask    = (unsigned int *)(sq + params.sq_off.ring_mask);
+    io_sq_array   = (unsigned int *)(sq + params.sq_off.array);
+    io_cq_head    = (unsigned int *)(cq + params.cq_off.head);
+    io_cq_tail    = (unsigned int *)(cq + params.cq_off.tail);
+    io_cq_mask    = (unsigned int *)(cq + params.cq_off.ring_mask);
+    io_cqes       = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    io_ring_fd    = fd;
+    return 0;
+}
+
+/*
+ *  Keep the ring full until every request of batch completed. A request
+ *      not done in full by the kernel is redone synchronously.
+ */
+static void io_uring_batch(struct io_req *reqs,
+                           int num_reqs)
+{
+    int next = 0;           // next request to queue
+    int unsubmitted = 0;    // queued, not taken by kernel yet
+    int in_flight = 0;      // taken by kernel, not completed
+    
+    while (next < num_reqs || unsubmitted || in_flight) {
+        unsigned int tail = *io_sq_tail;
+        while (next < num_reqs && in_flight + unsubmitted < io_sq_entries) {
+            unsigned int idx = tail & *io_sq_mask;
+            struct io_uring_sqe *sqe = io_sqes + idx;
+            memset(sqe, 0, sizeof(struct io_uring_sqe));
+            sqe->opcode    = reqs[next].write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe->fd        = io_fd;
+            sqe->addr      = (unsigned long)reqs[next].buf;
+            sqe->len       = reqs[next].num_blocks * EXT2_BLOCK_SIZE;
+            sqe->off       = (unsigned long long)reqs[next].block_num * EXT2_BLOCK_SIZE;
+            sqe->user_data = next;
+            io_sq_array[idx] = idx;
+            tail++;
+            next++;
+            unsubmitted++;
+        }
+        __atomic_store_n(io_sq_tail, tail, __ATOMIC_RELEASE);
+        
+        int rs = syscall(__NR_io_uring_enter, io_ring_fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (rs < 0) {
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                perror("io_uring_enter");
+                exit(EIO);
+            }
+            rs = 0;
+        }
+        unsubmitted -= rs;
+        in_flight += rs;
+        
+        unsigned int head = *io_cq_head;
+        while (head != __atomic_load_n(io_cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = io_cqes + (head & *io_cq_mask);
+            struct io_req *req = reqs + cqe->user_data;
+            if (cqe->res == req->num_blocks * EXT2_BLOCK_SIZE) {
+                req->rs = 0;
+            } else {
+                // short read at end of image, interrupted or failed
+                io_req_do(req);
+            }
+            head++;
+            in_flight--;
+        }
+        __atomic_store_n(io_cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+static void *io_pool_worker(void *arg)
+{
+    pthread_mutex_lock(&io_pool_lock);
+    while (1) {
+        while (io_pool_next >= io_pool_num) {
+            pthread_cond_wait(&io_pool_work, &io_pool_lock);
+        }
+        struct io_req *req = io_pool_reqs + io_pool_next++;
+        pthread_mutex_unlock(&io_pool_lock);
+        io_req_do(req);
+        pthread_mutex_lock(&io_pool_lock);
+        if (--io_pool_pending == 0) {
+            pthread_cond_signal(&io_pool_done);
+        }
+    }
+    return NULL;
+}
+
+/*
+ *  Start EXT2_IO_POOL_THREADS detached workers, left blocked on exit.
+ */
+static int io_pool_init(void)
+{
+    int i;
+    
+    for (i = 0; i < EXT2_IO_POOL_THREADS; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, io_pool_worker, NULL)) {
+            return i ? 0 : -1;
+        }
+        pthread_detach(thread);
+    }
+    return 0;
+}
+
+static void io_pool_batch(struct io_req *reqs,
+                          int num_reqs)
+{
+    pthread_mutex_lock(&io_pool_lock);
+    io_pool_reqs    = reqs;
+    io_pool_next    = 0;
+    io_pool_num     = num_reqs;
+    io_pool_pending = num_reqs;
+    pthread_cond_broadcast(&io_pool_work);
+    while (io_pool_pending) {
+        pthread_cond_wait(&io_pool_done, &io_pool_lock);
+    }
+    io_pool_num = 0;
+    pthread_mutex_unlock(&io_pool_lock);
+}
+
+/*
+ *  Mark blocks to be flushed by --sync.
+ */
+static void io_mark_dirty(int block_num,
+                          int num_blocks)
+{
+    int i;
+    
+    if (io_dirty == NULL) {
+        return;
+    }
+    for (i = block_num; i < block_num + num_blocks; i++) {
+        io_dirty[i / 8] |= 1 << (i % 8);
+    }
+}
+
+static int io_test_bit(unsigned char *bits,
+                       int i)
+{
+    return bits[i / 8] & (1 << (i % 8));
+}
+
+/*
+ *  Do every request of batch, concurrently with uring or threads backend.
+ *  Return: int
+ *      -1 if a request failed (its rs is -1)
+ *       0 if success
+ */
+static int io_submit_batch(struct io_req *reqs,
+                           int num_reqs)
+{
+    int rs = 0;
+    int i;
+    
+    if (num_reqs == 0) {
+        return 0;
+    }
+    EXT2_STATS_ADD(io_batches, 1);
+    for (i = 0; i < num_reqs; i++) {
+        if (reqs[i].write) {
+            EXT2_STATS_ADD(blocks_written, reqs[i].num_blocks);
+        } else {
+            EXT2_STATS_ADD(blocks_read, reqs[i].num_blocks);
+        }
+    }
+    
+    if (io_backend == EXT2_IO_URING && num_reqs > 1) {
+        io_uring_batch(reqs, num_reqs);
+    } else if (io_backend == EXT2_IO_THREADS && num_reqs > 1) {
+        io_pool_batch(reqs, num_reqs);
+    } else {
+        for (i = 0; i < num_reqs; i++) {
+            io_req_do(reqs + i);
+        }
+    }
+    
+    for (i = 0; i < num_reqs; i++) {
+        if (reqs[i].rs) {
+            rs = -1;
+        } else if (reqs[i].write && !io_journal) {
+            io_mark_dirty(reqs[i].block_num, reqs[i].num_blocks);
+        }
+    }
+    return rs;
+}
+
+/*
+ *  Read or write num_blocks blocks at block_num right away.
+ */
+static int io_rw_blocks(int write,
+                        int block_num,
+                        int num_blocks,
+                        unsigned char *buf)
+{
+    struct io_req req = {write, block_num, num_blocks, buf, 0};
+    return io_submit_batch(&req, 1);
+}
+
+static void io_lru_remove(struct io_buf *buf)
+{
+    if (buf->lru_prev) {
+        buf->lru_prev->lru_next = buf->lru_next;
+    } else {
+        io_lru_head = buf->lru_next;
+    }
+    if (buf->lru_next) {
+        buf->lru_next->lru_prev = buf->lru_prev;
+    } else {
+        io_lru_tail = buf->lru_prev;
+    }
+    buf->lru_prev = buf->lru_next = NULL;
+}
+
+static void io_lru_push_head(struct io_buf *buf)
+{
+    buf->lru_prev = NULL;
+    buf->lru_next = io_lru_head;
+    if (io_lru_head) {
+        io_lru_head->lru_prev = buf;
+    } else {
+        io_lru_tail = buf;
+    }
+    io_lru_head = buf;
+}
+
+/*
+ *  Buffer can be evicted (is on lru list) if unpinned, and its changes
+ *      can be written back. Changes to a read only image live in cache,
+ *      so do metadata changes under --journal until they are committed.
+ */
+static int io_buf_evictable(struct io_buf *buf)
+{
+    if (buf->pins) {
+        return 0;
+    }
+    if (!buf->dirty) {
+        return 1;
+    }
+    return io_writable && !(io_journal && (buf->dirty & ~EXT2_IO_DIRTY_DATA));
+}
+
+static struct io_buf *io_hash_lookup(int block_num)
+{
+    struct io_buf *buf = io_hash[block_num & io_hash_mask];
+    while (buf && buf->block_num != block_num) {
+        buf = buf->hash_next;
+    }
+    return buf;
+}
+
+static void io_hash_remove(struct io_buf *buf)
+{
+    struct io_buf **link = io_hash + (buf->block_num & io_hash_mask);
+    while (*link != buf) {
+        link = &(*link)->hash_next;
+    }
+    *link = buf->hash_next;
+}
+
+/*
+ *  Set buffer for block_num, pinned once, and add it to hash.
+ */
+static void io_buf_insert(struct io_buf *buf,
+                          int block_num)
+{
+    buf->block_num = block_num;
+    buf->pins = 1;
+    buf->dirty = 0;
+    buf->hash_next = io_hash[block_num & io_hash_mask];
+    io_hash[block_num & io_hash_mask] = buf;
+}
+
+/*
+ *  Write back dirty buffers at the cold end of lru list in one batch,
+ *      so eviction during bulk writes doesn't stall on each block.
+ */
+static void io_flush_lru_tail(void)
+{
+    struct io_req reqs[EXT2_IO_QUEUE_DEPTH];
+    struct io_buf *buf;
+    int num_reqs = 0;
+    
+    for (buf = io_lru_tail; buf && num_reqs < EXT2_IO_QUEUE_DEPTH; buf = buf->lru_prev) {
+        if (buf->dirty) {
+            struct io_req req = {1, buf->block_num, 1, buf->data, 0};
+            reqs[num_reqs++] = req;
+            buf->dirty = 0;
+        }
+    }
+    if (io_submit_batch(reqs, num_reqs)) {
+        perror("pwrite");
+    }
+}
+
+/*
+ *  Get a free buffer: a new one while under budget (or if every buffer
+ *      is pinned), otherwise the least recently used one.
+ */
+static struct io_buf *io_buf_take(void)
+{
+    struct io_buf *buf;
+    
+    if (io_num_bufs >= io_cache_blocks && io_lru_tail) {
+        buf = io_lru_tail;
+        if (buf->dirty) {
+            io_flush_lru_tail();
+        }
+        io_lru_remove(buf);
+        io_hash_remove(buf);
+        return buf;
+    }
+    
+    buf = calloc(1, sizeof(struct io_buf));
+    if (buf == NULL) {
+        perror("calloc");
+        exit(ENOMEM);
+    }
+    if (io_num_bufs == io_bufs_cap) {
+        io_bufs_cap = io_bufs_cap ? io_bufs_cap * 2 : 64;
+        io_bufs = realloc(io_bufs, sizeof(struct io_buf *) * io_bufs_cap);
+    }
+    io_bufs[io_num_bufs++] = buf;
+    return buf;
+}
+
+/*
+ *  Pin cached buffer of block_num if any.
+ */
+static struct io_buf *io_buf_pin(int block_num)
+{
+    struct io_buf *buf = io_hash_lookup(block_num);
+    if (buf) {
+        if (io_buf_evictable(buf)) {
+            io_lru_remove(buf);
+        }
+        buf->pins++;
+    }
+    return buf;
+}
+
+unsigned char *ext2_block_get(int block_num)
+{
+    if (io_backend == EXT2_IO_MMAP || block_num < io_meta_blocks) {
+        return disk + (size_t)EXT2_BLOCK_SIZE * block_num;
+    }
+    
+    struct io_buf *buf = io_buf_pin(block_num);
+    if (buf) {
+        return buf->data;
+    }
+    
+    buf = io_buf_take();
+    if (io_rw_blocks(0, block_num, 1, buf->data)) {
+        perror("pread");
+        memset(buf->data, 0, EXT2_BLOCK_SIZE);
+    }
+    io_buf_insert(buf, block_num);
+    return buf->data;
+}
+
+unsigned char *ext2_block_get_new(int block_num)
+{
+    if (io_backend == EXT2_IO_MMAP || block_num < io_meta_blocks) {
+        return disk + (size_t)EXT2_BLOCK_SIZE * block_num;
+    }
+    
+    struct io_buf *buf = io_buf_pin(block_num);
+    if (buf) {
+        return buf->data;
+    }
+    
+    // about to be overwritten, no need to read
+    buf = io_buf_take();
+    io_buf_insert(buf, block_num);
+    return buf->data;
+}
+
+void ext2_block_put(int block_num,
+                    int dirty)
+{
+    if (io_backend == EXT2_IO_MMAP) {
+        // already in the mapping, only remembered for --sync and --journal
+        if (dirty) {
+            io_mark_dirty(block_num, 1);
+            if (io_dirty_meta && (dirty & ~EXT2_IO_DIRTY_DATA)) {
+                io_dirty_meta[block_num / 8] |= 1 << (block_num % 8);
+            }
+        }
+        return;
+    }
+    if (block_num < io_meta_blocks) {
+        return;
+    }
+    
+    struct io_buf *buf = io_hash_lookup(block_num);
+    if (buf == NULL || buf->pins == 0) {
+        return;
+    }
+    buf->dirty |= dirty;
+    buf->pins--;
+    if (io_buf_evictable(buf)) {
+        io_lru_push_head(buf);
+    }
+}
+
+int ext2_io_prefetch(const int *block_nums,
+                     int num_blocks)
+{
+    if (io_backend == EXT2_IO_MMAP || num_blocks <= 0) {
+        return 0;
+    }
+    
+    // at most half the cache per batch, so a batch doesn't evict itself
+    int batch_size = io_cache_blocks / 2 ? io_cache_blocks / 2 : 1;
+    if (batch_size > num_blocks) {
+        batch_size = num_blocks;
+    }
+    struct io_req *reqs = malloc(sizeof(struct io_req) * batch_size);
+    struct io_buf **bufs = malloc(sizeof(struct io_buf *) * batch_size);
+    int rs = 0;
+    int i = 0;
+    int j;
+    
+    while (i < num_blocks) {
+        int num_reqs = 0;
+        for (; i < num_blocks && num_reqs < batch_size; i++) {
+            int block_num = block_nums[i];
+            if (block_num < io_meta_blocks || block_num >= sb->s_blocks_count ||
+                io_hash_lookup(block_num)) {
+                continue;
+            }
+            // pinned while read, so a later take in this batch can't get it
+            struct io_buf *buf = io_buf_take();
+            io_buf_insert(buf, block_num);
+            struct io_req req = {0, block_num, 1, buf->data, 0};
+            reqs[num_reqs] = req;
+            bufs[num_reqs++] = buf;
+        }
+        if (io_submit_batch(reqs, num_reqs)) {
+            rs = -1;
+        }
+        for (j = 0; j < num_reqs; j++) {
+            if (reqs[j].rs) {
+                memset(bufs[j]->data, 0, EXT2_BLOCK_SIZE);
+            }
+            bufs[j]->pins = 0;
+            io_lru_push_head(bufs[j]);
+        }
+    }
+    
+    free(bufs);
+    free(reqs);
+    return rs;
+}
+
+/*
+ *  Make blocks marked dirty durable. Writeback of each run of dirty
+ *      pages is started with one ranged call, then all of it is waited
+ *      for and the drive cache flushed by a single fdatasync(): a
+ *      ranged msync(MS_SYNC) per run would commit the host journal
+ *      once per run.
+ */
+static int io_flush_dirty(void)
+{
+    int blocks_per_page = sysconf(_SC_PAGESIZE) / EXT2_BLOCK_SIZE;
+    int num_ranges = 0;
+    int rs = 0;
+    int i = 0;
+    
+    if (blocks_per_page < 1) {
+        blocks_per_page = 1;
+    }
+    while (i < sb->s_blocks_count) {
+        if (!(io_dirty[i / 8] & (1 << (i % 8)))) {
+            i += io_dirty[i / 8] ? 1 : 8 - i % 8;
+            continue;
+        }
+        // extend over dirty blocks and clean gaps within the same page
+        int start = i;
+        int end = i + 1;
+        for (; i < sb->s_blocks_count && i < end + blocks_per_page; i++) {
+            if (io_dirty[i / 8] & (1 << (i % 8))) {
+                io_dirty[i / 8] &= ~(1 << (i % 8));
+                end = i + 1;
+            } else if (i / blocks_per_page != (end - 1) / blocks_per_page) {
+                break;
+            }
+        }
+        if (sync_file_range(io_fd, (off_t)start * EXT2_BLOCK_SIZE,
+                            (off_t)(end - start) * EXT2_BLOCK_SIZE,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE)) {
+            rs = -1;
+        }
+        num_ranges++;
+    }
+    if (num_ranges && fdatasync(io_fd)) {
+        rs = -1;
+    }
+    EXT2_STATS_ADD(sync_ranges, num_ranges);
+    return rs;
+}
+
+static unsigned long long io_checksum(unsigned long long hash,
+                                      const void *data,
+                                      size_t len)
+{
+    const unsigned char *bytes = data;
+    size_t i;
+    
+    // FNV-1a
+    for (i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ *  Commit metadata blocks of reqs as one transaction: their images are
+ *      logged to the journal and made durable behind a commit record,
+ *      then written in place, then the journal is removed. A crash at
+ *      any point leaves either the old or the new metadata after
+ *      io_journal_replay(). File content must be durable before.
+ *  Journal format: magic, blocks count, number of blocks, block
+ *      numbers, block images, commit magic, checksum of all before.
+ */
+static int io_journal_commit(struct io_req *reqs,
+                             int num_reqs)
+{
+    FILE *journal = fopen(io_journal_path, "wb");
+    if (journal == NULL) {
+        return -1;
+    }
+    
+    unsigned int header[2] = {sb->s_blocks_count, num_reqs};
+    unsigned long long sum = io_checksum(0xcbf29ce484222325ULL, EXT2_IO_JOURNAL_MAGIC, 8);
+    sum = io_checksum(sum, header, sizeof(header));
+    fwrite(EXT2_IO_JOURNAL_MAGIC, 1, 8, journal);
+    fwrite(header, sizeof(header), 1, journal);
+    int i;
+    for (i = 0; i < num_reqs; i++) {
+        unsigned int block_num = reqs[i].block_num;
+        sum = io_checksum(sum, &block_num, sizeof(block_num));
+        fwrite(&block_num, sizeof(block_num), 1, journal);
+    }
+    for (i = 0; i < num_reqs; i++) {
+        sum = io_checksum(sum, reqs[i].buf, EXT2_BLOCK_SIZE);
+        fwrite(reqs[i].buf, EXT2_BLOCK_SIZE, 1, journal);
+    }
+    fwrite(EXT2_IO_JOURNAL_COMMIT, 1, 8, journal);
+    fwrite(&sum, sizeof(sum), 1, journal);
+    if (fflush(journal) || ferror(journal) || fdatasync(fileno(journal))) {
+        fclose(journal);
+        return -1;
+    }
+    fclose(journal);
+    EXT2_STATS_ADD(journal_blocks, num_reqs);
+    
+    // checkpoint, the journal is replayed if this doesn't complete
+    if (io_submit_batch(reqs, num_reqs) || fdatasync(io_fd)) {
+        return -1;
+    }
+    return unlink(io_journal_path);
+}
+
+/*
+ *  Write back a transaction left committed in the journal by a crash,
+ *      and drop one that never got its commit record. Cost is that of
+ *      reading the journal, whatever the image size.
+ */
+static int io_journal_replay(const char *path)
+{
+    if (strlen(path) + strlen(".journal") >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(io_journal_path, path);
+    strcat(io_journal_path, ".journal");
+    
+    FILE *journal = fopen(io_journal_path, "rb");
+    if (journal == NULL) {
+        return 0;
+    }
+    
+    char magic[8];
+    unsigned int header[2] = {0, 0};
+    unsigned long long sum = io_checksum(0xcbf29ce484222325ULL, EXT2_IO_JOURNAL_MAGIC, 8);
+    unsigned long long commit_sum;
+    unsigned int *block_nums = NULL;
+    unsigned char *images = NULL;
+    int committed = 0;
+    int rs = 0;
+    unsigned int i;
+    
+    if (fread(magic, 1, 8, journal) == 8 &&
+        memcmp(magic, EXT2_IO_JOURNAL_MAGIC, 8) == 0 &&
+        fread(header, sizeof(header), 1, journal) == 1) {
+        block_nums = malloc(sizeof(unsigned int) * header[1] + 1);
+        images = malloc((size_t)EXT2_BLOCK_SIZE * header[1] + 1);
+        if (block_nums && images &&
+            fread(block_nums, sizeof(unsigned int), header[1], journal) == header[1] &&
+            fread(images, EXT2_BLOCK_SIZE, header[1], journal) == header[1] &&
+            fread(magic, 1, 8, journal) == 8 &&
+            memcmp(magic, EXT2_IO_JOURNAL_COMMIT, 8) == 0 &&
+            fread(&commit_sum, sizeof(commit_sum), 1, journal) == 1) {
+            sum = io_checksum(sum, header, sizeof(header));
+            sum = io_checksum(sum, block_nums, sizeof(unsigned int) * header[1]);
+            sum = io_checksum(sum, images, (size_t)EXT2_BLOCK_SIZE * header[1]);
+            committed = sum == commit_sum;
+        }
+    }
+    fclose(journal);
+    
+    for (i = 0; committed && i < header[1]; i++) {
+        if (block_nums[i] >= header[0]) {
+            committed = 0;
+        }
+    }
+    if (committed) {
+        io_fd = open(path, O_RDWR);
+        if (io_fd == -1) {
+            rs = -1;
+        } else {
+            for (i = 0; i < header[1] && rs == 0; i++) {
+                rs = io_pwrite_full(images + (size_t)EXT2_BLOCK_SIZE * i, EXT2_BLOCK_SIZE,
+                                    (off_t)block_nums[i] * EXT2_BLOCK_SIZE);
+            }
+            if (rs == 0) {
+                rs = fdatasync(io_fd);
+            }
+            close(io_fd);
+            io_fd = -1;
+        }
+        if (rs == 0) {
+            fprintf(stderr, "%s: replayed %u blocks\n", io_journal_path, header[1]);
+        }
+    }
+    free(block_nums);
+    free(images);
+    
+    // kept if replay failed, so it's retried on next open
+    if (rs == 0) {
+        unlink(io_journal_path);
+    }
+    return rs;
+}
+
+int ext2_io_sync(void)
+{
+    int num_reqs = 0;
+    int num_meta = 0;
+    int rs;
+    int i;
+    
+    if (!io_writable) {
+        return 0;
+    }
+    ext2_counters_fold();
+    
+    int max_reqs = io_num_bufs + io_meta_blocks;
+    if (io_backend == EXT2_IO_MMAP && io_journal) {
+        for (i = io_meta_blocks; i < sb->s_blocks_count; i++) {
+            max_reqs += io_test_bit(io_dirty, i) != 0;
+        }
+    }
+    
+    // dirty buffers and changed metadata blocks, all in one batch, but
+    //      metadata goes through journal under --journal
+    struct io_req *reqs = malloc(sizeof(struct io_req) * (max_reqs + 1));
+    struct io_req *meta_reqs = malloc(sizeof(struct io_req) * (max_reqs + 1));
+    for (i = 0; i < io_num_bufs; i++) {
+        struct io_buf *buf = io_bufs[i];
+        if (buf->dirty) {
+            struct io_req req = {1, buf->block_num, 1, buf->data, 0};
+            int held = buf->pins == 0 && !io_buf_evictable(buf);
+            if (io_journal && (buf->dirty & ~EXT2_IO_DIRTY_DATA)) {
+                meta_reqs[num_meta++] = req;
+            } else {
+                reqs[num_reqs++] = req;
+            }
+            buf->dirty = 0;
+            // held out of lru list while dirty, can be evicted now
+            if (held) {
+                io_lru_push_head(buf);
+            }
+        }
+    }
+    for (i = 0; io_meta_clean && i < io_meta_blocks; i++) {
+        unsigned char *curr = disk + EXT2_BLOCK_SIZE * i;
+        unsigned char *clean = io_meta_clean + EXT2_BLOCK_SIZE * i;
+        if (memcmp(curr, clean, EXT2_BLOCK_SIZE) != 0) {
+            struct io_req req = {1, i, 1, curr, 0};
+            if (io_journal) {
+                meta_reqs[num_meta++] = req;
+            } else if (io_backend == EXT2_IO_MMAP) {
+                io_mark_dirty(i, 1);
+            } else {
+                reqs[num_reqs++] = req;
+            }
+            memcpy(clean, curr, EXT2_BLOCK_SIZE);
+        }
+    }
+    // private mapping under --journal, changes reach image from here only
+    if (io_backend == EXT2_IO_MMAP && io_journal) {
+        for (i = io_meta_blocks; i < sb->s_blocks_count; i++) {
+            if (io_test_bit(io_dirty, i)) {
+                struct io_req req = {1, i, 1, disk + (size_t)EXT2_BLOCK_SIZE * i, 0};
+                if (io_test_bit(io_dirty_meta, i)) {
+                    meta_reqs[num_meta++] = req;
+                } else {
+                    reqs[num_reqs++] = req;
+                }
+            }
+        }
+        memset(io_dirty, 0, sb->s_blocks_count / 8 + 1);
+        memset(io_dirty_meta, 0, sb->s_blocks_count / 8 + 1);
+    }
+    rs = io_submit_batch(reqs, num_reqs);
+    
+    if (io_journal) {
+        // file content durable before metadata pointing at it commits
+        if (num_meta && (rs || fdatasync(io_fd) || io_journal_commit(meta_reqs, num_meta))) {
+            rs = -1;
+        }
+    } else if (io_durable && io_flush_dirty()) {
+        rs = -1;
+    }
+    free(meta_reqs);
+    free(reqs);
+    return rs;
+}
+
+static void io_sync_at_exit(void)
+{
+    ext2_counters_fold();
+    if (io_was_valid) {
+        sb->s_state |= EXT2_VALID_FS;
+    }
+    if (ext2_io_sync()) {
+        perror(io_durable || io_journal ? "sync" : "pwrite");
+    }
+}
+
+/*
+ *  Number of blocks from block 0 to the end of bitmaps and inode table,
+ *      given the first 3 blocks of image.
+ */
+static int io_meta_end(unsigned char *head)
+{
+    struct ext2_super_block *head_sb = (struct ext2_super_block *)(head + EXT2_BLOCK_SIZE);
+    struct ext2_group_desc *head_gdt = (struct ext2_group_desc *)(head + EXT2_BLOCK_SIZE + sizeof(struct ext2_super_block));
+    int inode_table_blocks = (head_sb->s_inodes_count * sizeof(struct ext2_inode) + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    int meta_blocks = head_gdt->bg_inode_table + inode_table_blocks;
+    
+    if (head_gdt->bg_block_bitmap >= meta_blocks) {
+        meta_blocks = head_gdt->bg_block_bitmap + 1;
+    }
+    if (head_gdt->bg_inode_bitmap >= meta_blocks) {
+        meta_blocks = head_gdt->bg_inode_bitmap + 1;
+    }
+    return meta_blocks;
+}
+
+/*
+ *  Map whole image. Metadata is prefaulted (walked by every tool), the
+ *      rest is advised per access pattern.
+ */
+static int io_map_image(int writable)
+{
+    size_t size = disk_image_size(io_fd);
+    int flags = writable && !io_journal ? MAP_SHARED : MAP_PRIVATE;
+    
+    // map disk img into memory, private if never written back or if
+    //      written back by journal commit only
+    if (io_map_flags & EXT2_IO_MAP_POPULATE) {
+        flags |= MAP_POPULATE;
+    }
+    disk = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, io_fd, 0);
+    if (disk == MAP_FAILED) {
+        return -1;
+    }
+    if (io_map_flags & EXT2_IO_MAP_HUGEPAGE) {
+        // taken only where file THP is supported
+        madvise(disk, size, MADV_HUGEPAGE);
+    }
+    
+    io_meta_blocks = io_meta_end(disk);
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t meta_len = ((size_t)io_meta_blocks * EXT2_BLOCK_SIZE + page_size - 1) / page_size * page_size;
+    if (meta_len > size) {
+        meta_len = size;
+    }
+    if (!(io_map_flags & EXT2_IO_MAP_POPULATE)) {
+        int rs = -1;
+#ifdef MADV_POPULATE_READ
+        rs = madvise(disk, meta_len, MADV_POPULATE_READ);
+#endif
+        // older kernel: only start reading it in
+        if (rs) {
+            madvise(disk, meta_len, MADV_WILLNEED);
+        }
+    }
+    if (io_access == EXT2_IO_ACCESS_RANDOM) {
+        madvise(disk + meta_len, size - meta_len, MADV_RANDOM);
+    } else if (io_access == EXT2_IO_ACCESS_SEQUENTIAL) {
+        madvise(disk + meta_len, size - meta_len, MADV_SEQUENTIAL);
+    }
+    return 0;
+}
+
+/*
+ *  Read superblock, group descriptor, bitmaps and inode table, they
+ *      are addressed through pointers all over utils and stay resident.
+ */
+static int io_load_metadata(void)
+{
+    unsigned char head[3 * EXT2_BLOCK_SIZE];
+    if (io_rw_blocks(0, 0, 3, head)) {
+        return -1;
+    }
+    io_meta_blocks = io_meta_end(head);
+    
+    disk = malloc((size_t)EXT2_BLOCK_SIZE * io_meta_blocks);
+    io_meta_clean = malloc((size_t)EXT2_BLOCK_SIZE * io_meta_blocks);
+    if (disk == NULL || io_meta_clean == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    
+    // in chunks, read concurrently with uring or threads backend
+    int num_reqs = (io_meta_blocks + EXT2_IO_META_CHUNK - 1) / EXT2_IO_META_CHUNK;
+    struct io_req *reqs = malloc(sizeof(struct io_req) * num_reqs);
+    int i;
+    for (i = 0; i < num_reqs; i++) {
+        int block_num = i * EXT2_IO_META_CHUNK;
+        int num_blocks = io_meta_blocks - block_num;
+        if (num_blocks > EXT2_IO_META_CHUNK) {
+            num_blocks = EXT2_IO_META_CHUNK;
+        }
+        struct io_req req = {0, block_num, num_blocks, disk + (size_t)EXT2_BLOCK_SIZE * block_num, 0};
+        reqs[i] = req;
+    }
+    int rs = io_submit_batch(reqs, num_reqs);
+    free(reqs);
+    if (rs) {
+        return -1;
+    }
+    memcpy(io_meta_clean, disk, (size_t)EXT2_BLOCK_SIZE * io_meta_blocks);
+    
+    // hash table about twice the cache size
+    int hash_size = 1;
+    while (hash_size < io_cache_blocks * 2) {
+        hash_size *= 2;
+    }
+    io_hash = calloc(hash_size, sizeof(struct io_buf *));
+    io_hash_mask = hash_size - 1;
+    return 0;
+}
+
+int ext2_io_open(const char *path,
+                 int writable)
+{
+    if (io_journal_replay(path)) {
+        return -1;
+    }
+    io_fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (io_fd == -1) {
+        return -1;
+    }
+    io_writable = writable;
+    
+    // uring falls back to threads, threads to plain pread
+    if (io_backend == EXT2_IO_URING && io_uring_init()) {
+        io_backend = EXT2_IO_THREADS;
+    }
+    if (io_backend == EXT2_IO_THREADS && io_pool_init()) {
+        io_backend = EXT2_IO_PREAD;
+    }
+    
+    if (io_backend == EXT2_IO_MMAP) {
+        if (io_map_image(writable)) {
+            return -1;
+        }
+        // --sync, --journal: changed metadata is found against a clean copy
+        if ((io_durable || io_journal) && writable) {
+            size_t meta_len = (size_t)EXT2_BLOCK_SIZE * io_meta_blocks;
+            io_meta_clean = malloc(meta_len);
+            if (io_meta_clean == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            memcpy(io_meta_clean, disk, meta_len);
+        }
+    } else {
+        if (io_load_metadata()) {
+            return -1;
+        }
+        // readahead of data blocks per access pattern
+        off_t meta_len = (off_t)io_meta_blocks * EXT2_BLOCK_SIZE;
+        if (io_access == EXT2_IO_ACCESS_RANDOM) {
+            posix_fadvise(io_fd, meta_len, 0, POSIX_FADV_RANDOM);
+        } else if (io_access == EXT2_IO_ACCESS_SEQUENTIAL) {
+            posix_fadvise(io_fd, meta_len, 0, POSIX_FADV_SEQUENTIAL);
+        }
+    }
+    
+    // Init utils
+    ext2_utils_init();
+    
+    if (writable) {
+        // counters may be stale after a crash, bitmaps are the truth
+        int valid = sb->s_state & EXT2_VALID_FS;
+        if (!valid && io_recount) {
+            ext2_counters_recompute();
+        }
+        // without recount the caller checks and fixes counters itself
+        io_was_valid = valid || !io_recount;
+        // unclean until counters are folded back on close, a journal
+        //      commit carries both at once instead
+        if (valid && !io_journal) {
+            sb->s_state &= ~EXT2_VALID_FS;
+            if (io_backend != EXT2_IO_MMAP) {
+                if (io_rw_blocks(1, 1, 1, disk + EXT2_BLOCK_SIZE)) {
+                    return -1;
+                }
+                memcpy(io_meta_clean + EXT2_BLOCK_SIZE, disk + EXT2_BLOCK_SIZE, EXT2_BLOCK_SIZE);
+            }
+        }
+        atexit(io_sync_at_exit);
+    }
+    
+    if ((io_durable || io_journal) && writable) {
+        io_dirty = calloc(sb->s_blocks_count / 8 + 1, 1);
+        if (io_dirty == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    if (io_journal && writable && io_backend == EXT2_IO_MMAP) {
+        io_dirty_meta = calloc(sb->s_blocks_count / 8 + 1, 1);
+        if (io_dirty_meta == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,156 @@
+#ifndef ext2_io_h
+#define ext2_io_h
+
+#include <stdio.h>
+#include "ext2.h"
+
+/* Block backends */
+#define EXT2_IO_MMAP    0   /* whole image mapped, blocks are pointers into it */
+#define EXT2_IO_PREAD   1   /* pread/pwrite through a bounded buffer cache */
+#define EXT2_IO_URING   2   /* as pread, batches go through io_uring */
+#define EXT2_IO_THREADS 3   /* as pread, batches spread over a thread pool */
+
+/* Access patterns, readahead advice for data blocks */
+#define EXT2_IO_ACCESS_NORMAL     0
+#define EXT2_IO_ACCESS_RANDOM     1 /* lookups, few scattered blocks */
+#define EXT2_IO_ACCESS_SEQUENTIAL 2 /* copy, whole files in block order */
+
+/* Mapping options of mmap backend */
+#define EXT2_IO_MAP_POPULATE 0x1    /* prefault whole image at open */
+#define EXT2_IO_MAP_HUGEPAGE 0x2    /* ask for transparent huge pages */
+
+/* ext2_block_put() dirty value for file content, or a fresh copy no
+ *  metadata points at yet: written in place ahead of a journal commit
+ *  rather than through the journal. Any other non zero value is
+ *  metadata (directory and indirect blocks). */
+#define EXT2_IO_DIRTY_DATA 2
+
+/* Journal magics, "<image>.journal" holds one transaction at most */
+#define EXT2_IO_JOURNAL_MAGIC  "EXT2JRNL"
+#define EXT2_IO_JOURNAL_COMMIT "EXT2CMIT"
+
+/* Default buffer cache size of cached backends, in blocks */
+#define EXT2_IO_DEFAULT_CACHE_BLOCKS 1024
+/* Entries of io_uring submission queue, requests in flight at most */
+#define EXT2_IO_QUEUE_DEPTH 64
+/* Workers of thread pool backend */
+#define EXT2_IO_POOL_THREADS 8
+/* Blocks per read when loading resident metadata */
+#define EXT2_IO_META_CHUNK 32
+
+/*
+ *  Take "--io=mmap|pread|uring|threads", "--cache=N" (cache size in
+ *      blocks, all but mmap backend), "--access=normal|random|sequential",
+ *      "--map=populate|hugepage" (mmap backend, may be repeated),
+ *      "--sync" (changes are durable on exit) and "--journal" (changes
+ *      are committed atomically through "<image>.journal") out of argv
+ *      wherever they are.
+ *  Return: int
+ *      -1 if a value is invalid
+ *       0 if success
+ */
+int ext2_io_parse_flags(int *argc,
+                        const char *argv[]);
+
+/*
+ *  Set access pattern of the tool, "--access=" overrides it if this is
+ *      called before ext2_io_parse_flags().
+ *  Parameters:
+ *      int :   EXT2_IO_ACCESS_*
+ */
+void ext2_io_set_access(int access);
+
+/*
+ *  Set if a writable open of an image left unclean (EXT2_VALID_FS not
+ *      set) recomputes free counts from bitmaps, on by default. A tool
+ *      that checks and fixes counters itself turns it off before
+ *      ext2_io_open(), the image is then marked clean on close.
+ *  Parameters:
+ *      int :   0 to keep counters as found
+ */
+void ext2_io_set_recount(int recount);
+
+/*
+ *  Open image with the backend picked by ext2_io_parse_flags() (mmap by
+ *      default), set disk and init utils. A transaction committed to
+ *      "<image>.journal" but not written in place yet is replayed first,
+ *      even if writable is 0, and an uncommitted one is dropped. uring backend falls back to
+ *      threads if io_uring can't be set up, threads to pread. With mmap
+ *      the metadata pages are prefaulted and the rest of the mapping is
+ *      advised per access pattern. Superblock, group descriptor,
+ *      bitmaps and inode table stay resident behind disk with either
+ *      backend, other blocks must be reached through ext2_block_get().
+ *      Changes are written back on exit, unless writable is 0, then
+ *      they stay in memory only (pread backend keeps changed blocks in
+ *      cache past its size). A writable open of an image left unclean
+ *      recomputes free counts, unless ext2_io_set_recount(0).
+ *  Parameters:
+ *      const char * :   path of image file
+ *      int          :   if 0, image is never written
+ *  Return: int
+ *      -1 if image can't be opened (errno set)
+ *       0 if success
+ */
+int ext2_io_open(const char *path,
+                 int writable);
+
+/*
+ *  Get a pointer to the content of a block, pinned until the matching
+ *      ext2_block_put(). A pinned block is never evicted, so pointers
+ *      held across nested calls stay valid.
+ *  Parameters:
+ *      int :   block number
+ *  Return: unsigned char *
+ *      EXT2_BLOCK_SIZE bytes of the block
+ */
+unsigned char *ext2_block_get(int block_num);
+
+/*
+ *  Like ext2_block_get(), for a block about to be fully overwritten:
+ *      content is not read from image and is undefined.
+ *  Parameters:
+ *      int :   block number
+ *  Return: unsigned char *
+ *      EXT2_BLOCK_SIZE bytes of the block
+ */
+unsigned char *ext2_block_get_new(int block_num);
+
+/*
+ *  Unpin a block got from ext2_block_get() or ext2_block_get_new().
+ *  Parameters:
+ *      int :   block number
+ *      int :   set if the block was changed, EXT2_IO_DIRTY_DATA if it
+ *              holds file content
+ */
+void ext2_block_put(int block_num,
+                    int dirty);
+
+/*
+ *  Read blocks not cached yet in batches, queued all at once with uring
+ *      or threads backend, so a walk over them doesn't stall on each
+ *      read. No-op with mmap backend.
+ *  Parameters:
+ *      const int * :   block numbers
+ *      int         :   number of blocks
+ *  Return: int
+ *      -1 if a read failed
+ *       0 if success
+ */
+int ext2_io_prefetch(const int *block_nums,
+                     int num_blocks);
+
+/*
+ *  Write every changed block back to the image, in one batch. With
+ *      "--sync", also flush the blocks changed since last call (and
+ *      only those) to stable storage, mmap backend included. With
+ *      "--journal", every change since last call is one transaction:
+ *      file content is written in place and flushed, then metadata
+ *      blocks are logged to the journal, committed, and written in
+ *      place.
+ *  Return: int
+ *      -1 if a write failed
+ *       0 if success
+ */
+int ext2_io_sync(void);
+
+#endif /* ext2_io_h */
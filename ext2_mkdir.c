@@ -4,6 +4,7 @@
  Please read the specifications to make sure you're implementing everything correctly (e.g., directory entries should be aligned to 4B, entry names are not null-terminated, etc.).
  When you allocate a new inode or data block, you *must use the next one available* from the corresponding bitmap (excluding reserved inodes, of course). Failure to do so will result in deductions, so please be careful about this requirement.
  Be careful to consider trailing slashes in paths. These will show up during testing so it's your responsibility to make your code as robust as possible by capturing corner cases.
+ Locality mode: with "--locality", new inodes and blocks are placed by locality instead of taking the next one available: a dir made in root goes to the least used region of the image, anything else next to its parent, and file blocks follow the region of their inode and each other.
  */
 
 #include <stdio.h>
@@ -19,6 +20,7 @@
 #include <string.h>
 #include <errno.h>
 #include "ext2_utils.h"
+#include "ext2_io.h"
 
 unsigned char *disk;
 
@@ -29,28 +31,35 @@ unsigned char *inode_bitmap;
 struct ext2_inode *inode_table;
 
 int main(int argc, const char * argv[]) {
+    // "--stats" prints hot path counters on exit
+    ext2_stats_parse_flag(&argc, argv);
+    // "--locality" places new inodes and blocks near their parent
+    ext2_alloc_parse_flag(&argc, argv);
+    // a path lookup touches a few scattered blocks
+    ext2_io_set_access(EXT2_IO_ACCESS_RANDOM);
+    // "--io=", "--cache=", "--access=" and "--map=" set up the block backend
+    if (ext2_io_parse_flags(&argc, argv)) {
+        fprintf(stderr, "Invalid --io, --cache, --access or --map value\n");
+        exit(1);
+    }
+    
     if(argc != 3) {
         fprintf(stderr, "Usage: <image file name> <absolute path of new dir>\n");
         exit(1);
     }
-    int fd = open(argv[1], O_RDWR);
-    
-    // map disk img into memory
-    disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if(disk == MAP_FAILED) {
-        perror("mmap");
+    // open disk img through block backend, written back on exit
+    if (ext2_io_open(argv[1], 1)) {
+        perror(argv[1]);
         exit(1);
     }
     
-    // Init utils
-    ext2_utils_init();
-    
     char path[PATH_MAX];
     char new_dir_name[EXT2_NAME_LEN];
     char parent_path[PATH_MAX];
     
     // Copy argv[2] to user stack
-    memcpy(path, argv[2], strlen(argv[2]));
+    strncpy(path, argv[2], PATH_MAX - 1);
+    path[PATH_MAX - 1] = '\0';
     
     // Case: handle user input path end with '/'
     // For example.
@@ -68,7 +77,7 @@ int main(int argc, const char * argv[]) {
     
     
     // Find out in which inode this dir should be created
-    int in_which_inode = get_inode_number_by_path(parent_path);
+    int in_which_inode = get_inode_number_by_path_follow(EXT2_ROOT_INO, parent_path, 1);
     if (in_which_inode == -1) {
         return ENOENT;
     }
@@ -79,9 +88,8 @@ int main(int argc, const char * argv[]) {
     }
     
     // create dir
-    int rs;
-    if ((rs = inode_mkdir(in_which_inode, new_dir_name)) != 0) {
-        return rs;
+    if (inode_mkdir(in_which_inode, new_dir_name) < 0) {
+        return ENOSPC;
     }
     
 }
@@ -4,6 +4,8 @@
  Note: If the directory entry for the file has not been overwritten, you will still need to make sure that the inode has not been reused, and that none of its data blocks have been reallocated. You may assume that the bitmaps are reliable indicators of such fact. If the file cannot be fully restored, your program should terminate with ENOENT, indicating that the operation was unsuccessful.
  Note(2): For testing, you should focus primarily on restoring files that you've removed using your ext2_rm implementation, since ext2_restore should undo the exact changes made by ext2_rm. While there are some removed entries already present in some of the image files provided, the respective files have been removed on a non-ext2 file system, which is not doing the removal the same way that ext2 would. In ext2, when you do "rm", the inode's i_blocks do not get zeroed, and you can do full recovery, as stated in the assignment (which deals solely with ext2 images, hence why you only have to worry about this type of (simpler) recovery). In other FSs things work differently. In ext3, when you rm a file, the data block indexes from its inode do get zeroed, so recovery is not as trivial. For example, there are some removed files in deletedfile.img, which have their blocks zero-ed out (due to how these images were created). There are also some unrecoverable entries in images like twolevel.img, largefile.img, etc. In such cases, your code should still work, but simply recover a file as an empty file (with no data blocks), or discard the entry if it is unrecoverable. However, for the most part, try to recover files that you've ext2_rm-ed yourself, to make sure that you can restore data blocks as well. We will not be testing recovery of files removed with a non-ext2 tool.
  Note(3): We will not try to recover files that had hardlinks at the time of removal. This is because when trying to restore a file, if its inode is already in use, there are two options: the file we're trying to restore previously had other hardlinks (and hence its inode never really got invalidated), _or_ its inode has been re-allocated to a completely new file. Since there is no way to tell between these 2 possibilities, recovery in this case should not be attempted.
+ Scan mode: with "-a" (or "--scan") instead of a path, every directory block in the image is swept once, all deleted entries found in the gaps are indexed and restored in one pass. An optional fnmatch(3) pattern after the flag restores only the entries whose absolute path matches. Deleted directories are skipped unless "-r" is given too. Each entry is reported as "Restored: <path>" or "Unrecoverable: <path>".
+ Recursive mode: with "-r", a removed directory is restored with all its contents, depth-first. Its inode and blocks must not be reused; a child whose inode or blocks were reused is dropped from the directory, so is a child whose inode is still in use through a hard link outside the tree (see Note(3)). Bitmap counters are adjusted once at the end.
  BONUS: Implement an additional "-r" flag (after the disk image argument), which allows restoring directories as well. In this case, you will have to recursively restore all the contents of the directory specified in the last argument. If "-r" is used with a regular file or link, then it should be ignored (the restore operation should be carried out as if the flag had not been entered). If you decide to do the bonus, make sure first that your ext2_restore works, then create a new copy of it and rename it to ext2_restore_bonus.c, and implement the additional functionality in this separate source file.
  */
 
@@ -19,7 +21,9 @@
 #include <limits.h>
 #include <string.h>
 #include <errno.h>
+#include <fnmatch.h>
 #include "ext2_utils.h"
+#include "ext2_io.h"
 
 unsigned char *disk;
 
@@ -29,42 +33,123 @@ unsigned char *block_bitmap;
 unsigned char *inode_bitmap;
 struct ext2_inode *inode_table;
 
+/*
+ *  Restore every recoverable entry in the image whose path match pattern.
+ *      pattern NULL match all. Dir is restored only if recursive set.
+ *  Return: int
+ *      ENOENT if no entry match
+ */
+int restore_scan(const char *pattern, int recursive) {
+    struct ext2_undelete_entry *index;
+    int index_size = build_undelete_index(&index);
+    int num_matched = 0;
+    int i;
+    
+    for (i = 0; i < index_size; i++) {
+        char path[PATH_MAX];
+        if (get_path_by_inode_number(index[i].parent_inode_num, path, PATH_MAX - EXT2_NAME_LEN - 1)) {
+            continue;
+        }
+        if (strcmp(path, "/") != 0) {
+            strcat(path, "/");
+        }
+        strcat(path, index[i].name);
+        
+        if (pattern != NULL && fnmatch(pattern, path, 0) != 0) {
+            continue;
+        }
+        
+        // dir need its contents restored as well
+        if (index[i].file_type == EXT2_FT_DIR && !recursive) {
+            continue;
+        }
+        num_matched++;
+        
+        if (index[i].recoverable && restore_undelete_entry(index + i) == 0) {
+            printf("Restored: %s\n", path);
+        } else {
+            printf("Unrecoverable: %s\n", path);
+        }
+    }
+    
+    free(index);
+    return num_matched ? 0 : ENOENT;
+}
+
 int main(int argc, const char * argv[]) {
-    if(argc != 3) {
-        fprintf(stderr, "Usage: <image file name> <absolute path of rm file>\n");
+    // "--stats" prints hot path counters on exit
+    ext2_stats_parse_flag(&argc, argv);
+    // a path lookup touches a few scattered blocks
+    ext2_io_set_access(EXT2_IO_ACCESS_RANDOM);
+    // "--io=", "--cache=", "--access=" and "--map=" set up the block backend
+    if (ext2_io_parse_flags(&argc, argv)) {
+        fprintf(stderr, "Invalid --io, --cache, --access or --map value\n");
+        exit(1);
+    }
+    
+    // if -a flag set, this will be set to 1
+    int scan_mode = 0;
+    // if -r flag set, this will be set to 1
+    int recursive = 0;
+    int arg_idx = 2;
+    
+    while (arg_idx < argc && argv[arg_idx][0] == '-') {
+        if (strcmp("-a", argv[arg_idx]) == 0 || strcmp("--scan", argv[arg_idx]) == 0) {
+            scan_mode = 1;
+        } else if (strcmp("-r", argv[arg_idx]) == 0) {
+            recursive = 1;
+        } else {
+            break;
+        }
+        arg_idx++;
+    }
+    
+    if(argc < 2 ||
+       (!scan_mode && argc - arg_idx != 1) ||
+       (scan_mode && argc - arg_idx > 1)) {
+        fprintf(stderr, "Usage: <image file name> [-r] <absolute path of rm file>\n"
+                        "       <image file name> [-r] <-a|--scan> [path pattern]\n");
+        exit(1);
+    }
+    // open disk img through block backend, written back on exit
+    if (ext2_io_open(argv[1], 1)) {
+        perror(argv[1]);
         exit(1);
     }
-    int fd = open(argv[1], O_RDWR);
     
-    // map disk img into memory
-    disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if(disk == MAP_FAILED) {
-        perror("mmap");
+    // keep reference counts of shared blocks correct
+    if (dedup_load(argv[1], 0)) {
+        fprintf(stderr, "Invalid dedup index\n");
         exit(1);
     }
     
-    // Init utils
-    ext2_utils_init();
+    if (scan_mode) {
+        return restore_scan(arg_idx < argc ? argv[arg_idx] : NULL, recursive);
+    }
     
     //
-    unsigned long path_len = strlen(argv[2]) + 1;
+    unsigned long path_len = strlen(argv[arg_idx]) + 1;
     char path[path_len];
     char path_parent[path_len];
     char path_name[EXT2_NAME_LEN];
     
-    strcpy(path, argv[2]);
+    strcpy(path, argv[arg_idx]);
     clear_end_slash(path);
     cut_path(path, path_parent, path_name);
     
     // check if exist
-    int parent_inode_num = get_inode_number_by_path(path_parent);
+    int parent_inode_num = get_inode_number_by_path_follow(EXT2_ROOT_INO, path_parent, 1);
     if (parent_inode_num < 0) {
         return ENOENT;
     }
     
     struct ext2_inode *parent_inode = inode_table + parent_inode_num - 1;
     
-    if (restore_from_dir_entry(parent_inode, path_name)) {
+    if (restore_from_dir_entry(parent_inode, path_name) == 0) {
+        return 0;
+    }
+    
+    if (!recursive || restore_dir_from_dir_entry(parent_inode, path_name)) {
         return ENOENT;
     }
     
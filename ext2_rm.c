@@ -1,5 +1,6 @@
 /*
  This program takes two command line arguments. The first is the name of an ext2 formatted virtual disk, and the second is an absolute path to a file or link (not a directory) on that disk. The program should work like rm, removing the specified file from the disk. If the file does not exist or if it is a directory, then your program should return the appropriate error. Once again, please read the specifications of ext2 carefully, to figure out what needs to actually happen when a file or link is removed (e.g., no need to zero out data blocks, must set i_dtime in the inode, removing a directory entry need not shift the directory entries after the one being deleted, etc.).
+ Recursive mode: with "-r" (after the disk image argument) a directory is removed with everything under it. All inodes and blocks of the subtree are collected first and freed in one sorted bitmap sweep, with the superblock and group counters updated once. The directory blocks are left intact so "ext2_restore -r" can bring the tree back. With a regular file or link "-r" is ignored.
  BONUS: Implement an additional "-r" flag (after the disk image argument), which allows removing directories as well. In this case, you will have to recursively remove all the contents of the directory specified in the last argument. If "-r" is used with a regular file or link, then it should be ignored (the ext2_rm operation should be carried out as if the flag had not been entered). If you decide to do the bonus, make sure first that your ext2_rm works, then create a new copy of it and rename it to ext2_rm_bonus.c, and implement the additional functionality in this separate source file.
  */
  
@@ -17,6 +18,7 @@
 #include <string.h>
 #include <errno.h>
 #include "ext2_utils.h"
+#include "ext2_io.h"
 
 unsigned char *disk;
 
@@ -27,35 +29,55 @@ unsigned char *inode_bitmap;
 struct ext2_inode *inode_table;
 
 int main(int argc, const char * argv[]) {
-    if(argc != 3) {
-        fprintf(stderr, "Usage: <image file name> <absolute path of rm file>\n");
+    // "--stats" prints hot path counters on exit
+    ext2_stats_parse_flag(&argc, argv);
+    // a path lookup touches a few scattered blocks
+    ext2_io_set_access(EXT2_IO_ACCESS_RANDOM);
+    // "--io=", "--cache=", "--access=" and "--map=" set up the block backend
+    if (ext2_io_parse_flags(&argc, argv)) {
+        fprintf(stderr, "Invalid --io, --cache, --access or --map value\n");
         exit(1);
     }
-    int fd = open(argv[1], O_RDWR);
     
-    // map disk img into memory
-    disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if(disk == MAP_FAILED) {
-        perror("mmap");
+    // if -r flag set, this will be set to 1
+    int recursive = 0;
+    
+    if (argc == 4 && strcmp("-r", argv[2]) == 0) {
+        recursive = 1;
+    }
+    
+    if(argc != 3 + recursive) {
+        fprintf(stderr, "Usage: <image file name> [-r] <absolute path of rm file>\n");
+        exit(1);
+    }
+    // open disk img through block backend, written back on exit
+    if (ext2_io_open(argv[1], 1)) {
+        perror(argv[1]);
         exit(1);
     }
     
-    // Init utils
-    ext2_utils_init();
+    // keep reference counts of shared blocks correct
+    if (dedup_load(argv[1], 0)) {
+        fprintf(stderr, "Invalid dedup index\n");
+        exit(1);
+    }
     
     //
-    unsigned long path_len = strlen(argv[2]) + 1;
+    unsigned long path_len = strlen(argv[2 + recursive]) + 1;
     char path[path_len];
     char path_parent[path_len];
     char path_name[EXT2_NAME_LEN];
     
-    strcpy(path, argv[2]);
+    strcpy(path, argv[2 + recursive]);
     clear_end_slash(path);
     cut_path(path, path_parent, path_name);
     
     // check if exist
-    int parent_inode_num = get_inode_number_by_path(path_parent);
-    int file_inode_num = get_inode_number_by_path(path);
+    int parent_inode_num = get_inode_number_by_path_follow(EXT2_ROOT_INO, path_parent, 1);
+    if (parent_inode_num < 0) {
+        return ENOENT;
+    }
+    int file_inode_num = get_inode_number_by_name(parent_inode_num, path_name);
     if (file_inode_num < 0) {
         return ENOENT;
     }
@@ -63,7 +85,15 @@ int main(int argc, const char * argv[]) {
     struct ext2_inode *parent_inode = inode_table + parent_inode_num - 1;
     struct ext2_inode *file_inode = inode_table + file_inode_num - 1;
     if (file_inode->i_mode & EXT2_S_IFDIR) {
-        return EISDIR;
+        if (!recursive) {
+            return EISDIR;
+        }
+        // never remove a dir through its "." or ".."
+        if (strcmp(path_name, ".") == 0 || strcmp(path_name, "..") == 0) {
+            return EINVAL;
+        }
+        remove_dir_from_dir_entry(parent_inode, path_name);
+        return 0;
     }
     
     remove_from_dir_entry(parent_inode, path_name);
@@ -2,8 +2,14 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <time.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "ext2_utils.h"
+#include "ext2_io.h"
 
 extern unsigned char *disk;
 
@@ -13,8 +19,286 @@ extern unsigned char *block_bitmap;
 extern unsigned char *inode_bitmap;
 extern struct ext2_inode *inode_table;
 
+// Cache of resolved symlink target, indexed by inode number
+struct symlink_cache_entry {
+    int  inode_num;
+    char target[EXT2_BLOCK_SIZE];
+};
+static struct symlink_cache_entry symlink_cache[EXT2_SYMLINK_CACHE_SIZE];
+
+// Free-space summary of recently modified dirs, indexed by inode number
+struct dir_space_summary {
+    int             dir_inode_num;  // 0 if slot unused
+    int             num_blocks;
+    int             blocks_cap;
+    int             next_fit;       // block to start next search from
+    int            *block_nums;
+    unsigned short *largest_gap;    // largest space a new entry can take, per block
+};
+static struct dir_space_summary dir_space_cache[EXT2_DIR_SPACE_CACHE_SIZE];
+
+__thread struct ext2_stats *ext2_stats_self;
+static struct ext2_stats *stats_list;
+
+// One traced call, times in ns from CLOCK_MONOTONIC
+struct trace_event {
+    const char *name;
+    long long   start_ns;
+    long long   dur_ns;
+};
+
+// Ring of one thread, only its owner writes it. Rings are pushed on a
+//      global list without lock and never freed, dumped on exit.
+struct trace_ring {
+    struct trace_ring  *next;
+    int                 tid;
+    unsigned long       num_events;     // total recorded, ring keeps the last EXT2_TRACE_RING_SIZE
+    struct trace_event  events[EXT2_TRACE_RING_SIZE];
+};
+
+int ext2_trace_enabled;
+static const char *trace_path;
+static struct trace_ring *trace_rings;
+static int trace_next_tid;
+static __thread struct trace_ring *trace_thread_ring;
+
+// Scope of a traced call, its end is recorded when it goes out of scope
+struct trace_scope {
+    const char *name;
+    long long   start_ns;   // 0 if tracing off
+};
+
+static long long trace_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static struct trace_ring *trace_ring_of_thread(void)
+{
+    struct trace_ring *ring = trace_thread_ring;
+    if (ring) {
+        return ring;
+    }
+    ring = calloc(1, sizeof(struct trace_ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->tid = __atomic_add_fetch(&trace_next_tid, 1, __ATOMIC_RELAXED);
+    ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        // ring->next reloaded by failed exchange
+    }
+    trace_thread_ring = ring;
+    return ring;
+}
+
+static void trace_scope_end(struct trace_scope *scope)
+{
+    if (scope->start_ns == 0) {
+        return;
+    }
+    struct trace_ring *ring = trace_ring_of_thread();
+    if (ring == NULL) {
+        return;
+    }
+    struct trace_event *event = ring->events + ring->num_events % EXT2_TRACE_RING_SIZE;
+    event->name     = scope->name;
+    event->start_ns = scope->start_ns;
+    event->dur_ns   = trace_now_ns() - scope->start_ns;
+    __atomic_store_n(&ring->num_events, ring->num_events + 1, __ATOMIC_RELEASE);
+}
+
+// Put at the top of a function to trace it, tracing off costs a test
+#define TRACE_SCOPE(name) \
+    struct trace_scope trace_scope_ __attribute__((cleanup(trace_scope_end))) = \
+        {(name), ext2_trace_enabled ? trace_now_ns() : 0}
+
+int ext2_trace_dump(void)
+{
+    FILE *out = fopen(trace_path, "w");
+    if (out == NULL) {
+        return -1;
+    }
+    size_t path_len = strlen(trace_path);
+    int json_lines = path_len > 6 && strcmp(trace_path + path_len - 6, ".jsonl") == 0;
+    int pid = (int)getpid();
+    int first = 1;
+    struct trace_ring *ring;
+    
+    if (!json_lines) {
+        fprintf(out, "{\"traceEvents\":[\n");
+    }
+    for (ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        unsigned long num_events = __atomic_load_n(&ring->num_events, __ATOMIC_ACQUIRE);
+        unsigned long i = num_events > EXT2_TRACE_RING_SIZE ? num_events - EXT2_TRACE_RING_SIZE : 0;
+        for (; i < num_events; i++) {
+            struct trace_event *event = ring->events + i % EXT2_TRACE_RING_SIZE;
+            if (json_lines) {
+                fprintf(out, "{\"name\":\"%s\",\"tid\":%d,\"ts_ns\":%lld,\"dur_ns\":%lld}\n",
+                        event->name, ring->tid, event->start_ns, event->dur_ns);
+            } else {
+                // chrome trace wants microseconds
+                fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                        first ? "" : ",\n", event->name, pid, ring->tid,
+                        event->start_ns / 1e3, event->dur_ns / 1e3);
+            }
+            first = 0;
+        }
+    }
+    if (!json_lines) {
+        fprintf(out, "\n]}\n");
+    }
+    return fclose(out) == 0 ? 0 : -1;
+}
+
+static void ext2_trace_dump_at_exit(void)
+{
+    if (ext2_trace_dump()) {
+        perror(trace_path);
+    }
+}
+// page faults at the time "--stats" was seen
+static struct rusage stats_start_usage;
+
+static void ext2_stats_print_at_exit(void)
+{
+    ext2_stats_print(stderr);
+}
+
+
+int ext2_stats_parse_flag(int *argc,
+                          const char *argv[])
+{
+    int found = 0;
+    int i;
+    int j = 1;
+    
+    for (i = 1; i < *argc; i++) {
+        if (strcmp("--stats", argv[i]) == 0) {
+            found = 1;
+        } else {
+            argv[j++] = argv[i];
+        }
+    }
+    *argc = j;
+    argv[j] = NULL;
+    
+    if (found) {
+        getrusage(RUSAGE_SELF, &stats_start_usage);
+        atexit(ext2_stats_print_at_exit);
+    }
+    return found;
+}
+
+// set by "--locality", allocation goals are ignored without it
+static int alloc_locality;
+
+int ext2_alloc_parse_flag(int *argc,
+                          const char *argv[])
+{
+    int i;
+    int j = 1;
+    
+    for (i = 1; i < *argc; i++) {
+        if (strcmp("--locality", argv[i]) == 0) {
+            alloc_locality = 1;
+        } else {
+            argv[j++] = argv[i];
+        }
+    }
+    *argc = j;
+    argv[j] = NULL;
+    return alloc_locality;
+}
+
+struct ext2_stats *ext2_stats_of_thread(void)
+{
+    struct ext2_stats *stats = ext2_stats_self;
+    if (stats) {
+        return stats;
+    }
+    stats = aligned_alloc(64, sizeof(struct ext2_stats));
+    if (stats == NULL) {
+        perror("aligned_alloc");
+        exit(ENOMEM);
+    }
+    memset(stats, 0, sizeof(struct ext2_stats));
+    // pushed without lock and never freed, like trace rings
+    stats->next = __atomic_load_n(&stats_list, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&stats_list, &stats->next, stats, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        // stats->next reloaded by failed exchange
+    }
+    ext2_stats_self = stats;
+    return stats;
+}
+
+void ext2_stats_sum(struct ext2_stats *total)
+{
+    struct ext2_stats *stats = __atomic_load_n(&stats_list, __ATOMIC_ACQUIRE);
+    
+    memset(total, 0, sizeof(struct ext2_stats));
+    for (; stats; stats = stats->next) {
+        total->ialloc_bits_scanned   += stats->ialloc_bits_scanned;
+        total->dalloc_bits_scanned   += stats->dalloc_bits_scanned;
+        total->dir_entries_visited   += stats->dir_entries_visited;
+        total->blocks_touched        += stats->blocks_touched;
+        total->i_block_array_mallocs += stats->i_block_array_mallocs;
+        total->blocks_read           += stats->blocks_read;
+        total->blocks_written        += stats->blocks_written;
+        total->io_batches            += stats->io_batches;
+        total->sync_ranges           += stats->sync_ranges;
+        total->journal_blocks        += stats->journal_blocks;
+        total->prealloc_hits         += stats->prealloc_hits;
+    }
+}
+
+void ext2_stats_print(FILE *out)
+{
+    struct ext2_stats ext2_stats;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    ext2_stats_sum(&ext2_stats);
+    
+    fprintf(out, "%-28s%lu\n", "ialloc bits scanned:", ext2_stats.ialloc_bits_scanned);
+    fprintf(out, "%-28s%lu\n", "dalloc bits scanned:", ext2_stats.dalloc_bits_scanned);
+    fprintf(out, "%-28s%lu\n", "dir entries visited:", ext2_stats.dir_entries_visited);
+    fprintf(out, "%-28s%lu\n", "blocks touched:", ext2_stats.blocks_touched);
+    fprintf(out, "%-28s%lu\n", "i_block array mallocs:", ext2_stats.i_block_array_mallocs);
+    fprintf(out, "%-28s%lu/%lu\n", "blocks read/written:", ext2_stats.blocks_read, ext2_stats.blocks_written);
+    fprintf(out, "%-28s%lu\n", "io batches:", ext2_stats.io_batches);
+    fprintf(out, "%-28s%lu\n", "sync ranges:", ext2_stats.sync_ranges);
+    fprintf(out, "%-28s%lu\n", "blocks journaled:", ext2_stats.journal_blocks);
+    fprintf(out, "%-28s%lu\n", "preallocated blocks used:", ext2_stats.prealloc_hits);
+    fprintf(out, "%-28s%ld/%ld\n", "page faults (minor/major):",
+            usage.ru_minflt - stats_start_usage.ru_minflt,
+            usage.ru_majflt - stats_start_usage.ru_majflt);
+}
+
+
+size_t disk_image_size(int fd) {
+    struct stat st;
+    
+    if (fstat(fd, &st) == -1 || st.st_size < DISK_SIZE * 1024) {
+        return DISK_SIZE * 1024;
+    }
+    return st.st_size;
+}
+
+static void alloc_init(void);
+static void prealloc_init(void);
 
 void ext2_utils_init() {
+    // Tracing, registered once even if init is called again
+    if (!ext2_trace_enabled && getenv("EXT2_TRACE") && getenv("EXT2_TRACE")[0]) {
+        trace_path = getenv("EXT2_TRACE");
+        ext2_trace_enabled = 1;
+        atexit(ext2_trace_dump_at_exit);
+    }
+    
     // Init global varible.
     // setup sb, gdt, block_bitmap, inode_bitmap, inode_table
     sb = (struct ext2_super_block *)(disk + EXT2_BLOCK_SIZE);
@@ -22,6 +306,9 @@ void ext2_utils_init() {
     block_bitmap = (unsigned char *)(disk + (gdt->bg_block_bitmap * EXT2_BLOCK_SIZE));
     inode_bitmap = (unsigned char *)(disk + (gdt->bg_inode_bitmap * EXT2_BLOCK_SIZE));
     inode_table = (struct ext2_inode *)(disk + (gdt->bg_inode_table * EXT2_BLOCK_SIZE));
+    
+    alloc_init();
+    prealloc_init();
     return;
 }
 
@@ -29,6 +316,7 @@ void ext2_utils_init() {
 int get_inode_number_by_name(int in_which_dir_num,
                              char *name)
 {
+    TRACE_SCOPE("get_inode_number_by_name");
     // Inode index = inode number - 1
     // Get inode by inode index.
     struct ext2_inode *in_which_inode = inode_table + in_which_dir_num - 1;
@@ -37,7 +325,9 @@ int get_inode_number_by_name(int in_which_dir_num,
     int *in_which_inode_i_block_array = read_i_block_into_array(in_which_inode);
     // walk through each datablock of parent dir
     while (in_which_inode_i_block_array[curr_i_block] != -1) {
-        unsigned char *in_which_inode_data = disk + EXT2_BLOCK_SIZE * in_which_inode_i_block_array[curr_i_block];
+        int block_num = in_which_inode_i_block_array[curr_i_block];
+        unsigned char *in_which_inode_data = ext2_block_get(block_num);
+        EXT2_STATS_ADD(blocks_touched, 1);
         
         // Dir entry struct
         struct ext2_dir_entry *entry;
@@ -46,14 +336,22 @@ int get_inode_number_by_name(int in_which_dir_num,
         // walk through datablock
         while (curr_entry_off < EXT2_BLOCK_SIZE) {
             entry = (struct ext2_dir_entry *)(in_which_inode_data + curr_entry_off);
-            if (strncmp(entry->name, name, entry->name_len) == 0) {
-                return entry->inode;
+            EXT2_STATS_ADD(dir_entries_visited, 1);
+            if (entry->inode != 0 &&
+                entry->name_len == strlen(name) &&
+                strncmp(entry->name, name, entry->name_len) == 0) {
+                int found_inode_num = entry->inode;
+                ext2_block_put(block_num, 0);
+                free(in_which_inode_i_block_array);
+                return found_inode_num;
             }
             curr_entry_off += entry->rec_len;
         }
+        ext2_block_put(block_num, 0);
         curr_i_block++;
     }
     // If reach here no match found
+    free(in_which_inode_i_block_array);
     return -1;
 }
 
@@ -122,6 +420,7 @@ int get_inode_number_by_path_helper(char *path,
 
 int get_inode_number_by_path(char *path)
 {
+    TRACE_SCOPE("get_inode_number_by_path");
     // Invaild path not start with '/'
     if (path[0] != '/') {
         return -1;
@@ -135,20 +434,166 @@ int get_inode_number_by_path(char *path)
     return get_inode_number_by_path_helper(path + 1, 2);
 }
 
+int read_symlink(struct ext2_inode *link_inode,
+                 char *buf,
+                 int buf_size)
+{
+    char *target;
+    int target_len = link_inode->i_size;
+    int fast = is_fast_symlink(link_inode);
+    
+    if (fast) {
+        target = (char *)link_inode->i_block;
+    } else {
+        target = (char *)ext2_block_get(link_inode->i_block[0]);
+    }
+    
+    // i_size of slow symlink may count the ending null char
+    if (target_len > EXT2_BLOCK_SIZE) {
+        target_len = EXT2_BLOCK_SIZE;
+    }
+    target_len = strnlen(target, target_len);
+    if (target_len >= buf_size) {
+        target_len = -1;
+    } else {
+        memcpy(buf, target, target_len);
+        buf[target_len] = '\0';
+    }
+    if (!fast) {
+        ext2_block_put(link_inode->i_block[0], 0);
+    }
+    return target_len;
+}
+
+/*
+ *  Return cached target of symlink inode, read it into cache on miss.
+ *      NULL if target can not be read.
+ */
+static char *symlink_cache_lookup(int link_inode_num)
+{
+    struct symlink_cache_entry *slot = symlink_cache + (link_inode_num % EXT2_SYMLINK_CACHE_SIZE);
+    
+    if (slot->inode_num == link_inode_num) {
+        return slot->target;
+    }
+    
+    struct ext2_inode *link_inode = inode_table + link_inode_num - 1;
+    if (read_symlink(link_inode, slot->target, sizeof(slot->target)) < 0) {
+        slot->inode_num = 0;
+        return NULL;
+    }
+    slot->inode_num = link_inode_num;
+    return slot->target;
+}
+
+void symlink_cache_invalidate(int link_inode_num)
+{
+    struct symlink_cache_entry *slot = symlink_cache + (link_inode_num % EXT2_SYMLINK_CACHE_SIZE);
+    
+    if (slot->inode_num == link_inode_num) {
+        slot->inode_num = 0;
+    }
+}
+
+int get_inode_number_by_path_follow(int in_which_dir,
+                                    char *path,
+                                    int follow_last)
+{
+    TRACE_SCOPE("get_inode_number_by_path_follow");
+    // Remaining path to resolve, a symlink target get spliced in front
+    //      of the rest of path.
+    char remain[PATH_MAX];
+    char next_remain[PATH_MAX];
+    char name[EXT2_NAME_LEN + 1];
+    int num_hops = 0;
+    int curr_inode_num = in_which_dir;
+    
+    if (strlen(path) >= PATH_MAX) {
+        return -1;
+    }
+    strcpy(remain, path);
+    char *curr = remain;
+    if (curr[0] == '/') {
+        curr_inode_num = EXT2_ROOT_INO;
+    }
+    
+    while (1) {
+        // skip slashes
+        while (*curr == '/') {
+            curr++;
+        }
+        // reach end of path
+        if (*curr == '\0') {
+            return curr_inode_num;
+        }
+        
+        // only dir can hold next level
+        struct ext2_inode *curr_inode = inode_table + curr_inode_num - 1;
+        if ((curr_inode->i_mode & 0xF000) != EXT2_S_IFDIR) {
+            return -1;
+        }
+        
+        // Prepare name of this level
+        int name_len = strcspn(curr, "/");
+        if (name_len > EXT2_NAME_LEN) {
+            return -1;
+        }
+        memcpy(name, curr, name_len);
+        name[name_len] = '\0';
+        curr += name_len;
+        
+        int next_level_inode = get_inode_number_by_name(curr_inode_num, name);
+        if (next_level_inode == -1) {
+            return -1;
+        }
+        
+        struct ext2_inode *next_inode = inode_table + next_level_inode - 1;
+        int is_last = (curr[strspn(curr, "/")] == '\0');
+        if ((next_inode->i_mode & 0xF000) != EXT2_S_IFLNK ||
+            (is_last && !follow_last)) {
+            curr_inode_num = next_level_inode;
+            continue;
+        }
+        
+        // Follow symlink, stay in current dir for relative target
+        if (++num_hops > EXT2_MAX_SYMLINK_HOPS) {
+            return -1;
+        }
+        char *target = symlink_cache_lookup(next_level_inode);
+        if (target == NULL ||
+            strlen(target) + 1 + strlen(curr) >= PATH_MAX) {
+            return -1;
+        }
+        if (target[0] == '/') {
+            curr_inode_num = EXT2_ROOT_INO;
+        }
+        strcpy(next_remain, target);
+        strcat(next_remain, "/");
+        strcat(next_remain, curr);
+        strcpy(remain, next_remain);
+        curr = remain;
+    }
+}
+
 int inode_mkdir(int parent,
                 char *new_dir_name)
 {
+    TRACE_SCOPE("inode_mkdir");
     struct ext2_inode *parent_inode = inode_table + parent - 1;
     
-    int new_dir_inode_num = ialloc();
-    int new_dir_datablock_idx = dalloc();
-    if (new_dir_inode_num < 0 || new_dir_datablock_idx < 0) {
-        return ENOSPC;
+    int new_dir_inode_num = ialloc_near(parent, 1);
+    if (new_dir_inode_num < 0) {
+        return -1;
+    }
+    int new_dir_datablock_idx = dalloc_near(block_goal_of_inode(new_dir_inode_num));
+    if (new_dir_datablock_idx < 0) {
+        ifree(new_dir_inode_num);
+        return -1;
     }
     
     // Build inode and datablock for new dir
     struct ext2_inode *new_dir_inode = inode_table + new_dir_inode_num - 1;
-    unsigned char *new_dir_datablock = disk + (EXT2_BLOCK_SIZE * new_dir_datablock_idx);
+    unsigned char *new_dir_datablock = ext2_block_get(new_dir_datablock_idx);
     
     new_dir_inode->i_mode           = 0x0000 | EXT2_S_IFDIR;
     new_dir_inode->i_uid            = 0;
@@ -161,6 +606,7 @@ int inode_mkdir(int parent,
     new_dir_inode->i_blocks         = new_dir_inode->i_size/512;
     new_dir_inode->i_flags          = 0;
     new_dir_inode->osd1             = 0;
+    memset(new_dir_inode->i_block, 0, sizeof(new_dir_inode->i_block));
     new_dir_inode->i_block[0]       = new_dir_datablock_idx;
     new_dir_inode->i_generation     = 0;
     new_dir_inode->i_file_acl       = 0;
@@ -170,6 +616,7 @@ int inode_mkdir(int parent,
     
     // Init dir_entry datablock for new dir
     init_dir_entry(new_dir_datablock, new_dir_inode_num, parent);
+    ext2_block_put(new_dir_datablock_idx, 1);
     
     // Add inode back to parent dir entry
     add_to_dir_entry(parent_inode, new_dir_inode_num, new_dir_name, EXT2_FT_DIR);
@@ -177,603 +624,2782 @@ int inode_mkdir(int parent,
     // Update gdt
     gdt->bg_used_dirs_count++;
     
+    return new_dir_inode_num;
+}
+
+/*
+ *  Number of datablocks of an inode, indirect block not included.
+ */
+static int inode_num_data_blocks(struct ext2_inode *inode)
+{
+    int total_blocks = inode->i_blocks / 2;
+    if (is_fast_symlink(inode)) {
+        return 0;
+    }
+    return total_blocks > 12 ? total_blocks - 1 : total_blocks;
+}
+
+/*
+ *  Add a datablock to the end of an inode's block map, indirect block
+ *      get allocated when direct blocks run out. i_blocks is updated,
+ *      i_size is left to caller.
+ *  Return: int
+ *      ENOSPC if no enought space
+ *      0      if success
+ */
+static int append_block_to_inode(struct ext2_inode *inode,
+                                 int block_num)
+{
+    int idx = inode_num_data_blocks(inode);
+    
+    if (idx < 12) {
+        inode->i_block[idx] = block_num;
+        inode->i_blocks += 2;
+        return 0;
+    }
+    
+    // Since disk size is 128kb, only consider the cases that
+    //      there is only one indirect block.
+    if (idx - 12 >= EXT2_BLOCK_SIZE / 4) {
+        return ENOSPC;
+    }
+    if (idx == 12) {
+        // with --locality, first free block after the first one it maps
+        int indirect_block_num = dalloc_near(block_num);
+        if (indirect_block_num < 0) {
+            return ENOSPC;
+        }
+        inode->i_block[12] = indirect_block_num;
+        inode->i_blocks += 2;
+        // reused block may hold stale block numbers
+        memset(ext2_block_get_new(indirect_block_num), 0, EXT2_BLOCK_SIZE);
+        ext2_block_put(indirect_block_num, 1);
+    }
+    unsigned int *indirect_block = (unsigned int *)ext2_block_get(inode->i_block[12]);
+    indirect_block[idx - 12] = block_num;
+    ext2_block_put(inode->i_block[12], 1);
+    inode->i_blocks += 2;
     return 0;
 }
 
-void add_to_dir_entry(struct ext2_inode *parent_inode,
-                      unsigned int inode_num,
-                      char *name,
-                      unsigned char type)
+/*
+ *  Largest space in a dir datablock a new entry can take.
+ */
+static int dir_block_largest_gap(unsigned char *dir_data)
 {
-    int parent_inode_last_block_index = (parent_inode->i_blocks / 2) - 1;
-    unsigned char *parent_inode_data = disk + EXT2_BLOCK_SIZE * parent_inode->i_block[parent_inode_last_block_index];
+    int largest_gap = 0;
+    int curr_off = 0;
     
-    // Find out the last entry
-    int curr_entry_off = 0;
-    struct ext2_dir_entry *entry;
-    while (1) {
-        entry = (struct ext2_dir_entry *)(parent_inode_data + curr_entry_off);
-        if (entry->rec_len + curr_entry_off == EXT2_BLOCK_SIZE) {
-            
-            //handle case: no space for last entry
-            if (entry->rec_len - sizeof(struct ext2_dir_entry) - entry->name_len < sizeof(struct ext2_dir_entry) + strlen(name)) {
-                // allocate new block on datablock
-                int new_block_number = dalloc();
-                if (new_block_number < 0) {
-                    exit(ENOSPC);
-                }
-                
-                // add this block back to parent inode
-                parent_inode->i_block[parent_inode_last_block_index + 1] = new_block_number;
-                parent_inode->i_blocks += 2;
-                
-                // add entry in this block
-                entry = (struct ext2_dir_entry *)(disk + EXT2_BLOCK_SIZE * new_block_number);
-                // Build entry in parent for new dir
-                entry->file_type    = type;
-                entry->inode        = inode_num;
-                entry->name_len     = strlen(name);
-                entry->rec_len      = EXT2_BLOCK_SIZE;
-                memcpy(entry->name, name, entry->name_len);
-                // align name, padding null char to the end of entry->name
-                int padding_len = 4 - (entry->name_len % 4);
-                memset(entry->name + entry->name_len, '\0', padding_len);
-                
-                // Update link count for self
-                struct ext2_inode *self_inode = inode_table + (inode_num - 1);
-                self_inode->i_links_count++;
-                return;
-            }
-            
-            
+    while (curr_off < EXT2_BLOCK_SIZE) {
+        struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(dir_data + curr_off);
+        if (entry->rec_len == 0) {
             break;
         }
-        curr_entry_off += entry->rec_len;
+        int gap = entry->rec_len;
+        if (entry->inode) {
+            gap -= EXT2_DIR_REC_LEN(entry->name_len);
+        }
+        if (gap > largest_gap) {
+            largest_gap = gap;
+        }
+        curr_off += entry->rec_len;
+    }
+    return largest_gap;
+}
+
+/*
+ *  Return free-space summary of a dir, build it on miss or if the dir's
+ *      block map no longer match the summary.
+ */
+static struct dir_space_summary *dir_space_lookup(int dir_inode_num)
+{
+    struct dir_space_summary *summary = dir_space_cache + (dir_inode_num % EXT2_DIR_SPACE_CACHE_SIZE);
+    struct ext2_inode *dir_inode = inode_table + dir_inode_num - 1;
+    int num_blocks = inode_num_data_blocks(dir_inode);
+    
+    if (summary->dir_inode_num == dir_inode_num &&
+        summary->num_blocks == num_blocks &&
+        (num_blocks == 0 || summary->block_nums[0] == dir_inode->i_block[0])) {
+        return summary;
     }
     
-    // Update the last entry's rec_len
-    int last_entry_len = sizeof(struct ext2_dir_entry) + entry->name_len;
-    if (last_entry_len % 4) {   // align
-        last_entry_len += 4 - (last_entry_len % 4);
+    // (re)build
+    int *dir_iblock_array = read_i_block_into_array(dir_inode);
+    int i;
+    free(summary->block_nums);
+    free(summary->largest_gap);
+    summary->dir_inode_num = dir_inode_num;
+    summary->num_blocks    = num_blocks;
+    summary->blocks_cap    = num_blocks;
+    summary->next_fit      = 0;
+    summary->block_nums    = malloc(sizeof(int) * (num_blocks + 1));
+    summary->largest_gap   = malloc(sizeof(unsigned short) * (num_blocks + 1));
+    for (i = 0; i < num_blocks; i++) {
+        summary->block_nums[i] = dir_iblock_array[i];
+        summary->largest_gap[i] = dir_block_largest_gap(ext2_block_get(dir_iblock_array[i]));
+        ext2_block_put(dir_iblock_array[i], 0);
     }
-    entry->rec_len = last_entry_len;
+    free(dir_iblock_array);
+    return summary;
+}
+
+/*
+ *  Recompute summary of one datablock of a dir, if the dir is cached.
+ */
+static void dir_space_update_block(int dir_inode_num,
+                                   int block_num)
+{
+    struct dir_space_summary *summary = dir_space_cache + (dir_inode_num % EXT2_DIR_SPACE_CACHE_SIZE);
+    int i;
     
-    // Move to next
-    curr_entry_off += entry->rec_len;
-    entry = (struct ext2_dir_entry *)(parent_inode_data + curr_entry_off);
+    if (summary->dir_inode_num != dir_inode_num) {
+        return;
+    }
+    for (i = 0; i < summary->num_blocks; i++) {
+        if (summary->block_nums[i] == block_num) {
+            summary->largest_gap[i] = dir_block_largest_gap(ext2_block_get(block_num));
+            ext2_block_put(block_num, 0);
+            return;
+        }
+    }
+}
+
+/*
+ *  Drop cached summary of a dir.
+ */
+static void dir_space_invalidate(int dir_inode_num)
+{
+    struct dir_space_summary *summary = dir_space_cache + (dir_inode_num % EXT2_DIR_SPACE_CACHE_SIZE);
     
-    // Build entry in parent for new dir
+    if (summary->dir_inode_num == dir_inode_num) {
+        summary->dir_inode_num = 0;
+    }
+}
+
+/*
+ *  Build a dir entry at given place.
+ */
+static void build_dir_entry(struct ext2_dir_entry *entry,
+                            unsigned int inode_num,
+                            char *name,
+                            unsigned char type,
+                            int rec_len)
+{
     entry->file_type    = type;
     entry->inode        = inode_num;
     entry->name_len     = strlen(name);
-    entry->rec_len      = EXT2_BLOCK_SIZE - curr_entry_off;
+    entry->rec_len      = rec_len;
     memcpy(entry->name, name, entry->name_len);
     // align name, padding null char to the end of entry->name
-    int padding_len = 4 - (entry->name_len % 4);
+    int padding_len = EXT2_DIR_REC_LEN(entry->name_len) - sizeof(struct ext2_dir_entry) - entry->name_len;
     memset(entry->name + entry->name_len, '\0', padding_len);
-    
-    // Update link count for self
-    struct ext2_inode *self_inode = inode_table + (inode_num - 1);
-    self_inode->i_links_count++;
-    
 }
 
-int remove_from_dir_entry(struct ext2_inode * parent_inode,
-                          char *name)
+void add_to_dir_entry(struct ext2_inode *parent_inode,
+                      unsigned int inode_num,
+                      char *name,
+                      unsigned char type)
 {
-    int *parent_inode_iblock_array = read_i_block_into_array(parent_inode);
-    struct ext2_dir_entry *prev_entry;
-    struct ext2_dir_entry *curr_entry;
+    TRACE_SCOPE("add_to_dir_entry");
+    int parent_inode_num = parent_inode - inode_table + 1;
+    int need_len = EXT2_DIR_REC_LEN(strlen(name));
+    struct dir_space_summary *summary = dir_space_lookup(parent_inode_num);
+    unsigned char *parent_inode_data;
+    int parent_block_num;
+    int i = 0;
+    int n;
     
-    int i = -1;
-    int curr_offset = 1024;
-    while (parent_inode_iblock_array[i] != -1) {
-        if (curr_offset == EXT2_BLOCK_SIZE) {
-            i++;
-            curr_offset = 0;
-            prev_entry = (struct ext2_dir_entry *)(disk + EXT2_BLOCK_SIZE * parent_inode_iblock_array[i] + curr_offset);
-            curr_entry = (struct ext2_dir_entry *)(disk + EXT2_BLOCK_SIZE * parent_inode_iblock_array[i] + curr_offset);
+    // Next fit: start from the block took the last entry
+    for (n = 0; n < summary->num_blocks; n++) {
+        i = (summary->next_fit + n) % summary->num_blocks;
+        if (summary->largest_gap[i] >= need_len) {
+            break;
+        }
+    }
+    
+    EXT2_STATS_ADD(blocks_touched, 1);
+    if (n == summary->num_blocks) {
+        //handle case: no space in any block
+        // allocate new block on datablock
+        // take from reservation of dir, so its blocks stay together
+        int last_block = summary->num_blocks ? summary->block_nums[summary->num_blocks - 1] : -1;
+        int new_block_number = dalloc_grow(parent_inode_num, last_block);
+        if (new_block_number < 0) {
+            exit(ENOSPC);
+        }
+        
+        // add this block back to parent inode
+        if (append_block_to_inode(parent_inode, new_block_number)) {
+            exit(ENOSPC);
+        }
+        parent_inode->i_size += EXT2_BLOCK_SIZE;
+        
+        // add entry in this block
+        parent_block_num = new_block_number;
+        parent_inode_data = ext2_block_get(parent_block_num);
+        build_dir_entry((struct ext2_dir_entry *)parent_inode_data, inode_num, name, type, EXT2_BLOCK_SIZE);
+        
+        if (summary->num_blocks == summary->blocks_cap) {
+            summary->blocks_cap = summary->blocks_cap * 2 + 1;
+            summary->block_nums = realloc(summary->block_nums, sizeof(int) * summary->blocks_cap);
+            summary->largest_gap = realloc(summary->largest_gap, sizeof(unsigned short) * summary->blocks_cap);
         }
+        i = summary->num_blocks++;
+        summary->block_nums[i] = new_block_number;
         
-        if (strncmp(name, curr_entry->name, curr_entry->name_len) == 0) {
-            // do entry del
-            prev_entry->rec_len += curr_entry->rec_len;
-            // update inode link count
-            struct ext2_inode *curr_inode = inode_table + curr_entry->inode - 1;
-            curr_inode->i_links_count--;
+    } else {
+        // Find out the entry whose gap fit new entry
+        parent_block_num = summary->block_nums[i];
+        parent_inode_data = ext2_block_get(parent_block_num);
+        int curr_entry_off = 0;
+        struct ext2_dir_entry *entry;
+        while (curr_entry_off < EXT2_BLOCK_SIZE) {
+            entry = (struct ext2_dir_entry *)(parent_inode_data + curr_entry_off);
             
-            // inode link count drop to 0
-            if (curr_inode->i_links_count == 0) {
-                free_inode(curr_entry->inode);
+            if (entry->inode == 0 && entry->rec_len >= need_len) {
+                // reuse unused entry in place
+                build_dir_entry(entry, inode_num, name, type, entry->rec_len);
+                break;
             }
             
-            free(parent_inode_iblock_array);
-            return 0;
+            int last_entry_len = EXT2_DIR_REC_LEN(entry->name_len);
+            if (entry->inode && entry->rec_len - last_entry_len >= need_len) {
+                // Split entry, new entry take its gap
+                struct ext2_dir_entry *new_entry = (struct ext2_dir_entry *)(parent_inode_data + curr_entry_off + last_entry_len);
+                build_dir_entry(new_entry, inode_num, name, type, entry->rec_len - last_entry_len);
+                entry->rec_len = last_entry_len;
+                break;
+            }
+            curr_entry_off += entry->rec_len;
         }
-        
-        prev_entry = curr_entry;
-        curr_offset += curr_entry->rec_len;
-        curr_entry = (struct ext2_dir_entry *)(disk + EXT2_BLOCK_SIZE * parent_inode_iblock_array[i] + curr_offset);
     }
     
-    free(parent_inode_iblock_array);
-    return -1;
+    summary->largest_gap[i] = dir_block_largest_gap(parent_inode_data);
+    summary->next_fit = i;
+    ext2_block_put(parent_block_num, 1);
+    
+    // Update link count for self
+    struct ext2_inode *self_inode = inode_table + (inode_num - 1);
+    self_inode->i_links_count++;
+    
 }
 
-int restore_from_dir_entry(struct ext2_inode *parent_inode,
-                           char *name)
+/*
+ *  Take entry name out of a dir, the space goes to the previous entry.
+ *      First entry in a datablock has its inode set to 0 instead.
+ *  Return: int
+ *      inode number of the removed entry
+ *      -1 if no entry name found
+ */
+static int unlink_dir_entry(struct ext2_inode *parent_inode,
+                            char *name)
 {
     int *parent_inode_iblock_array = read_i_block_into_array(parent_inode);
     int i = 0;
-    int curr_off = 0;
-    struct ext2_dir_entry *entry;
     
     while (parent_inode_iblock_array[i] != -1) {
+        unsigned char *parent_data = ext2_block_get(parent_inode_iblock_array[i]);
+        struct ext2_dir_entry *prev_entry = NULL;
+        int curr_offset = 0;
+        EXT2_STATS_ADD(blocks_touched, 1);
         
-        entry = (struct ext2_dir_entry *)(disk + EXT2_BLOCK_SIZE * parent_inode_iblock_array[i] + curr_off);
-        int gap_size = entry->rec_len - sizeof(struct ext2_dir_entry) - entry->name_len;
-        int gap_off = 0;
-        if (entry->name_len%4) {
-            gap_off = 4 - (entry->name_len%4);
-        }
-        
-        while (gap_off < gap_size) {
-            if (gap_size < sizeof(struct ext2_dir_entry) + 4) {
+        while (curr_offset < EXT2_BLOCK_SIZE) {
+            struct ext2_dir_entry *curr_entry = (struct ext2_dir_entry *)(parent_data + curr_offset);
+            if (curr_entry->rec_len == 0) {
                 break;
             }
-            struct ext2_dir_entry *gap_entry = (struct ext2_dir_entry *)(disk + EXT2_BLOCK_SIZE * parent_inode_iblock_array[i] + curr_off + sizeof(struct ext2_dir_entry) + entry->name_len + gap_off);
-            if (strncmp(name, gap_entry->name, gap_entry->name_len) == 0) {
-                struct ext2_inode *curr_gap_inode = inode_table + gap_entry->inode - 1;
-                
-                // if inode for deleted entry reused, can't recover
-                if (curr_gap_inode->i_dtime == 0) {
-                    return -1;
-                }
-                
-                // restore inode
-                curr_gap_inode->i_links_count++;
-                curr_gap_inode->i_dtime = 0;
-                
-                // restore dir entry
-                gap_entry->rec_len = entry->rec_len - gap_off - sizeof(struct ext2_dir_entry) - entry->name_len;
-                entry->rec_len = sizeof(struct ext2_dir_entry) + entry->name_len + gap_off;
-                
-                
-                // restore inode bitmap
-                if (restore_inode_bitmap(gap_entry->inode)) {
-                    return -1;
-                }
-                
-                
-                // restore block bitmap
-                if (curr_gap_inode->i_blocks == 0) {
-                    return 0; // if blocks zeroed out
-                }
-                
-                int *curr_gap_inode_iblock_array = read_i_block_into_array(curr_gap_inode);
-                int j = 0;
-                while (curr_gap_inode_iblock_array[j] != -1) {
-                    if (restore_block_bitmap(curr_gap_inode_iblock_array[j])) {
-                        return -1;
-                    }
-                    j++;
-                }
-                if (j >= 12) {// restore indirect block
-                    if (restore_block_bitmap(curr_gap_inode->i_block[12])) {
-                        return -1;
-                    };
+            EXT2_STATS_ADD(dir_entries_visited, 1);
+            
+            if (curr_entry->inode != 0 &&
+                curr_entry->name_len == strlen(name) &&
+                strncmp(name, curr_entry->name, curr_entry->name_len) == 0) {
+                // do entry del
+                int inode_num = curr_entry->inode;
+                if (prev_entry) {
+                    prev_entry->rec_len += curr_entry->rec_len;
+                } else {
+                    curr_entry->inode = 0;
                 }
-                
-                return 0;
+                dir_space_update_block(parent_inode - inode_table + 1, parent_inode_iblock_array[i]);
+                ext2_block_put(parent_inode_iblock_array[i], 1);
+                free(parent_inode_iblock_array);
+                return inode_num;
             }
             
-            gap_off += gap_entry->name_len + sizeof(struct ext2_dir_entry);
-            if (gap_entry->name_len%4) {
-                gap_off += 4 - (gap_entry->name_len%4);
-            }
-        }
-        
-        curr_off += entry->rec_len;
-        
-        if (curr_off == EXT2_BLOCK_SIZE) {
-            i++;
+            prev_entry = curr_entry;
+            curr_offset += curr_entry->rec_len;
         }
+        ext2_block_put(parent_inode_iblock_array[i], 0);
+        i++;
     }
     
-    // If reach here, not found
+    free(parent_inode_iblock_array);
     return -1;
 }
 
-void init_dir_entry(unsigned char *entry_datablock,
+int remove_from_dir_entry(struct ext2_inode * parent_inode,
+                          char *name)
+{
+    TRACE_SCOPE("remove_from_dir_entry");
+    int inode_num = unlink_dir_entry(parent_inode, name);
+    if (inode_num < 0) {
+        return -1;
+    }
+    
+    // update inode link count
+    struct ext2_inode *curr_inode = inode_table + inode_num - 1;
+    curr_inode->i_links_count--;
+    
+    // inode link count drop to 0
+    if (curr_inode->i_links_count == 0) {
+        free_inode(inode_num);
+    }
+    
+    return 0;
+}
+
+/*
+ *  Mark a inode deleted and add it with its blocks to batch.
+ */
+static void release_inode_into_batch(int inode_num,
+                                     struct bitmap_batch *batch)
+{
+    struct ext2_inode *inode = inode_table + inode_num - 1;
+    
+    // set del time
+    inode->i_dtime = (unsigned int)time(NULL);
+    inode->i_links_count = 0;
+    if ((inode->i_mode & 0xF000) == EXT2_S_IFDIR) {
+        gdt->bg_used_dirs_count--;
+        dir_space_invalidate(inode_num);
+    }
+    
+    // drop cached symlink target, inode number may be reused
+    symlink_cache_invalidate(inode_num);
+    // and blocks reserved for its growth
+    prealloc_discard(inode_num);
+    
+    bitmap_batch_add_inode(batch, inode_num);
+    
+    // block shared by dedup is freed with its last reference
+    int *inode_iblock_array = read_i_block_into_array(inode);
+    int i = 0;
+    while (inode_iblock_array[i] != -1) {
+        if (dedup_release_block(inode_iblock_array[i])) {
+            bitmap_batch_add_block(batch, inode_iblock_array[i]);
+        }
+        i++;
+    }
+    if (i > 12) { // indirect block
+        bitmap_batch_add_block(batch, inode->i_block[12]);
+    }
+    free(inode_iblock_array);
+}
+
+/*
+ *  Release every child of a dir depth-first. Dir datablocks are left
+ *      untouched, so restore_dir_from_dir_entry() can walk them again.
+ */
+static void remove_dir_contents_rec(int dir_inode_num,
+                                    struct bitmap_batch *batch)
+{
+    struct ext2_inode *dir_inode = inode_table + dir_inode_num - 1;
+    int *dir_iblock_array = read_i_block_into_array(dir_inode);
+    int i = 0;
+    
+    prefetch_block_array(dir_iblock_array);
+    while (dir_iblock_array[i] != -1) {
+        unsigned char *dir_data = ext2_block_get(dir_iblock_array[i]);
+        int curr_off = 0;
+        
+        while (curr_off < EXT2_BLOCK_SIZE) {
+            struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(dir_data + curr_off);
+            if (entry->rec_len == 0) {
+                break;
+            }
+            curr_off += entry->rec_len;
+            
+            if (entry->inode == 0 ||
+                (entry->name_len == 1 && entry->name[0] == '.') ||
+                (entry->name_len == 2 && entry->name[0] == '.' && entry->name[1] == '.')) {
+                continue;
+            }
+            
+            struct ext2_inode *child_inode = inode_table + entry->inode - 1;
+            if ((child_inode->i_mode & 0xF000) == EXT2_S_IFDIR) {
+                remove_dir_contents_rec(entry->inode, batch);
+                release_inode_into_batch(entry->inode, batch);
+            } else if (child_inode->i_links_count <= 1) {
+                release_inode_into_batch(entry->inode, batch);
+            } else {
+                // hard link outside this dir keep inode alive
+                child_inode->i_links_count--;
+            }
+        }
+        ext2_block_put(dir_iblock_array[i], 0);
+        i++;
+    }
+    
+    free(dir_iblock_array);
+}
+
+int remove_dir_from_dir_entry(struct ext2_inode *parent_inode,
+                              char *name)
+{
+    TRACE_SCOPE("remove_dir_from_dir_entry");
+    struct bitmap_batch batch = BITMAP_BATCH_INIT;
+    
+    int dir_inode_num = get_inode_number_by_name(parent_inode - inode_table + 1, name);
+    if (dir_inode_num < 0 ||
+        (inode_table[dir_inode_num - 1].i_mode & 0xF000) != EXT2_S_IFDIR ||
+        unlink_dir_entry(parent_inode, name) < 0) {
+        return -1;
+    }
+    
+    // ".." in removed dir
+    parent_inode->i_links_count--;
+    
+    remove_dir_contents_rec(dir_inode_num, &batch);
+    release_inode_into_batch(dir_inode_num, &batch);
+    bitmap_batch_free(&batch);
+    bitmap_batch_destroy(&batch);
+    
+    return 0;
+}
+
+/*
+ *  Test if bit for inode_num or block_num is set in bitmap.
+ *      bit 0 in inode bitmap is inode 1,
+ *      bit 0 in block bitmap is s_first_data_block.
+ */
+static int test_inode_bitmap(int inode_num)
+{
+    int bit = inode_num - 1;
+    return (inode_bitmap[bit / 8] >> (bit % 8)) & 1;
+}
+
+static int test_block_bitmap(int block_num)
+{
+    int bit = block_num - sb->s_first_data_block;
+    return (block_bitmap[bit / 8] >> (bit % 8)) & 1;
+}
+
+/*
+ *  Check if a entry found in gap looks like a real deleted entry.
+ *      gap_end is the offset (in block) where the gap ends.
+ */
+static int is_valid_gap_entry(struct ext2_dir_entry *gap_entry,
+                              int gap_off,
+                              int gap_end)
+{
+    int i;
+    
+    if (gap_entry->inode < EXT2_GOOD_OLD_FIRST_INO ||
+        gap_entry->inode > sb->s_inodes_count ||
+        gap_entry->name_len == 0 ||
+        gap_off + sizeof(struct ext2_dir_entry) + gap_entry->name_len > gap_end ||
+        gap_entry->rec_len < EXT2_DIR_REC_LEN(gap_entry->name_len) ||
+        gap_entry->rec_len % 4 ||
+        gap_off + gap_entry->rec_len > EXT2_BLOCK_SIZE) {
+        return 0;
+    }
+    if (gap_entry->file_type != EXT2_FT_REG_FILE &&
+        gap_entry->file_type != EXT2_FT_DIR &&
+        gap_entry->file_type != EXT2_FT_SYMLINK) {
+        return 0;
+    }
+    for (i = 0; i < gap_entry->name_len; i++) {
+        if (gap_entry->name[i] == '\0' || gap_entry->name[i] == '/') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ *  Append every deleted entry found in the gaps of one dir to index.
+ *  Return: int
+ *      new size of index
+ */
+static int scan_dir_gaps(int dir_inode_num,
+                         struct ext2_undelete_entry **index,
+                         int index_size,
+                         int *index_cap)
+{
+    struct ext2_inode *dir_inode = inode_table + dir_inode_num - 1;
+    int *dir_iblock_array = read_i_block_into_array(dir_inode);
+    int i = 0;
+    
+    prefetch_block_array(dir_iblock_array);
+    while (dir_iblock_array[i] != -1) {
+        unsigned char *dir_data = ext2_block_get(dir_iblock_array[i]);
+        int curr_off = 0;
+        
+        while (curr_off < EXT2_BLOCK_SIZE) {
+            struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(dir_data + curr_off);
+            if (entry->rec_len < 8 || curr_off + entry->rec_len > EXT2_BLOCK_SIZE) {
+                break; // corrupted block
+            }
+            
+            // gap start after the live entry, its name padding included
+            int gap_off = curr_off;
+            if (entry->inode) {
+                gap_off += EXT2_DIR_REC_LEN(entry->name_len);
+            }
+            int gap_end = curr_off + entry->rec_len;
+            
+            // deleted entries are 4 bytes aligned, try each offset
+            while (gap_off + sizeof(struct ext2_dir_entry) < gap_end) {
+                struct ext2_dir_entry *gap_entry = (struct ext2_dir_entry *)(dir_data + gap_off);
+                if (!is_valid_gap_entry(gap_entry, gap_off, gap_end)) {
+                    gap_off += 4;
+                    continue;
+                }
+                
+                if (index_size == *index_cap) {
+                    *index_cap = *index_cap ? *index_cap * 2 : 64;
+                    *index = realloc(*index, sizeof(struct ext2_undelete_entry) * (*index_cap));
+                }
+                struct ext2_undelete_entry *found = *index + index_size;
+                memcpy(found->name, gap_entry->name, gap_entry->name_len);
+                found->name[gap_entry->name_len] = '\0';
+                found->parent_inode_num = dir_inode_num;
+                found->inode_num        = gap_entry->inode;
+                found->file_type        = gap_entry->file_type;
+                found->block_num        = dir_iblock_array[i];
+                found->block_off        = gap_off;
+                found->recoverable      = inode_recoverable(gap_entry->inode);
+                index_size++;
+                
+                gap_off += EXT2_DIR_REC_LEN(gap_entry->name_len);
+            }
+            
+            curr_off += entry->rec_len;
+        }
+        ext2_block_put(dir_iblock_array[i], 0);
+        i++;
+    }
+    
+    free(dir_iblock_array);
+    return index_size;
+}
+
+int inode_recoverable(int inode_num)
+{
+    struct ext2_inode *inode = inode_table + inode_num - 1;
+    
+    // if inode for deleted entry reused, can't recover
+    if (test_inode_bitmap(inode_num) || inode->i_dtime == 0) {
+        return 0;
+    }
+    
+    // none of its datablock can be reallocated
+    int *inode_iblock_array = read_i_block_into_array(inode);
+    int result = 1;
+    int i = 0;
+    while (inode_iblock_array[i] != -1) {
+        if (inode_iblock_array[i] < sb->s_first_data_block ||
+            inode_iblock_array[i] >= sb->s_blocks_count ||
+            (test_block_bitmap(inode_iblock_array[i]) && !dedup_is_shared(inode_iblock_array[i]))) {
+            result = 0;
+            break;
+        }
+        i++;
+    }
+    if (result && i > 12 && test_block_bitmap(inode->i_block[12])) {
+        result = 0;
+    }
+    
+    free(inode_iblock_array);
+    return result;
+}
+
+int build_undelete_index(struct ext2_undelete_entry **index)
+{
+    TRACE_SCOPE("build_undelete_index");
+    int index_size = 0;
+    int index_cap = 0;
+    int inode_num;
+    
+    *index = NULL;
+    
+    // Each live dir is scanned once, so is each dir datablock
+    for (inode_num = 1; inode_num <= sb->s_inodes_count; inode_num++) {
+        struct ext2_inode *inode = inode_table + inode_num - 1;
+        if ((inode->i_mode & 0xF000) != EXT2_S_IFDIR ||
+            inode->i_dtime != 0 ||
+            !test_inode_bitmap(inode_num)) {
+            continue;
+        }
+        index_size = scan_dir_gaps(inode_num, index, index_size, &index_cap);
+    }
+    
+    return index_size;
+}
+
+/*
+ *  Put a deleted entry back to its dir datablock by splitting the gap
+ *      holding it. Earlier restore in this block may have split the gap.
+ *  Return: int
+ *      -1 if entry no longer in a gap
+ *       0 if success
+ */
+static int relink_gap_entry(struct ext2_undelete_entry *found)
+{
+    unsigned char *dir_data = ext2_block_get(found->block_num);
+    struct ext2_dir_entry *gap_entry = (struct ext2_dir_entry *)(dir_data + found->block_off);
+    
+    // Find out the live entry whose gap hold deleted entry
+    int curr_off = 0;
+    struct ext2_dir_entry *entry = NULL;
+    while (curr_off < EXT2_BLOCK_SIZE) {
+        entry = (struct ext2_dir_entry *)(dir_data + curr_off);
+        if (curr_off + entry->rec_len > found->block_off) {
+            break;
+        }
+        curr_off += entry->rec_len;
+    }
+    if (entry == NULL || curr_off == found->block_off ||
+        (entry->inode && curr_off + EXT2_DIR_REC_LEN(entry->name_len) > found->block_off)) {
+        ext2_block_put(found->block_num, 0);
+        return -1; // entry already live
+    }
+    
+    // restore dir entry
+    gap_entry->rec_len = curr_off + entry->rec_len - found->block_off;
+    entry->rec_len = found->block_off - curr_off;
+    dir_space_update_block(found->parent_inode_num, found->block_num);
+    ext2_block_put(found->block_num, 1);
+    return 0;
+}
+
+static void restore_dir_contents_rec(int dir_inode_num,
+                                     struct bitmap_batch *batch);
+
+/*
+ *  Restore a deleted inode (already checked recoverable), its bitmap
+ *      bits are added to batch. Dir is restored with its contents.
+ */
+static void restore_inode_into_batch(int inode_num,
+                                     int parent_inode_num,
+                                     struct bitmap_batch *batch)
+{
+    struct ext2_inode *inode = inode_table + inode_num - 1;
+    
+    inode->i_dtime = 0;
+    bitmap_batch_add_inode(batch, inode_num);
+    bitmap_batch_add_blocks_of(batch, inode);
+    
+    // block still shared by dedup get one more reference
+    int *inode_iblock_array = read_i_block_into_array(inode);
+    int i = 0;
+    while (inode_iblock_array[i] != -1) {
+        dedup_ref_block(inode_iblock_array[i]);
+        i++;
+    }
+    free(inode_iblock_array);
+    
+    if ((inode->i_mode & 0xF000) != EXT2_S_IFDIR) {
+        inode->i_links_count++;
+        return;
+    }
+    
+    // entries may get dropped from restored dir
+    dir_space_invalidate(inode_num);
+    
+    // entry in parent and "." , each restored sub dir add its ".."
+    inode->i_links_count = 2;
+    struct ext2_inode *parent_inode = inode_table + parent_inode_num - 1;
+    parent_inode->i_links_count++;
+    gdt->bg_used_dirs_count++;
+    
+    restore_dir_contents_rec(inode_num, batch);
+}
+
+/*
+ *  Check if inode was restored earlier in this batch.
+ */
+static int batch_has_inode(struct bitmap_batch *batch,
+                           int inode_num)
+{
+    int i;
+    for (i = 0; i < batch->num_inodes; i++) {
+        if (batch->inodes[i] == inode_num) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ *  Walk datablocks of a restored dir, restore each child depth-first.
+ *      Child can't be restored (inode or blocks reused) get its entry
+ *      dropped, so the dir never point to a reused inode. A live inode
+ *      may be a hard link outside the tree or a reuse, can't tell, so
+ *      it is dropped too.
+ */
+static void restore_dir_contents_rec(int dir_inode_num,
+                                     struct bitmap_batch *batch)
+{
+    struct ext2_inode *dir_inode = inode_table + dir_inode_num - 1;
+    int *dir_iblock_array = read_i_block_into_array(dir_inode);
+    int i = 0;
+    
+    prefetch_block_array(dir_iblock_array);
+    while (dir_iblock_array[i] != -1) {
+        unsigned char *dir_data = ext2_block_get(dir_iblock_array[i]);
+        struct ext2_dir_entry *prev_entry = NULL;
+        int curr_off = 0;
+        
+        while (curr_off < EXT2_BLOCK_SIZE) {
+            struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(dir_data + curr_off);
+            int rec_len = entry->rec_len;
+            if (rec_len == 0) {
+                break;
+            }
+            curr_off += rec_len;
+            
+            if (entry->inode == 0 ||
+                (entry->name_len == 1 && entry->name[0] == '.') ||
+                (entry->name_len == 2 && entry->name[0] == '.' && entry->name[1] == '.')) {
+                prev_entry = entry;
+                continue;
+            }
+            
+            struct ext2_inode *child_inode = inode_table + entry->inode - 1;
+            if (entry->inode > sb->s_inodes_count) {
+                // fall through to drop
+            } else if (batch_has_inode(batch, entry->inode)) {
+                // restored earlier in this batch, another hard link to it
+                child_inode->i_links_count++;
+                prev_entry = entry;
+                continue;
+            } else if (inode_recoverable(entry->inode)) {
+                restore_inode_into_batch(entry->inode, dir_inode_num, batch);
+                prev_entry = entry;
+                continue;
+            }
+            
+            // drop entry
+            if (prev_entry) {
+                prev_entry->rec_len += rec_len;
+            } else {
+                entry->inode = 0;
+                prev_entry = entry;
+            }
+        }
+        ext2_block_put(dir_iblock_array[i], 1);
+        i++;
+    }
+    
+    free(dir_iblock_array);
+}
+
+int restore_undelete_entry(struct ext2_undelete_entry *found)
+{
+    struct bitmap_batch batch = BITMAP_BATCH_INIT;
+    
+    // entry may be restored by someone else sharing the same inode
+    if (!inode_recoverable(found->inode_num)) {
+        return -1;
+    }
+    
+    if (relink_gap_entry(found)) {
+        return -1;
+    }
+    
+    restore_inode_into_batch(found->inode_num, found->parent_inode_num, &batch);
+    bitmap_batch_restore(&batch);
+    bitmap_batch_destroy(&batch);
+    
+    return 0;
+}
+
+int restore_from_dir_entry(struct ext2_inode *parent_inode,
+                           char *name)
+{
+    TRACE_SCOPE("restore_from_dir_entry");
+    struct ext2_undelete_entry *index = NULL;
+    int index_cap = 0;
+    int index_size = scan_dir_gaps(parent_inode - inode_table + 1, &index, 0, &index_cap);
+    int result = -1;
+    int i;
+    
+    // Same name may be deleted more than once, take the one can be restored
+    for (i = 0; i < index_size; i++) {
+        if (index[i].file_type != EXT2_FT_DIR &&
+            strcmp(index[i].name, name) == 0 &&
+            restore_undelete_entry(index + i) == 0) {
+            result = 0;
+            break;
+        }
+    }
+    
+    free(index);
+    return result;
+}
+
+int restore_dir_from_dir_entry(struct ext2_inode *parent_inode,
+                               char *name)
+{
+    TRACE_SCOPE("restore_dir_from_dir_entry");
+    struct ext2_undelete_entry *index = NULL;
+    int index_cap = 0;
+    int index_size = scan_dir_gaps(parent_inode - inode_table + 1, &index, 0, &index_cap);
+    int result = -1;
+    int i;
+    
+    // Same name may be deleted more than once, take the one can be restored
+    for (i = 0; i < index_size; i++) {
+        if (index[i].file_type == EXT2_FT_DIR &&
+            strcmp(index[i].name, name) == 0 &&
+            restore_undelete_entry(index + i) == 0) {
+            result = 0;
+            break;
+        }
+    }
+    
+    free(index);
+    return result;
+}
+
+static int get_name_in_dir(int dir_inode_num,
+                           int inode_num,
+                           char *name)
+{
+    struct ext2_inode *dir_inode = inode_table + dir_inode_num - 1;
+    int *dir_iblock_array = read_i_block_into_array(dir_inode);
+    int i = 0;
+    
+    while (dir_iblock_array[i] != -1) {
+        unsigned char *dir_data = ext2_block_get(dir_iblock_array[i]);
+        int curr_off = 0;
+        while (curr_off < EXT2_BLOCK_SIZE) {
+            struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(dir_data + curr_off);
+            if (entry->rec_len == 0) {
+                break;
+            }
+            if (entry->inode == inode_num &&
+                !(entry->name_len == 1 && entry->name[0] == '.') &&
+                !(entry->name_len == 2 && entry->name[0] == '.' && entry->name[1] == '.')) {
+                memcpy(name, entry->name, entry->name_len);
+                name[entry->name_len] = '\0';
+                ext2_block_put(dir_iblock_array[i], 0);
+                free(dir_iblock_array);
+                return 0;
+            }
+            curr_off += entry->rec_len;
+        }
+        ext2_block_put(dir_iblock_array[i], 0);
+        i++;
+    }
+    
+    free(dir_iblock_array);
+    return -1;
+}
+
+int get_path_by_inode_number(int dir_inode_num,
+                             char *path,
+                             int path_size)
+{
+    char name[EXT2_NAME_LEN + 1];
+    char tmp[PATH_MAX];
+    int curr_inode_num = dir_inode_num;
+    int depth = 0;
+    
+    path[0] = '\0';
+    while (curr_inode_num != EXT2_ROOT_INO) {
+        int parent_inode_num = get_inode_number_by_name(curr_inode_num, "..");
+        if (parent_inode_num < 0 || ++depth > PATH_MAX / 2 ||
+            get_name_in_dir(parent_inode_num, curr_inode_num, name)) {
+            return -1;
+        }
+        if (strlen(name) + 1 + strlen(path) >= path_size) {
+            return -1;
+        }
+        // prepend "/name"
+        strcpy(tmp, path);
+        strcpy(path, "/");
+        strcat(path, name);
+        strcat(path, tmp);
+        curr_inode_num = parent_inode_num;
+    }
+    
+    if (path[0] == '\0') {
+        strcpy(path, "/");
+    }
+    return 0;
+}
+
+/*
+ *  Record of a dir entry to be repacked by compact_dir().
+ */
+struct compact_record {
+    struct ext2_dir_entry *entry;   // entry in old datablock
+    int                    live;    // 0 for deleted entry kept in gap
+};
+
+/*
+ *  Pack records into new datablocks, a live entry and the deleted
+ *      entries following it stay in the same block.
+ *  Return: int
+ *      number of datablocks used
+ */
+static int pack_compact_records(struct compact_record *records,
+                                int num_records,
+                                unsigned char *new_data)
+{
+    int curr_block = 0;
+    int curr_off = 0;
+    struct ext2_dir_entry *last_live = NULL;
+    int i = 0;
+    
+    while (i < num_records) {
+        // size of the live entry with its deleted entries
+        int group_len = EXT2_DIR_REC_LEN(records[i].entry->name_len);
+        int group_end = i + 1;
+        while (group_end < num_records && !records[group_end].live) {
+            group_end++;
+        }
+        
+        if (curr_off + group_len > EXT2_BLOCK_SIZE) {
+            // close current block, last live entry take the rest of it
+            last_live->rec_len += EXT2_BLOCK_SIZE - curr_off;
+            curr_block++;
+            curr_off = 0;
+        }
+        
+        unsigned char *block_data = new_data + EXT2_BLOCK_SIZE * curr_block;
+        last_live = (struct ext2_dir_entry *)(block_data + curr_off);
+        memcpy(last_live, records[i].entry, group_len);
+        last_live->rec_len = group_len;
+        curr_off += group_len;
+        
+        // deleted entries live in the gap of last_live, drop those not fit
+        for (i = i + 1; i < group_end; i++) {
+            int deleted_len = EXT2_DIR_REC_LEN(records[i].entry->name_len);
+            if (curr_off + deleted_len > EXT2_BLOCK_SIZE) {
+                continue;
+            }
+            struct ext2_dir_entry *deleted = (struct ext2_dir_entry *)(block_data + curr_off);
+            memcpy(deleted, records[i].entry, deleted_len);
+            deleted->rec_len = deleted_len;
+            last_live->rec_len += deleted_len;
+            curr_off += deleted_len;
+        }
+    }
+    
+    if (last_live) {
+        last_live->rec_len += EXT2_BLOCK_SIZE - curr_off;
+    }
+    return curr_block + 1;
+}
+
+int compact_dir(int dir_inode_num,
+                int keep_deleted)
+{
+    TRACE_SCOPE("compact_dir");
+    struct ext2_inode *dir_inode = inode_table + dir_inode_num - 1;
+    int *dir_iblock_array = read_i_block_into_array(dir_inode);
+    int num_blocks = inode_num_data_blocks(dir_inode);
+    struct compact_record *records = NULL;
+    int num_records = 0;
+    int records_cap = 0;
+    int i;
+    
+    if (num_blocks == 0) {
+        free(dir_iblock_array);
+        return 0;
+    }
+    
+    // Collect live entries in order, with deleted ones found in their gaps,
+    //      records point into the blocks so they stay pinned until packed
+    ext2_io_prefetch(dir_iblock_array, num_blocks);
+    for (i = 0; i < num_blocks; i++) {
+        unsigned char *dir_data = ext2_block_get(dir_iblock_array[i]);
+        int curr_off = 0;
+        
+        while (curr_off < EXT2_BLOCK_SIZE) {
+            struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(dir_data + curr_off);
+            if (entry->rec_len < 8 || curr_off + entry->rec_len > EXT2_BLOCK_SIZE) {
+                break; // corrupted block
+            }
+            int gap_off = curr_off;
+            int gap_end = curr_off + entry->rec_len;
+            curr_off += entry->rec_len;
+            
+            if (entry->inode == 0) {
+                continue;
+            }
+            if (num_records + 1 >= records_cap) {
+                records_cap = records_cap * 2 + 64;
+                records = realloc(records, sizeof(struct compact_record) * records_cap);
+            }
+            records[num_records].entry = entry;
+            records[num_records].live  = 1;
+            num_records++;
+            
+            if (!keep_deleted) {
+                continue;
+            }
+            gap_off += EXT2_DIR_REC_LEN(entry->name_len);
+            while (gap_off + sizeof(struct ext2_dir_entry) < gap_end) {
+                struct ext2_dir_entry *gap_entry = (struct ext2_dir_entry *)(dir_data + gap_off);
+                if (!is_valid_gap_entry(gap_entry, gap_off, gap_end)) {
+                    gap_off += 4;
+                    continue;
+                }
+                if (inode_recoverable(gap_entry->inode)) {
+                    if (num_records + 1 >= records_cap) {
+                        records_cap = records_cap * 2 + 64;
+                        records = realloc(records, sizeof(struct compact_record) * records_cap);
+                    }
+                    records[num_records].entry = gap_entry;
+                    records[num_records].live  = 0;
+                    num_records++;
+                }
+                gap_off += EXT2_DIR_REC_LEN(gap_entry->name_len);
+            }
+        }
+    }
+    
+    // Build new content aside, old blocks are not touched yet
+    unsigned char *new_data = calloc(num_blocks, EXT2_BLOCK_SIZE);
+    int new_num_blocks = num_records ? pack_compact_records(records, num_records, new_data) : num_blocks;
+    free(records);
+    for (i = 0; i < num_blocks; i++) {
+        ext2_block_put(dir_iblock_array[i], 0);
+    }
+    
+    if (new_num_blocks >= num_blocks) {
+        free(new_data);
+        free(dir_iblock_array);
+        return 0;
+    }
+    
+    // Apply: rewrite the leading blocks, then shrink block map in one step
+    struct bitmap_batch batch = BITMAP_BATCH_INIT;
+    for (i = 0; i < new_num_blocks; i++) {
+        memcpy(ext2_block_get_new(dir_iblock_array[i]), new_data + EXT2_BLOCK_SIZE * i, EXT2_BLOCK_SIZE);
+        ext2_block_put(dir_iblock_array[i], 1);
+    }
+    for (i = new_num_blocks; i < num_blocks; i++) {
+        bitmap_batch_add_block(&batch, dir_iblock_array[i]);
+    }
+    if (num_blocks > 12 && new_num_blocks <= 12) {
+        bitmap_batch_add_block(&batch, dir_inode->i_block[12]);
+        dir_inode->i_block[12] = 0;
+    }
+    for (i = new_num_blocks; i < 12; i++) {
+        dir_inode->i_block[i] = 0;
+    }
+    dir_inode->i_size   = new_num_blocks * EXT2_BLOCK_SIZE;
+    dir_inode->i_blocks = (new_num_blocks + (new_num_blocks > 12)) * 2;
+    bitmap_batch_free(&batch);
+    bitmap_batch_destroy(&batch);
+    dir_space_invalidate(dir_inode_num);
+    
+    free(new_data);
+    free(dir_iblock_array);
+    return num_blocks - new_num_blocks;
+}
+
+int compact_dir_rec(int dir_inode_num,
+                    int keep_deleted)
+{
+    int num_freed = compact_dir(dir_inode_num, keep_deleted);
+    struct ext2_inode *dir_inode = inode_table + dir_inode_num - 1;
+    int *dir_iblock_array = read_i_block_into_array(dir_inode);
+    int i = 0;
+    
+    prefetch_block_array(dir_iblock_array);
+    while (dir_iblock_array[i] != -1) {
+        unsigned char *dir_data = ext2_block_get(dir_iblock_array[i]);
+        int curr_off = 0;
+        while (curr_off < EXT2_BLOCK_SIZE) {
+            struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(dir_data + curr_off);
+            if (entry->rec_len == 0) {
+                break;
+            }
+            curr_off += entry->rec_len;
+            
+            if (entry->inode == 0 || entry->file_type != EXT2_FT_DIR ||
+                (entry->name_len == 1 && entry->name[0] == '.') ||
+                (entry->name_len == 2 && entry->name[0] == '.' && entry->name[1] == '.')) {
+                continue;
+            }
+            num_freed += compact_dir_rec(entry->inode, keep_deleted);
+        }
+        ext2_block_put(dir_iblock_array[i], 0);
+        i++;
+    }
+    
+    free(dir_iblock_array);
+    return num_freed;
+}
+
+void init_dir_entry(unsigned char *entry_datablock,
                     int self_inode_num,
                     int parent_inode_num)
 {
-    struct ext2_dir_entry *entry;
-    // Build first entry for self "."
-    entry = (struct ext2_dir_entry *)entry_datablock;
-    entry->file_type    = EXT2_FT_DIR;
-    entry->inode        = self_inode_num;
-    entry->name[0]      = '.';
-    entry->name_len     = 1;
-    entry->rec_len      = 12;
-    // Update self link count
-    struct ext2_inode *self_inode = inode_table + (self_inode_num - 1);
-    self_inode->i_links_count++;
+    struct ext2_dir_entry *entry;
+    // Build first entry for self "."
+    entry = (struct ext2_dir_entry *)entry_datablock;
+    entry->file_type    = EXT2_FT_DIR;
+    entry->inode        = self_inode_num;
+    entry->name[0]      = '.';
+    entry->name_len     = 1;
+    entry->rec_len      = 12;
+    // Update self link count
+    struct ext2_inode *self_inode = inode_table + (self_inode_num - 1);
+    self_inode->i_links_count++;
+    
+    // Build second entry for parent ".."
+    entry = (struct ext2_dir_entry *)(entry_datablock + 12);
+    entry->file_type    = EXT2_FT_DIR;
+    entry->inode        = parent_inode_num;
+    entry->name[0]      = '.';
+    entry->name[1]      = '.';
+    entry->name_len     = 2;
+    entry->rec_len      = EXT2_BLOCK_SIZE - 12;
+    // Update parent link count
+    struct ext2_inode *parent_inode = inode_table + (parent_inode_num - 1);
+    parent_inode->i_links_count++;
+}
+
+int *read_i_block_into_array(struct ext2_inode *inode)
+{
+    int total_blocks = inode->i_blocks/2;
+    int *result = malloc(sizeof(int) * (total_blocks + 1));
+    int num_block_read = 0;
+    EXT2_STATS_ADD(i_block_array_mallocs, 1);
+    int i;
+    
+    // Fast symlink keep the path in i_block[], and inode without any
+    //      datablock has nothing to read.
+    if (is_fast_symlink(inode) || total_blocks == 0) {
+        result[0] = -1;
+        return result;
+    }
+    
+    for (i = 0; i < 12; i++) {
+        result[i] = inode->i_block[i];
+        num_block_read++;
+        if (num_block_read == total_blocks) {
+            result[i + 1] = -1;
+            return result;
+        }
+    }
+    
+    // If reach here, go into indirect_block
+    num_block_read++;
+    
+    // Since disk size is 128kb, only consider the cases that
+    //      there is only one indirect block.
+    unsigned int *indirect_block = (unsigned int *)ext2_block_get(inode->i_block[12]);
+    EXT2_STATS_ADD(blocks_touched, 1);
+    for (i = 0; i < EXT2_BLOCK_SIZE/4; i++) {
+        result[12 + i] = indirect_block[i];
+        num_block_read++;
+        if (num_block_read == total_blocks) {
+            result[12 + i + 1] = -1;
+            ext2_block_put(inode->i_block[12], 0);
+            return result;
+        }
+    }
+    
+    // If reach here, error
+    ext2_block_put(inode->i_block[12], 0);
+    free(result);
+    return NULL;
+}
+
+void prefetch_block_array(int *block_array)
+{
+    int num_blocks = 0;
+    while (block_array[num_blocks] != -1) {
+        num_blocks++;
+    }
+    ext2_io_prefetch(block_array, num_blocks);
+}
+
+void write_array_into_i_block(struct ext2_inode *inode,
+                              int *array,
+                              int array_size)
+{
+    int num_block_written = 0;
+    int i;
+    
+    // empty file has no block to write
+    if (array_size == 0) {
+        return;
+    }
+    
+    for (i = 0; i < 12; i++) {
+        inode->i_block[i] = array[i];
+        num_block_written++;
+        if (num_block_written == array_size) {
+            return;
+        }
+    }
+    
+    // If reach here, write into indirect_block
+    // allocate a space for indirect_block, with --locality the first
+    //      free block after the last direct one
+    int indirect_block_num = dalloc_near(array[11] + 1);
+    if (indirect_block_num < 0) {
+        exit(ENOSPC);
+    }
+    inode->i_block[12] = indirect_block_num;
+    inode->i_blocks += 2;
+    
+    // Since disk size is 128kb, only consider the cases that
+    //      there is only one indirect block.
+    unsigned int *indirect_block = (unsigned int *)ext2_block_get_new(indirect_block_num);
+    // reused block may hold stale block numbers
+    memset(indirect_block, 0, EXT2_BLOCK_SIZE);
+    EXT2_STATS_ADD(blocks_touched, 1);
+    for (i = 0; i < EXT2_BLOCK_SIZE/4; i++) {
+        indirect_block[i] = array[12 + i];
+        num_block_written++;
+        if (num_block_written == array_size) {
+            break;
+        }
+    }
+    ext2_block_put(indirect_block_num, 1);
+}
+
+/*
+ *  Allocator state of one thread, only its owner writes it: free inode
+ *      and block counts not folded into sb and gdt yet, and the bitmap
+ *      windows it reserved. Pushed on a global list without lock and
+ *      never freed, like trace rings. Own cache line, so threads
+ *      allocating in parallel don't share one.
+ */
+struct thread_alloc {
+    struct thread_alloc *next;
+    long                 free_inodes;
+    long                 free_blocks;
+    int                  inode_window;  // -1 if none reserved
+    int                  block_window;
+} __attribute__((aligned(64)));
+
+static struct thread_alloc *thread_alloc_list;
+static __thread struct thread_alloc *thread_alloc_self;
+
+/*
+ *  Reservation windows of a bitmap, EXT2_ALLOC_WINDOW_BITS each. A
+ *      window is reserved by one thread at a time (owners[w] set), so
+ *      threads take bits of different words.
+ */
+struct alloc_windows {
+    unsigned char *owners;
+    int            num_windows;
+    int            num_bits;
+    int            rotor;       // where to look for a window first
+    unsigned int  *reserved;    // bits kept for growing inodes, NULL if none
+};
+
+static struct alloc_windows inode_windows;
+static struct alloc_windows block_windows;
+
+#define ALLOC_WINDOW_WORDS (EXT2_ALLOC_WINDOW_BITS / 32)
+
+static void alloc_windows_init(struct alloc_windows *windows,
+                               int num_bits)
+{
+    free(windows->owners);
+    windows->num_bits = num_bits;
+    windows->num_windows = (num_bits + EXT2_ALLOC_WINDOW_BITS - 1) / EXT2_ALLOC_WINDOW_BITS;
+    windows->owners = calloc(windows->num_windows + 1, 1);
+    windows->rotor = 0;
+}
+
+/*
+ *  Set up windows over the bytes ialloc()/dalloc() scan.
+ */
+static void alloc_init(void)
+{
+    alloc_windows_init(&inode_windows, sb->s_inodes_count / 8 * 8);
+    alloc_windows_init(&block_windows, sb->s_blocks_count / 8 * 8);
+}
+
+static struct thread_alloc *thread_alloc_of_thread(void)
+{
+    struct thread_alloc *alloc = thread_alloc_self;
+    if (alloc) {
+        return alloc;
+    }
+    alloc = aligned_alloc(64, sizeof(struct thread_alloc));
+    if (alloc == NULL) {
+        perror("aligned_alloc");
+        exit(ENOMEM);
+    }
+    memset(alloc, 0, sizeof(struct thread_alloc));
+    alloc->inode_window = -1;
+    alloc->block_window = -1;
+    alloc->next = __atomic_load_n(&thread_alloc_list, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&thread_alloc_list, &alloc->next, alloc, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        // alloc->next reloaded by failed exchange
+    }
+    thread_alloc_self = alloc;
+    return alloc;
+}
+
+static void counters_add_inodes(long n)
+{
+    struct thread_alloc *alloc = thread_alloc_of_thread();
+    __atomic_store_n(&alloc->free_inodes, alloc->free_inodes + n, __ATOMIC_RELAXED);
+}
+
+static void counters_add_blocks(long n)
+{
+    struct thread_alloc *alloc = thread_alloc_of_thread();
+    __atomic_store_n(&alloc->free_blocks, alloc->free_blocks + n, __ATOMIC_RELAXED);
+}
+
+static void alloc_window_release(struct alloc_windows *windows,
+                                 int *window)
+{
+    if (*window >= 0) {
+        __atomic_store_n(windows->owners + *window, 0, __ATOMIC_RELEASE);
+        *window = -1;
+    }
+}
+
+/*
+ *  Blocks reserved past the last block of a growing inode, [next, end).
+ *      Kept in memory only: their bits are set in block_windows.reserved,
+ *      not in block bitmap, so alloc_bit() passes them over and a crash
+ *      leaves them free. Given back on fold.
+ */
+struct prealloc_window {
+    int next;
+    int end;
+    int listed;     // in prealloc_inodes
+};
+
+static struct prealloc_window *prealloc_windows;   // by inode number
+static int *prealloc_inodes;                       // inodes with a window
+static int prealloc_num_inodes;
+static pthread_mutex_t prealloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void prealloc_init(void)
+{
+    free(prealloc_windows);
+    free(prealloc_inodes);
+    free(block_windows.reserved);
+    prealloc_windows = calloc(sb->s_inodes_count + 1, sizeof(struct prealloc_window));
+    prealloc_inodes = malloc(sizeof(int) * (sb->s_inodes_count + 1));
+    prealloc_num_inodes = 0;
+    block_windows.reserved = calloc(block_windows.num_bits / 32 + 1, sizeof(unsigned int));
+}
+
+/*
+ *  Set or clear reserved bit of a block.
+ *  Return: int
+ *      previous value of the bit
+ */
+static int prealloc_mark(int block_num,
+                         int set)
+{
+    int bit = block_num - sb->s_first_data_block;
+    unsigned int mask = 1u << (bit % 32);
+    unsigned int old;
+    
+    if (set) {
+        old = __atomic_fetch_or(block_windows.reserved + bit / 32, mask, __ATOMIC_RELAXED);
+    } else {
+        old = __atomic_fetch_and(block_windows.reserved + bit / 32, ~mask, __ATOMIC_RELAXED);
+    }
+    return (old & mask) != 0;
+}
+
+/*
+ *  Unreserve blocks left in window of an inode, caller holds
+ *      prealloc_lock.
+ */
+static void prealloc_drop(int inode_num)
+{
+    struct prealloc_window *window = prealloc_windows + inode_num;
+    for (; window->next < window->end; window->next++) {
+        prealloc_mark(window->next, 0);
+    }
+    window->next = window->end = 0;
+}
+
+void prealloc_discard(int inode_num)
+{
+    if (prealloc_windows == NULL || inode_num <= 0 || inode_num > sb->s_inodes_count) {
+        return;
+    }
+    pthread_mutex_lock(&prealloc_lock);
+    prealloc_drop(inode_num);
+    pthread_mutex_unlock(&prealloc_lock);
+}
+
+static void prealloc_release_all(void)
+{
+    int i;
+    
+    pthread_mutex_lock(&prealloc_lock);
+    for (i = 0; i < prealloc_num_inodes; i++) {
+        prealloc_drop(prealloc_inodes[i]);
+        prealloc_windows[prealloc_inodes[i]].listed = 0;
+    }
+    prealloc_num_inodes = 0;
+    pthread_mutex_unlock(&prealloc_lock);
+}
+
+int dalloc_grow(int inode_num,
+                int last_block)
+{
+    if (prealloc_windows == NULL || inode_num <= 0 || inode_num > sb->s_inodes_count) {
+        return dalloc_near(last_block > 0 ? last_block + 1 : -1);
+    }
+    
+    pthread_mutex_lock(&prealloc_lock);
+    struct prealloc_window *window = prealloc_windows + inode_num;
+    
+    // window left behind if blocks of inode moved meanwhile
+    if (window->next < window->end && last_block > 0 && window->next != last_block + 1) {
+        prealloc_drop(inode_num);
+    }
+    if (window->next < window->end) {
+        int block_num = window->next++;
+        prealloc_mark(block_num, 0);
+        // taken anyway once only reserved blocks were left, or restored
+        if (restore_block_bitmap(block_num) == 0) {
+            pthread_mutex_unlock(&prealloc_lock);
+            EXT2_STATS_ADD(prealloc_hits, 1);
+            return block_num;
+        }
+        prealloc_drop(inode_num);
+    }
+    
+    int block_num = dalloc_near(last_block > 0 ? last_block + 1 : block_goal_of_inode(inode_num));
+    if (block_num < 0) {
+        pthread_mutex_unlock(&prealloc_lock);
+        return -1;
+    }
+    // reserve the free blocks right after it, up to the first used one
+    int end = block_num + 1;
+    while (end < block_num + EXT2_PREALLOC_BLOCKS && end < sb->s_blocks_count &&
+           !test_block_bitmap(end)) {
+        if (prealloc_mark(end, 1)) {
+            break;  // reserved for another inode
+        }
+        end++;
+    }
+    if (end > block_num + 1) {
+        if (!window->listed) {
+            prealloc_inodes[prealloc_num_inodes++] = inode_num;
+            window->listed = 1;
+        }
+        window->next = block_num + 1;
+        window->end = end;
+    }
+    pthread_mutex_unlock(&prealloc_lock);
+    return block_num;
+}
+
+void ext2_counters_fold(void)
+{
+    struct thread_alloc *alloc;
+    
+    // reservations go back before counts are folded
+    prealloc_release_all();
+    alloc = __atomic_load_n(&thread_alloc_list, __ATOMIC_ACQUIRE);
+    for (; alloc; alloc = alloc->next) {
+        long free_inodes = __atomic_exchange_n(&alloc->free_inodes, 0, __ATOMIC_RELAXED);
+        long free_blocks = __atomic_exchange_n(&alloc->free_blocks, 0, __ATOMIC_RELAXED);
+        gdt->bg_free_inodes_count += free_inodes;
+        sb->s_free_inodes_count   += free_inodes;
+        gdt->bg_free_blocks_count += free_blocks;
+        sb->s_free_blocks_count   += free_blocks;
+        // unused reservations go back
+        alloc_window_release(&inode_windows, &alloc->inode_window);
+        alloc_window_release(&block_windows, &alloc->block_window);
+    }
+}
+
+int ext2_free_inodes_count(void)
+{
+    struct thread_alloc *alloc = __atomic_load_n(&thread_alloc_list, __ATOMIC_ACQUIRE);
+    long count = gdt->bg_free_inodes_count;
     
-    // Build second entry for parent ".."
-    entry = (struct ext2_dir_entry *)(entry_datablock + 12);
-    entry->file_type    = EXT2_FT_DIR;
-    entry->inode        = parent_inode_num;
-    entry->name[0]      = '.';
-    entry->name[1]      = '.';
-    entry->name_len     = 2;
-    entry->rec_len      = EXT2_BLOCK_SIZE - 12;
-    // Update parent link count
-    struct ext2_inode *parent_inode = inode_table + (parent_inode_num - 1);
-    parent_inode->i_links_count++;
+    for (; alloc; alloc = alloc->next) {
+        count += __atomic_load_n(&alloc->free_inodes, __ATOMIC_RELAXED);
+    }
+    return count;
 }
 
-int *read_i_block_into_array(struct ext2_inode *inode)
+int ext2_free_blocks_count(void)
 {
-    int total_blocks = inode->i_blocks/2;
-    int *result = malloc(sizeof(int) * (total_blocks + 1));
-    int num_block_read = 0;
+    struct thread_alloc *alloc = __atomic_load_n(&thread_alloc_list, __ATOMIC_ACQUIRE);
+    long count = gdt->bg_free_blocks_count;
+    
+    for (; alloc; alloc = alloc->next) {
+        count += __atomic_load_n(&alloc->free_blocks, __ATOMIC_RELAXED);
+    }
+    return count;
+}
+
+void ext2_counters_recompute(void)
+{
+    struct thread_alloc *alloc = __atomic_load_n(&thread_alloc_list, __ATOMIC_ACQUIRE);
+    
+    // bitmaps already account for pending deltas
+    for (; alloc; alloc = alloc->next) {
+        __atomic_store_n(&alloc->free_inodes, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&alloc->free_blocks, 0, __ATOMIC_RELAXED);
+    }
+    gdt->bg_free_inodes_count = sb->s_free_inodes_count = count_inode_bitmap();
+    gdt->bg_free_blocks_count = sb->s_free_blocks_count = count_block_bitmap();
+}
+
+/*
+ *  Set lowest free bit of word within mask, by compare and swap as
+ *      frees and restores of other threads may change the word too.
+ *  Return: int
+ *      bit index, -1 if none
+ */
+static int alloc_in_word(unsigned int *words,
+                         int word_idx,
+                         unsigned int mask,
+                         unsigned long *scanned)
+{
+    unsigned int word = __atomic_load_n(words + word_idx, __ATOMIC_RELAXED);
+    unsigned int free_bits;
+    
+    while ((free_bits = ~word & mask) != 0) {
+        unsigned int bit = free_bits & -free_bits;
+        // word reloaded on failure
+        if (__atomic_compare_exchange_n(words + word_idx, &word, word | bit, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            *scanned += __builtin_ctz(bit) + 1;
+            return word_idx * 32 + __builtin_ctz(bit);
+        }
+    }
+    *scanned += 32;
+    return -1;
+}
+
+/*
+ *  Set first free bit of window from goal on, or lowest free bit if
+ *      goal is -1. Bits before goal are left, so a file growing from
+ *      goal doesn't jump back. Reserved bits are left too, unless
+ *      take_reserved is set.
+ *  Return: int
+ *      bit index, -1 if window is full
+ */
+static int alloc_in_window(struct alloc_windows *windows,
+                           unsigned char *bitmap,
+                           int window,
+                           int goal,
+                           int take_reserved,
+                           unsigned long *scanned)
+{
+    unsigned int *words = (unsigned int *)bitmap;
+    int first = window * ALLOC_WINDOW_WORDS;
+    int end = (windows->num_bits + 31) / 32;
+    int word_idx = goal >= 0 ? goal / 32 : first;
+    unsigned int goal_mask = goal >= 0 ? ~0u << (goal % 32) : ~0u;
+    int bit;
+    
+    if (end > first + ALLOC_WINDOW_WORDS) {
+        end = first + ALLOC_WINDOW_WORDS;
+    }
+    // bits past num_bits are never free
+    int bits_left = windows->num_bits - (end - 1) * 32;
+    unsigned int last_valid = bits_left < 32 ? (1u << bits_left) - 1 : ~0u;
+    
+    for (; word_idx < end; word_idx++) {
+        unsigned int mask = word_idx == end - 1 ? last_valid : ~0u;
+        if (windows->reserved && !take_reserved) {
+            mask &= ~__atomic_load_n(windows->reserved + word_idx, __ATOMIC_RELAXED);
+        }
+        bit = alloc_in_word(words, word_idx, mask & goal_mask, scanned);
+        if (bit >= 0) {
+            return bit;
+        }
+        goal_mask = ~0u;
+    }
+    return -1;
+}
+
+/*
+ *  Take a free bit, nearest after goal if goal isn't -1. Bits come
+ *      from the window reserved by this thread if it holds goal (or
+ *      whatever window without goal), else the next window with a free
+ *      bit from goal (or rotor) on is reserved. If every such window is
+ *      reserved by other threads, take a bit from theirs.
+ *  Return: int
+ *      bit index, -1 if bitmap is full
+ */
+static int alloc_bit(struct alloc_windows *windows,
+                     unsigned char *bitmap,
+                     int *window,
+                     int goal,
+                     unsigned long *scanned)
+{
+    int goal_window = goal >= 0 ? goal / EXT2_ALLOC_WINDOW_BITS : -1;
+    int bit;
     int i;
     
-    for (i = 0; i < 12; i++) {
-        result[i] = inode->i_block[i];
-        num_block_read++;
-        if (num_block_read == total_blocks) {
-            result[i + 1] = -1;
-            return result;
+    if (*window >= 0 && (goal < 0 || *window == goal_window)) {
+        bit = alloc_in_window(windows, bitmap, *window, goal, 0, scanned);
+        if (bit >= 0) {
+            return bit;
+        }
+    }
+    // full, or away from goal
+    alloc_window_release(windows, window);
+    
+    int start = goal >= 0 ? goal_window : __atomic_load_n(&windows->rotor, __ATOMIC_RELAXED);
+    for (i = 0; i < windows->num_windows; i++) {
+        int w = (start + i) % windows->num_windows;
+        unsigned char unowned = 0;
+        if (__atomic_load_n(windows->owners + w, __ATOMIC_RELAXED) ||
+            !__atomic_compare_exchange_n(windows->owners + w, &unowned, 1, 0,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        bit = alloc_in_window(windows, bitmap, w, w == goal_window ? goal : -1, 0, scanned);
+        if (bit >= 0) {
+            *window = w;
+            // next thread without goal looks past it
+            if (goal < 0) {
+                __atomic_store_n(&windows->rotor, (w + 1) % windows->num_windows, __ATOMIC_RELAXED);
+            }
+            return bit;
         }
+        __atomic_store_n(windows->owners + w, 0, __ATOMIC_RELEASE);
     }
     
-    // If reach here, go into indirect_block
-    num_block_read++;
+    // free bits left only in windows of other threads (or before goal,
+    //      or reserved for growing inodes), share them
+    for (i = 0; i < windows->num_windows; i++) {
+        int w = (start + i) % windows->num_windows;
+        bit = alloc_in_window(windows, bitmap, w, -1, 1, scanned);
+        if (bit >= 0) {
+            return bit;
+        }
+    }
+    return -1;
+}
+
+/*
+ *  Placement regions: a single group is split in up to
+ *      EXT2_ALLOC_REGIONS, region r holds the r-th fraction of windows
+ *      of both bitmaps, so inodes of a region get blocks of the same
+ *      region.
+ */
+static int alloc_num_regions(void)
+{
+    int num_regions = EXT2_ALLOC_REGIONS;
     
-    // Since disk size is 128kb, only consider the cases that
-    //      there is only one indirect block.
-    unsigned int *indirect_block = (unsigned int *)(disk + EXT2_BLOCK_SIZE * inode->i_block[12]);
-    for (i = 0; i < EXT2_BLOCK_SIZE/4; i++) {
-        result[12 + i] = indirect_block[i];
-        num_block_read++;
-        if (num_block_read == total_blocks) {
-            result[12 + i + 1] = -1;
-            return result;
+    if (num_regions > inode_windows.num_windows) {
+        num_regions = inode_windows.num_windows;
+    }
+    if (num_regions > block_windows.num_windows) {
+        num_regions = block_windows.num_windows;
+    }
+    return num_regions > 0 ? num_regions : 1;
+}
+
+/*
+ *  First bit of region in bitmap of windows.
+ */
+static int alloc_region_start(struct alloc_windows *windows,
+                              int region)
+{
+    int window = (long)region * windows->num_windows / alloc_num_regions();
+    return window * EXT2_ALLOC_WINDOW_BITS;
+}
+
+static int alloc_region_of_bit(struct alloc_windows *windows,
+                               int bit)
+{
+    int region = alloc_num_regions() - 1;
+    
+    while (region > 0 && alloc_region_start(windows, region) > bit) {
+        region--;
+    }
+    return region;
+}
+
+/*
+ *  Free bits of region in bitmap of windows, popcount a word at a time.
+ */
+static int alloc_region_free(struct alloc_windows *windows,
+                             unsigned char *bitmap,
+                             int region)
+{
+    unsigned int *words = (unsigned int *)bitmap;
+    int word_idx = alloc_region_start(windows, region) / 32;
+    int end = region + 1 < alloc_num_regions() ?
+              alloc_region_start(windows, region + 1) / 32 : (windows->num_bits + 31) / 32;
+    int num_free = 0;
+    
+    for (; word_idx < end; word_idx++) {
+        int bits_left = windows->num_bits - word_idx * 32;
+        unsigned int valid = bits_left < 32 ? (1u << bits_left) - 1 : ~0u;
+        num_free += __builtin_popcount(~__atomic_load_n(words + word_idx, __ATOMIC_RELAXED) & valid);
+    }
+    return num_free;
+}
+
+/*
+ *  Region for a new top level directory, Orlov style: among regions
+ *      with at least average free inodes and free blocks, the one with
+ *      most free blocks, so top level trees spread out and each has
+ *      room to grow next to itself.
+ */
+static int alloc_spread_region(void)
+{
+    int num_regions = alloc_num_regions();
+    int free_inodes[EXT2_ALLOC_REGIONS];
+    int free_blocks[EXT2_ALLOC_REGIONS];
+    long total_inodes = 0;
+    long total_blocks = 0;
+    int best = -1;
+    int r;
+    
+    for (r = 0; r < num_regions; r++) {
+        free_inodes[r] = alloc_region_free(&inode_windows, inode_bitmap, r);
+        free_blocks[r] = alloc_region_free(&block_windows, block_bitmap, r);
+        total_inodes += free_inodes[r];
+        total_blocks += free_blocks[r];
+    }
+    for (r = 0; r < num_regions; r++) {
+        if ((long)free_inodes[r] * num_regions < total_inodes ||
+            (long)free_blocks[r] * num_regions < total_blocks) {
+            continue;
+        }
+        if (best < 0 || free_blocks[r] > free_blocks[best]) {
+            best = r;
         }
     }
+    // no region above average on both, any with free inodes
+    for (r = 0; best < 0 && r < num_regions; r++) {
+        if (free_inodes[r] > 0) {
+            best = r;
+        }
+    }
+    return best < 0 ? 0 : best;
+}
+
+int block_goal_of_inode(int inode_num)
+{
+    if (inode_num <= 0) {
+        return -1;
+    }
+    int region = alloc_region_of_bit(&inode_windows, inode_num - 1);
+    return alloc_region_start(&block_windows, region) + sb->s_first_data_block;
+}
+
+int ialloc_near(int parent_inode_num,
+                int is_dir)
+{
+    TRACE_SCOPE("ialloc");
+    struct thread_alloc *alloc = thread_alloc_of_thread();
+    unsigned long scanned = 0;
+    int goal = -1;
+    
+    if (!alloc_locality) {
+        // first fit
+    } else if (is_dir && parent_inode_num == EXT2_ROOT_INO) {
+        goal = alloc_region_start(&inode_windows, alloc_spread_region());
+    } else if (parent_inode_num > 0) {
+        // next to parent
+        goal = parent_inode_num - 1;
+    }
+    int bit = alloc_bit(&inode_windows, inode_bitmap, &alloc->inode_window, goal, &scanned);
+    EXT2_STATS_ADD(ialloc_bits_scanned, scanned);
+    if (bit < 0) {
+        return -1;
+    }
+    counters_add_inodes(-1);
+    // bit 0 in inode bitmap is inode 1
+    return bit + 1;
+}
+
+int ialloc(void) {
+    return ialloc_near(0, 0);
+}
+
+int dalloc_near(int goal_block)
+{
+    TRACE_SCOPE("dalloc");
+    struct thread_alloc *alloc = thread_alloc_of_thread();
+    unsigned long scanned = 0;
+    int goal = goal_block - (int)sb->s_first_data_block;
     
-    // If reach here, error
-    free(result);
-    return NULL;
+    if (!alloc_locality || goal_block < 0 || goal < 0 || goal >= block_windows.num_bits) {
+        goal = -1;
+    }
+    int bit = alloc_bit(&block_windows, block_bitmap, &alloc->block_window, goal, &scanned);
+    EXT2_STATS_ADD(dalloc_bits_scanned, scanned);
+    if (bit < 0) {
+        return -1;
+    }
+    counters_add_blocks(-1);
+    // bit 0 in block bitmap is s_first_data_block
+    return bit + sb->s_first_data_block;
 }
 
-void write_array_into_i_block(struct ext2_inode *inode,
-                              int *array,
-                              int array_size)
+int dalloc(void) {
+    return dalloc_near(-1);
+}
+
+/*
+ *  Set or clear one bit of bitmap through its aligned 32 bits word, the
+ *      same access alloc_in_word() and bitmap_update_sorted() make, so
+ *      concurrent updates of the word never mix atomic sizes. Bitmap is
+ *      little-endian on disk, bit n of a word is bit n % 8 of byte n / 8.
+ *  Return: int
+ *      previous value of the bit
+ */
+static int bitmap_update_bit(unsigned char *bitmap,
+                             int bit,
+                             int set)
 {
-    int num_block_written = 0;
+    unsigned int *word = (unsigned int *)bitmap + bit / 32;
+    unsigned int mask = 1u << (bit % 32);
+    unsigned int old;
+    
+    if (set) {
+        old = __atomic_fetch_or(word, mask, __ATOMIC_ACQ_REL);
+    } else {
+        old = __atomic_fetch_and(word, ~mask, __ATOMIC_RELEASE);
+    }
+    return (old & mask) != 0;
+}
+
+void ifree(int inode_num) {
+    // bit 0 is inode 1
+    bitmap_update_bit(inode_bitmap, inode_num - 1, 0);
+    
+    counters_add_inodes(1);
+}
+
+
+void dfree(int block_num) {
+    // bit 0 is block 1
+    bitmap_update_bit(block_bitmap, block_num - 1, 0);
+    
+    counters_add_blocks(1);
+}
+
+int restore_inode_bitmap(int inode_num) {
+    // mark it back to used, unless in use already
+    if (bitmap_update_bit(inode_bitmap, inode_num - 1, 1)) {
+        return -1;
+    }
+    
+    counters_add_inodes(-1);
+    
+    return 0;
+}
+
+
+int restore_block_bitmap(int block_num) {
+    // mark it back to used, unless in use already
+    if (bitmap_update_bit(block_bitmap, block_num - 1, 1)) {
+        return -1;
+    }
+    
+    counters_add_blocks(-1);
+    
+    return 0;
+    
+}
+
+/*
+ *  Count zero bits in the first num_bytes of bitmap, a 32-bit word at a
+ *      time.
+ */
+static int count_zero_bits(unsigned char *bitmap, int num_bytes)
+{
+    unsigned int *words = (unsigned int *)bitmap;
+    int num_words = num_bytes / 4;
+    int num_set = 0;
     int i;
     
-    for (i = 0; i < 12; i++) {
-        inode->i_block[i] = array[i];
-        num_block_written++;
-        if (num_block_written == array_size) {
-            return;
+    for (i = 0; i < num_words; i++) {
+        num_set += __builtin_popcount(words[i]);
+    }
+    // leftover bytes
+    for (i = num_words * 4; i < num_bytes; i++) {
+        num_set += __builtin_popcount(bitmap[i]);
+    }
+    
+    return num_bytes * 8 - num_set;
+}
+
+int count_inode_bitmap() {
+    return count_zero_bits(inode_bitmap, sb->s_inodes_count/8);
+}
+
+int count_block_bitmap() {
+    return count_zero_bits(block_bitmap, sb->s_blocks_count/8);
+}
+
+int build_free_extents(struct free_extent **extents)
+{
+    unsigned int *words = (unsigned int *)block_bitmap;
+    int num_bits = sb->s_blocks_count - sb->s_first_data_block;
+    int num_extents = 0;
+    int extents_cap = 0;
+    int run_start = -1;
+    int bit = 0;
+    
+    *extents = NULL;
+    while (bit < num_bits) {
+        // skip 32 used blocks at once
+        if (bit % 32 == 0 && run_start < 0 && bit + 32 <= num_bits &&
+            words[bit / 32] == 0xFFFFFFFFu) {
+            bit += 32;
+            continue;
+        }
+        int used = (block_bitmap[bit / 8] >> (bit % 8)) & 1;
+        if (!used && run_start < 0) {
+            run_start = bit;
+        }
+        if ((used || bit == num_bits - 1) && run_start >= 0) {
+            int run_end = used ? bit : bit + 1;
+            if (num_extents == extents_cap) {
+                extents_cap = extents_cap * 2 + 64;
+                *extents = realloc(*extents, sizeof(struct free_extent) * extents_cap);
+            }
+            (*extents)[num_extents].start = run_start + sb->s_first_data_block;
+            (*extents)[num_extents].len   = run_end - run_start;
+            num_extents++;
+            run_start = -1;
         }
+        bit++;
     }
     
-    // If reach here, write into indirect_block
-    // allocate a space for indirect_block
-    int indirect_block_num = dalloc();
-    if (indirect_block_num < 0) {
-        exit(ENOSPC);
+    return num_extents;
+}
+
+/*
+ *  Count runs of block_array (-1 ended), as count_extents() does. Shared
+ *      by frag report and defrag, so both agree on what is contiguous.
+ */
+static int block_array_extents(struct ext2_inode *inode,
+                               int *block_array)
+{
+    int num_extents = 0;
+    int i;
+    
+    for (i = 0; block_array[i] != -1; i++) {
+        if (i == 0) {
+            num_extents++;
+            continue;
+        }
+        // indirect block sitting between 12th and 13th block is no break
+        int expected = block_array[i - 1] + 1;
+        if (i == 12 && inode->i_block[12] == expected) {
+            expected++;
+        }
+        if (block_array[i] != expected) {
+            num_extents++;
+        }
     }
-    inode->i_block[12] = indirect_block_num;
-    inode->i_blocks += 2;
+    return num_extents;
+}
+
+int count_extents(struct ext2_inode *inode)
+{
+    int *block_array = read_i_block_into_array(inode);
+    int num_extents = block_array_extents(inode, block_array);
+    free(block_array);
+    return num_extents;
+}
+
+int defrag_inode(int inode_num,
+                 struct free_extent *extents,
+                 int num_extents)
+{
+    TRACE_SCOPE("defrag_inode");
+    struct ext2_inode *inode = inode_table + inode_num - 1;
+    int num_blocks = inode_num_data_blocks(inode);
+    int need_len = num_blocks + (num_blocks > 12);
+    int i;
     
-    // Since disk size is 128kb, only consider the cases that
-    //      there is only one indirect block.
-    unsigned int *indirect_block = (unsigned int *)(disk + EXT2_BLOCK_SIZE * inode->i_block[12]);
-    for (i = 0; i < EXT2_BLOCK_SIZE/4; i++) {
-        indirect_block[i] = array[12 + i];
-        num_block_written++;
-        if (num_block_written == array_size) {
-            return;
+    if (num_blocks == 0) {
+        return 0;
+    }
+    
+    int *block_array = read_i_block_into_array(inode);
+    // one run already, wherever its indirect block is
+    if (block_array_extents(inode, block_array) == 1) {
+        free(block_array);
+        return 0;
+    }
+    
+    // block shared by dedup can't move, other owners point at it
+    for (i = 0; i < num_blocks; i++) {
+        if (dedup_is_shared(block_array[i])) {
+            free(block_array);
+            return -1;
+        }
+    }
+    
+    // best fit: smallest free extent that hold the whole file
+    int best = -1;
+    for (i = 0; i < num_extents; i++) {
+        if (extents[i].len >= need_len &&
+            (best < 0 || extents[i].len < extents[best].len)) {
+            best = i;
+        }
+    }
+    if (best < 0) {
+        free(block_array);
+        return -1;
+    }
+    int new_start = extents[best].start;
+    extents[best].start += need_len;
+    extents[best].len   -= need_len;
+    
+    // Take new run, copy data, then rewrite block map
+    ext2_io_prefetch(block_array, num_blocks);
+    struct bitmap_batch batch = BITMAP_BATCH_INIT;
+    int new_block = new_start;
+    for (i = 0; i < num_blocks; i++) {
+        if (i == 12) {
+            new_block++; // indirect block
+        }
+        bitmap_batch_add_block(&batch, new_block);
+        memcpy(ext2_block_get_new(new_block), ext2_block_get(block_array[i]), EXT2_BLOCK_SIZE);
+        ext2_block_put(block_array[i], 0);
+        // nothing points at the copy until block map is rewritten
+        ext2_block_put(new_block, EXT2_IO_DIRTY_DATA);
+        block_array[i] = new_block;
+        new_block++;
+    }
+    if (num_blocks > 12) {
+        bitmap_batch_add_block(&batch, new_start + 12);
+    }
+    bitmap_batch_restore(&batch);
+    bitmap_batch_destroy(&batch);
+    
+    // old blocks, indirect included
+    bitmap_batch_add_blocks_of(&batch, inode);
+    
+    for (i = 0; i < num_blocks && i < 12; i++) {
+        inode->i_block[i] = block_array[i];
+    }
+    if (num_blocks > 12) {
+        inode->i_block[12] = new_start + 12;
+        unsigned int *indirect_block = (unsigned int *)ext2_block_get_new(inode->i_block[12]);
+        memset(indirect_block, 0, EXT2_BLOCK_SIZE);
+        for (i = 12; i < num_blocks; i++) {
+            indirect_block[i - 12] = block_array[i];
+        }
+        ext2_block_put(inode->i_block[12], 1);
+    }
+    
+    bitmap_batch_free(&batch);
+    bitmap_batch_destroy(&batch);
+    if ((inode->i_mode & 0xF000) == EXT2_S_IFDIR) {
+        dir_space_invalidate(inode_num);
+    }
+    
+    free(block_array);
+    return 1;
+}
+
+void clear_end_slash(char *path) {
+    if (path[strlen(path) - 1] == '/') {
+        path[strlen(path) - 1] = '\0';
+    }
+}
+
+void cut_path(char *path,
+              char *parent,
+              char *name)
+{
+    int i;
+    // Find out the index of the last '/' in path;
+    int last_slash_index = 0;
+    for (i = 0; i < strlen(path); i++) {
+        if (path[i] == '/') {
+            last_slash_index = i;
         }
     }
+    // Set parent path
+    if (last_slash_index == 0) {
+        parent[0] = '/';
+        parent[1] = '\0';
+    } else {
+        memcpy(parent, path, last_slash_index);
+        parent[last_slash_index] = '\0';
+    }
+    // Set name
+    strncpy(name, path + last_slash_index + 1, EXT2_NAME_LEN);
 }
 
-int ialloc(void) {
-    if (gdt->bg_free_inodes_count == 0) {
-        return -1;
-    }
-    
-    unsigned char *inode_bitmap_ptr;
-    int curr_byte = 0;
-    int vaild_byte_count = sb->s_inodes_count/8;
-    int curr_inode_num = 0;
+
+
+
+/*
+ *  Block dedup index, loaded from "<image>.dedup" by dedup_load().
+ *      dedup_refs[b] is the number of inodes sharing block b, 0 for
+ *      blocks not in the index (owned by one inode as usual).
+ *      dedup_slots is a hash table from content hash to block,
+ *      open addressing with linear probe.
+ */
+struct dedup_slot {
+    unsigned long long hash;
+    unsigned int       block_num;   // 0 empty, DEDUP_SLOT_DELETED removed
+};
+#define DEDUP_SLOT_DELETED 0xFFFFFFFFu
+#define DEDUP_MAGIC "EXT2DDUP"
+
+static char                dedup_path[PATH_MAX];
+static int                 dedup_dirty;
+static unsigned int       *dedup_refs;
+static unsigned long long *dedup_hashes;
+static struct dedup_slot  *dedup_slots;
+static unsigned int        dedup_slots_mask;
+
+static unsigned long long dedup_hash_block(unsigned char *data)
+{
+    unsigned long long *words = (unsigned long long *)data;
+    unsigned long long hash = 0xcbf29ce484222325ULL;
     int i;
     
-    while (curr_byte < vaild_byte_count) {
-        inode_bitmap_ptr = inode_bitmap + curr_byte;
-        for (i = 0; i < 8; i++) {
-            curr_inode_num++;
-            if (!((*inode_bitmap_ptr)>>i & 1)){
-                // Set inode bitmap
-                *inode_bitmap_ptr = *inode_bitmap_ptr | (1 << i);
-                // Set gdt
-                gdt->bg_free_inodes_count--;
-                sb->s_free_inodes_count--;
-                return curr_inode_num;
-            }
-            
-        }
-        curr_byte++;
+    for (i = 0; i < EXT2_BLOCK_SIZE / 8; i++) {
+        hash = (hash ^ words[i]) * 0x100000001b3ULL;
+        hash ^= hash >> 29;
     }
-    
-    return -1;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
 }
 
-int dalloc(void) {
-    if (gdt->bg_free_blocks_count == 0) {
-        return -1;
-    }
-    
-    unsigned char *block_bitmap_ptr;
-    int curr_byte = 0;
-    int vaild_byte_count = sb->s_blocks_count/8;
-    int curr_inode_num = 0;
-    int i;
+static void dedup_insert(unsigned long long hash,
+                         int block_num)
+{
+    unsigned int slot = hash & dedup_slots_mask;
     
-    while (curr_byte < vaild_byte_count) {
-        block_bitmap_ptr = block_bitmap + curr_byte;
-        for (i = 0; i < 8; i++) {
-            if (!((*block_bitmap_ptr)>>i & 1)){
-                // Update block bitmap
-                *block_bitmap_ptr = *block_bitmap_ptr | (1 << i);
-                // Update gdt
-                gdt->bg_free_blocks_count--;
-                sb->s_free_blocks_count--;
-                return curr_inode_num;
+    while (dedup_slots[slot].block_num != 0 &&
+           dedup_slots[slot].block_num != DEDUP_SLOT_DELETED) {
+        slot = (slot + 1) & dedup_slots_mask;
+    }
+    dedup_slots[slot].hash      = hash;
+    dedup_slots[slot].block_num = block_num;
+    dedup_hashes[block_num]     = hash;
+    dedup_refs[block_num]       = 1;
+}
+
+/*
+ *  Return block in index holding same content as data, -1 if none.
+ *      Content is compared, hash match alone is not trusted.
+ */
+static int dedup_lookup(unsigned long long hash,
+                        unsigned char *data)
+{
+    unsigned int slot = hash & dedup_slots_mask;
+    
+    while (dedup_slots[slot].block_num != 0) {
+        unsigned int block_num = dedup_slots[slot].block_num;
+        if (block_num != DEDUP_SLOT_DELETED &&
+            dedup_slots[slot].hash == hash &&
+            dedup_refs[block_num] > 0) {
+            int same = memcmp(ext2_block_get(block_num), data, EXT2_BLOCK_SIZE) == 0;
+            ext2_block_put(block_num, 0);
+            if (same) {
+                return block_num;
             }
-            curr_inode_num++;
         }
-        curr_byte++;
+        slot = (slot + 1) & dedup_slots_mask;
     }
-    
     return -1;
 }
 
-void ifree(int inode_num) {
-    unsigned char *ptr;
-    int in_which_byte;
-    int off;
-    
-    in_which_byte = inode_num/8;
-    if (inode_num%8) {
-        in_which_byte++;
-        off = inode_num%8;
-    } else {
-        off = 8;
-    }
-    
-    
-    ptr = inode_bitmap + (in_which_byte - 1);
-    *ptr = *ptr & ~(1<<(off - 1));
+static void dedup_remove(int block_num)
+{
+    unsigned int slot = dedup_hashes[block_num] & dedup_slots_mask;
     
-    //update superblock and gdt
-    gdt->bg_free_inodes_count++;
-    sb->s_free_inodes_count++;
+    while (dedup_slots[slot].block_num != 0) {
+        if (dedup_slots[slot].block_num == block_num) {
+            dedup_slots[slot].block_num = DEDUP_SLOT_DELETED;
+            break;
+        }
+        slot = (slot + 1) & dedup_slots_mask;
+    }
+    dedup_refs[block_num] = 0;
 }
 
+static void dedup_save_at_exit(void)
+{
+    dedup_save();
+}
 
-void dfree(int block_num) {
-    block_num++;
+int dedup_load(const char *image_path,
+               int create)
+{
+    unsigned int num_slots = 1;
     
-    unsigned char *ptr;
-    int in_which_byte;
-    int off;
+    if (strlen(image_path) + strlen(".dedup") >= PATH_MAX) {
+        return -1;
+    }
+    strcpy(dedup_path, image_path);
+    strcat(dedup_path, ".dedup");
     
-    in_which_byte = block_num/8;
-    if (block_num%8) {
-        in_which_byte++;
-        off = block_num%8;
-    } else {
-        off = 8;
+    FILE *index_file = fopen(dedup_path, "rb");
+    if (index_file == NULL && !create) {
+        return 0;
     }
     
+    // Table never hold more than one slot per block, keep it half empty
+    while (num_slots < sb->s_blocks_count * 2) {
+        num_slots <<= 1;
+    }
+    dedup_slots_mask = num_slots - 1;
+    dedup_slots  = calloc(num_slots, sizeof(struct dedup_slot));
+    dedup_refs   = calloc(sb->s_blocks_count, sizeof(unsigned int));
+    dedup_hashes = calloc(sb->s_blocks_count, sizeof(unsigned long long));
+    atexit(dedup_save_at_exit);
+    
+    if (index_file == NULL) {
+        dedup_dirty = 1;
+        return 0;
+    }
     
-    ptr = block_bitmap + in_which_byte - 1;
-    *ptr = *ptr & ~(1<<(off - 1));
+    // Format: magic, blocks count, number of entries,
+    //      then each entry (block, refs, hash)
+    char magic[8];
+    unsigned int blocks_count;
+    unsigned int num_entries;
+    unsigned int i;
+    if (fread(magic, 1, 8, index_file) != 8 ||
+        memcmp(magic, DEDUP_MAGIC, 8) != 0 ||
+        fread(&blocks_count, sizeof(unsigned int), 1, index_file) != 1 ||
+        blocks_count != sb->s_blocks_count ||
+        fread(&num_entries, sizeof(unsigned int), 1, index_file) != 1) {
+        fclose(index_file);
+        return -1;
+    }
+    for (i = 0; i < num_entries; i++) {
+        unsigned int entry[2];
+        unsigned long long hash;
+        if (fread(entry, sizeof(unsigned int), 2, index_file) != 2 ||
+            fread(&hash, sizeof(unsigned long long), 1, index_file) != 1 ||
+            entry[0] < sb->s_first_data_block || entry[0] >= sb->s_blocks_count) {
+            fclose(index_file);
+            return -1;
+        }
+        dedup_insert(hash, entry[0]);
+        dedup_refs[entry[0]] = entry[1];
+    }
     
-    //update superblock and gdt
-    gdt->bg_free_blocks_count++;
-    sb->s_free_blocks_count++;
+    fclose(index_file);
+    return 0;
 }
 
-int restore_inode_bitmap(int inode_num) {
-    unsigned char *ptr;
-    int in_which_byte;
-    int off;
-    
-    in_which_byte = inode_num/8;
-    if (inode_num%8) {
-        in_which_byte++;
-        off = inode_num%8;
-    } else {
-        off = 8;
-    }
+int dedup_save(void)
+{
+    char tmp_path[PATH_MAX + 4];
+    unsigned int num_entries = 0;
+    unsigned int block_num;
     
+    if (dedup_refs == NULL || !dedup_dirty) {
+        return 0;
+    }
     
-    ptr = inode_bitmap + (in_which_byte - 1);
+    for (block_num = 0; block_num < sb->s_blocks_count; block_num++) {
+        if (dedup_refs[block_num]) {
+            num_entries++;
+        }
+    }
     
-    // check if in use
-    if ((*ptr)>>(off - 1) & 1) {
+    // Write aside then rename, old index stays valid until done
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", dedup_path);
+    FILE *index_file = fopen(tmp_path, "wb");
+    if (index_file == NULL) {
+        return -1;
+    }
+    fwrite(DEDUP_MAGIC, 1, 8, index_file);
+    fwrite(&sb->s_blocks_count, sizeof(unsigned int), 1, index_file);
+    fwrite(&num_entries, sizeof(unsigned int), 1, index_file);
+    for (block_num = 0; block_num < sb->s_blocks_count; block_num++) {
+        if (dedup_refs[block_num]) {
+            unsigned int entry[2] = {block_num, dedup_refs[block_num]};
+            fwrite(entry, sizeof(unsigned int), 2, index_file);
+            fwrite(dedup_hashes + block_num, sizeof(unsigned long long), 1, index_file);
+        }
+    }
+    if (fclose(index_file) != 0 || rename(tmp_path, dedup_path) != 0) {
         return -1;
     }
     
-    // mark it back to used
-    
-    *ptr = *ptr | (1<<(off - 1));
-    
-    //update superblock and gdt
-    gdt->bg_free_inodes_count--;
-    sb->s_free_inodes_count--;
-    
+    dedup_dirty = 0;
     return 0;
 }
 
+int dedup_release_block(int block_num)
+{
+    if (dedup_refs == NULL || dedup_refs[block_num] == 0) {
+        return 1;
+    }
+    dedup_dirty = 1;
+    if (--dedup_refs[block_num] > 0) {
+        return 0;
+    }
+    dedup_remove(block_num);
+    return 1;
+}
 
-int restore_block_bitmap(int block_num) {
-    block_num++;
-    
-    unsigned char *ptr;
-    int in_which_byte;
-    int off;
-    
-    in_which_byte = block_num/8;
-    if (block_num%8) {
-        in_which_byte++;
-        off = block_num%8;
-    } else {
-        off = 8;
+void dedup_ref_block(int block_num)
+{
+    if (dedup_refs != NULL && dedup_refs[block_num] > 0) {
+        dedup_refs[block_num]++;
+        dedup_dirty = 1;
     }
+}
+
+int dedup_is_shared(int block_num)
+{
+    return dedup_refs != NULL && dedup_refs[block_num] > 0;
+}
+
+int dedup_check_refs(void)
+{
+    unsigned int *num_refs;
+    unsigned int block_num;
+    int inode_num;
+    int num_fixed = 0;
     
+    if (dedup_refs == NULL) {
+        return 0;
+    }
     
-    ptr = block_bitmap + (in_which_byte - 1);
-    
-    // check if in use
-    if ((*ptr)>>(off - 1) & 1) {
-        return -1;
+    // Count references from every live inode
+    num_refs = calloc(sb->s_blocks_count, sizeof(unsigned int));
+    for (inode_num = EXT2_GOOD_OLD_FIRST_INO; inode_num <= sb->s_inodes_count; inode_num++) {
+        struct ext2_inode *inode = inode_table + inode_num - 1;
+        int bit = inode_num - 1;
+        if (!(inode_bitmap[bit / 8] >> (bit % 8) & 1) ||
+            inode->i_dtime != 0 ||
+            (inode->i_mode & 0xF000) != EXT2_S_IFREG) {
+            continue;
+        }
+        int *inode_iblock_array = read_i_block_into_array(inode);
+        int i = 0;
+        while (inode_iblock_array[i] != -1) {
+            if (inode_iblock_array[i] >= 0 && inode_iblock_array[i] < sb->s_blocks_count) {
+                num_refs[inode_iblock_array[i]]++;
+            }
+            i++;
+        }
+        free(inode_iblock_array);
     }
     
-    // mark it back to used
+    for (block_num = 0; block_num < sb->s_blocks_count; block_num++) {
+        if (dedup_refs[block_num] == 0 || dedup_refs[block_num] == num_refs[block_num]) {
+            continue;
+        }
+        int refs_off = dedup_refs[block_num] > num_refs[block_num] ?
+                       dedup_refs[block_num] - num_refs[block_num] :
+                       num_refs[block_num] - dedup_refs[block_num];
+        printf("Fixed: dedup reference count of block [%d] was off by %d\n", block_num, refs_off);
+        if (num_refs[block_num] == 0) {
+            dedup_remove(block_num);
+        } else {
+            dedup_refs[block_num] = num_refs[block_num];
+        }
+        dedup_dirty = 1;
+        num_fixed++;
+    }
     
-    *ptr = *ptr | (1<<(off - 1));
+    free(num_refs);
+    return num_fixed;
+}
+
+/*
+ *  Copy data to data block of an inode, with or without dedup.
+ *      Last block is padded with zero, src is never read past src_size.
+ */
+static int copy_to_inode_datablock_common(struct ext2_inode *dst_file_inode,
+                                          unsigned char *src_file,
+                                          int src_size,
+                                          int dedup)
+{
+    TRACE_SCOPE("copy_to_inode_datablock");
+    unsigned char block_buf[EXT2_BLOCK_SIZE];
     
-    //update superblock and gdt
-    gdt->bg_free_blocks_count--;
-    sb->s_free_blocks_count--;
+    // allocate datablock space for cpy_file
+    int dst_file_i_block_array_size = src_size/EXT2_BLOCK_SIZE;
+    if (src_size%EXT2_BLOCK_SIZE) {
+        dst_file_i_block_array_size++;
+    }
+    dst_file_inode->i_blocks = dst_file_i_block_array_size * 2; // set inode->blocks
+    int *dst_file_i_block_array = malloc(sizeof(int) * (dst_file_i_block_array_size + 1));
+    // blocks in a row, starting in region of inode
+    int goal = block_goal_of_inode(dst_file_inode - inode_table + 1);
+    int i;
+    for (i = 0; i < dst_file_i_block_array_size; i++) {
+        unsigned char *src = src_file + EXT2_BLOCK_SIZE * i;
+        int src_len = src_size - EXT2_BLOCK_SIZE * i;
+        if (src_len < EXT2_BLOCK_SIZE) {
+            memcpy(block_buf, src, src_len);
+            memset(block_buf + src_len, 0, EXT2_BLOCK_SIZE - src_len);
+            src = block_buf;
+        }
+        
+        // share block with same content
+        unsigned long long hash = 0;
+        if (dedup) {
+            hash = dedup_hash_block(src);
+            dst_file_i_block_array[i] = dedup_lookup(hash, src);
+            if (dst_file_i_block_array[i] > 0) {
+                dedup_ref_block(dst_file_i_block_array[i]);
+                continue;
+            }
+        }
+        
+        dst_file_i_block_array[i] = dalloc_near(goal);
+        if (dst_file_i_block_array[i] < 0) {
+            free(dst_file_i_block_array);
+            return ENOSPC;
+        }
+        goal = dst_file_i_block_array[i] + 1;
+        // do copy
+        memcpy(ext2_block_get_new(dst_file_i_block_array[i]), src, EXT2_BLOCK_SIZE);
+        ext2_block_put(dst_file_i_block_array[i], EXT2_IO_DIRTY_DATA);
+        EXT2_STATS_ADD(blocks_touched, 1);
+        if (dedup) {
+            dedup_insert(hash, dst_file_i_block_array[i]);
+            dedup_dirty = 1;
+        }
+    }
+    write_array_into_i_block(dst_file_inode, dst_file_i_block_array, dst_file_i_block_array_size);
     
+    free(dst_file_i_block_array);
     return 0;
-    
 }
 
-int count_inode_bitmap() {
-    unsigned char *inode_bitmap_ptr;
-    int curr_byte = 0;
-    int vaild_byte_count = sb->s_inodes_count/8;
-    int result = 0;
+int copy_to_inode_datablock(struct ext2_inode *dst_file_inode,
+                            unsigned char *src_file,
+                            int src_size)
+{
+    return copy_to_inode_datablock_common(dst_file_inode, src_file, src_size, 0);
+}
+
+int copy_to_inode_datablock_dedup(struct ext2_inode *dst_file_inode,
+                                  unsigned char *src_file,
+                                  int src_size)
+{
+    if (dedup_refs == NULL) {
+        return copy_to_inode_datablock_common(dst_file_inode, src_file, src_size, 0);
+    }
+    return copy_to_inode_datablock_common(dst_file_inode, src_file, src_size, 1);
+}
+
+/*
+ *  Point block map of an inode at array, reusing its indirect block if
+ *      it has one, freeing it if no longer needed. i_blocks is set.
+ */
+static void set_i_block_array(struct ext2_inode *inode,
+                              int *array,
+                              int old_num_blocks,
+                              int num_blocks)
+{
     int i;
     
-    while (curr_byte < vaild_byte_count) {
-        inode_bitmap_ptr = inode_bitmap + curr_byte;
-        for (i = 0; i < 8; i++) {
-            if (!(*inode_bitmap_ptr>>i & 1)) {
-                result++;
-            }
-            
+    for (i = 0; i < 12; i++) {
+        inode->i_block[i] = i < num_blocks ? array[i] : 0;
+    }
+    if (num_blocks <= 12) {
+        if (old_num_blocks > 12) {
+            dfree(inode->i_block[12]);
         }
-        curr_byte++;
+        inode->i_block[12] = 0;
+        inode->i_blocks = num_blocks * 2;
+        return;
     }
     
-    return result;
+    unsigned int *indirect_block;
+    if (old_num_blocks <= 12) {
+        // with --locality, first free block after the last direct one,
+        //      so after any data it maps already allocated
+        int indirect_block_num = dalloc_near(array[11] + 1);
+        if (indirect_block_num < 0) {
+            exit(ENOSPC);
+        }
+        inode->i_block[12] = indirect_block_num;
+        indirect_block = (unsigned int *)ext2_block_get_new(indirect_block_num);
+    } else {
+        indirect_block = (unsigned int *)ext2_block_get(inode->i_block[12]);
+    }
+    // stale entries past the end zeroed too
+    memset(indirect_block, 0, EXT2_BLOCK_SIZE);
+    for (i = 12; i < num_blocks; i++) {
+        indirect_block[i - 12] = array[i];
+    }
+    ext2_block_put(inode->i_block[12], 1);
+    EXT2_STATS_ADD(blocks_touched, 1);
+    inode->i_blocks = (num_blocks + 1) * 2;
 }
 
-int count_block_bitmap() {
-    unsigned char *block_bitmap_ptr;
-    int curr_byte = 0;
-    int vaild_byte_count = sb->s_blocks_count/8;
-    int result = 0;
+int write_to_inode_datablock(struct ext2_inode *inode,
+                             unsigned char *src,
+                             int src_size,
+                             int append)
+{
+    TRACE_SCOPE("write_to_inode_datablock");
+    unsigned char block_buf[EXT2_BLOCK_SIZE];
+    int inode_num = inode - inode_table + 1;
+    int offset = append ? inode->i_size : 0;
+    int new_size = offset + src_size;
+    int num_blocks = (new_size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    int old_num_blocks = inode_num_data_blocks(inode);
     int i;
     
-    while (curr_byte < vaild_byte_count) {
-        block_bitmap_ptr = block_bitmap + curr_byte;
-        for (i = 0; i < 8; i++) {
-            if (!(*block_bitmap_ptr>>i & 1)){
-                result++;
+    if (num_blocks > 12 + EXT2_BLOCK_SIZE / 4) {
+        return ENOSPC;
+    }
+    int *old_array = read_i_block_into_array(inode);
+    int *array = malloc(sizeof(int) * (num_blocks + old_num_blocks + 1));
+    
+    // worst case: every shared block rewritten gets a copy
+    int blocks_needed = num_blocks > old_num_blocks ? num_blocks - old_num_blocks : 0;
+    if (num_blocks > 12 && old_num_blocks <= 12) {
+        blocks_needed++;
+    }
+    for (i = offset / EXT2_BLOCK_SIZE; i < num_blocks && i < old_num_blocks; i++) {
+        blocks_needed += dedup_is_shared(old_array[i]);
+    }
+    if (blocks_needed > ext2_free_blocks_count()) {
+        free(old_array);
+        free(array);
+        return ENOSPC;
+    }
+    
+    for (i = 0; i < num_blocks && i < old_num_blocks; i++) {
+        array[i] = old_array[i];
+    }
+    
+    for (i = offset / EXT2_BLOCK_SIZE; i < num_blocks; i++) {
+        int block_start = i * EXT2_BLOCK_SIZE;
+        int from = offset > block_start ? offset - block_start : 0;
+        int to = new_size - block_start < EXT2_BLOCK_SIZE ? new_size - block_start : EXT2_BLOCK_SIZE;
+        
+        // bytes before offset kept, tail past new size zeroed
+        if (from > 0) {
+            memcpy(block_buf, ext2_block_get(array[i]), from);
+            ext2_block_put(array[i], 0);
+        }
+        memcpy(block_buf + from, src + block_start + from - offset, to - from);
+        memset(block_buf + to, 0, EXT2_BLOCK_SIZE - to);
+        
+        if (i < old_num_blocks) {
+            // unchanged block isn't written
+            int same = memcmp(ext2_block_get(array[i]), block_buf, EXT2_BLOCK_SIZE) == 0;
+            ext2_block_put(array[i], 0);
+            EXT2_STATS_ADD(blocks_touched, 1);
+            if (same) {
+                continue;
             }
-            
+            // block shared by dedup is copied on write, unless this
+            //      inode holds its last reference
+            if (dedup_is_shared(array[i]) && !dedup_release_block(array[i])) {
+                array[i] = dalloc_near(i > 0 ? array[i - 1] + 1 : block_goal_of_inode(inode_num));
+            }
+        } else {
+            // appended blocks come from the reservation of the inode
+            array[i] = dalloc_grow(inode_num, i > 0 ? array[i - 1] : -1);
+        }
+        if (array[i] < 0) {
+            exit(ENOSPC);
         }
-        curr_byte++;
+        memcpy(ext2_block_get_new(array[i]), block_buf, EXT2_BLOCK_SIZE);
+        ext2_block_put(array[i], EXT2_IO_DIRTY_DATA);
+        EXT2_STATS_ADD(blocks_touched, 1);
     }
     
-    return result;
+    // blocks past new size go back
+    for (i = num_blocks; i < old_num_blocks; i++) {
+        if (dedup_release_block(old_array[i])) {
+            dfree(old_array[i]);
+        }
+    }
+    if (num_blocks < old_num_blocks) {
+        prealloc_discard(inode_num);
+    }
+    
+    set_i_block_array(inode, array, old_num_blocks, num_blocks);
+    inode->i_size = new_size;
+    
+    free(old_array);
+    free(array);
+    return 0;
 }
 
-void clear_end_slash(char *path) {
-    if (path[strlen(path) - 1] == '/') {
-        path[strlen(path) - 1] = '\0';
+static void batch_push(int **array,
+                       int *size,
+                       int *cap,
+                       int value)
+{
+    if (*size == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        *array = realloc(*array, sizeof(int) * (*cap));
     }
+    (*array)[(*size)++] = value;
 }
 
-void cut_path(char *path,
-              char *parent,
-              char *name)
+void bitmap_batch_add_inode(struct bitmap_batch *batch,
+                            int inode_num)
 {
-    int i;
-    // Find out the index of the last '/' in path;
-    int last_slash_index = 0;
-    for (i = 0; i < strlen(path); i++) {
-        if (path[i] == '/') {
-            last_slash_index = i;
-        }
-    }
-    // Set parent path
-    if (last_slash_index == 0) {
-        parent[0] = '/';
-        parent[1] = '\0';
-    } else {
-        memcpy(parent, path, last_slash_index);
-        parent[last_slash_index] = '\0';
-    }
-    // Set name
-    strncpy(name, path + last_slash_index + 1, EXT2_NAME_LEN);
+    batch_push(&batch->inodes, &batch->num_inodes, &batch->inodes_cap, inode_num);
 }
 
+void bitmap_batch_add_block(struct bitmap_batch *batch,
+                            int block_num)
+{
+    batch_push(&batch->blocks, &batch->num_blocks, &batch->blocks_cap, block_num);
+}
 
+void bitmap_batch_add_blocks_of(struct bitmap_batch *batch,
+                                struct ext2_inode *inode)
+{
+    int *inode_iblock_array = read_i_block_into_array(inode);
+    int i = 0;
+    while (inode_iblock_array[i] != -1) {
+        bitmap_batch_add_block(batch, inode_iblock_array[i]);
+        i++;
+    }
+    if (i > 12) { // indirect block
+        bitmap_batch_add_block(batch, inode->i_block[12]);
+    }
+    free(inode_iblock_array);
+}
 
+static int compare_int(const void *a,
+                       const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
 
-int copy_to_inode_datablock(struct ext2_inode *dst_file_inode,
-                            unsigned char *src_file,
-                            int src_size)
+/*
+ *  Set or clear the bit of each value (bit = value - base) in bitmap.
+ *      Values get sorted, so each 32 bits word is read and written once
+ *      no matter how many of its bits change. Bitmap is little-endian
+ *      on disk, bit n of a word is bit n % 8 of byte n / 8.
+ *  Return: int
+ *      number of bits actually changed
+ */
+static int bitmap_update_sorted(unsigned char *bitmap,
+                                int *values,
+                                int num_values,
+                                int base,
+                                int set)
 {
-    // allocate datablock space for cpy_file
-    int dst_file_i_block_array_size = src_size/EXT2_BLOCK_SIZE;
-    if (src_size%EXT2_BLOCK_SIZE) {
-        dst_file_i_block_array_size++;
+    unsigned int *words = (unsigned int *)bitmap;
+    int num_changed = 0;
+    int i = 0;
+    
+    qsort(values, num_values, sizeof(int), compare_int);
+    // values below base have no bit
+    while (i < num_values && values[i] < base) {
+        i++;
     }
-    dst_file_inode->i_blocks = dst_file_i_block_array_size * 2; // set inode->blocks
-    int *dst_file_i_block_array = malloc(sizeof(int) * dst_file_i_block_array_size);
-    int i;
-    for (i = 0; i < dst_file_i_block_array_size; i++) {
-        dst_file_i_block_array[i] = dalloc();
-        if (dst_file_i_block_array[i] < 0) {
-            return ENOSPC;
+    
+    while (i < num_values) {
+        int word_idx = (values[i] - base) / 32;
+        unsigned int mask = 0;
+        while (i < num_values && (values[i] - base) / 32 == word_idx) {
+            mask |= 1u << ((values[i] - base) % 32);
+            i++;
+        }
+        // atomic, allocating threads may change the word too
+        if (set) {
+            unsigned int old = __atomic_fetch_or(words + word_idx, mask, __ATOMIC_ACQ_REL);
+            num_changed += __builtin_popcount(~old & mask);
+        } else {
+            unsigned int old = __atomic_fetch_and(words + word_idx, ~mask, __ATOMIC_RELEASE);
+            num_changed += __builtin_popcount(old & mask);
         }
     }
-    write_array_into_i_block(dst_file_inode, dst_file_i_block_array, dst_file_i_block_array_size);
-    // do copy
-    i = 0;
-    while (i < dst_file_i_block_array_size) {
-        unsigned char *src = src_file + EXT2_BLOCK_SIZE * i;
-        unsigned char *dst = disk + EXT2_BLOCK_SIZE * dst_file_i_block_array[i];
-        memcpy(dst, src, EXT2_BLOCK_SIZE);
-        i++;
+    
+    return num_changed;
+}
+
+void bitmap_batch_restore(struct bitmap_batch *batch)
+{
+    int num_set;
+    
+    num_set = bitmap_update_sorted(inode_bitmap, batch->inodes, batch->num_inodes, 1, 1);
+    // update counters once
+    counters_add_inodes(-num_set);
+    
+    num_set = bitmap_update_sorted(block_bitmap, batch->blocks, batch->num_blocks, sb->s_first_data_block, 1);
+    counters_add_blocks(-num_set);
+}
+
+void bitmap_batch_free(struct bitmap_batch *batch)
+{
+    int num_cleared;
+    
+    num_cleared = bitmap_update_sorted(inode_bitmap, batch->inodes, batch->num_inodes, 1, 0);
+    // update counters once
+    counters_add_inodes(num_cleared);
+    
+    num_cleared = bitmap_update_sorted(block_bitmap, batch->blocks, batch->num_blocks, sb->s_first_data_block, 0);
+    counters_add_blocks(num_cleared);
+}
+
+void bitmap_batch_destroy(struct bitmap_batch *batch)
+{
+    free(batch->inodes);
+    free(batch->blocks);
+    batch->inodes = NULL;
+    batch->blocks = NULL;
+    batch->num_inodes = batch->inodes_cap = 0;
+    batch->num_blocks = batch->blocks_cap = 0;
+}
+
+int is_fast_symlink(struct ext2_inode *inode)
+{
+    // Same test as linux ext2: a symlink without any datablock
+    return ((inode->i_mode & EXT2_S_IFLNK) == EXT2_S_IFLNK) &&
+           inode->i_blocks == 0;
+}
+
+int copy_to_inode_symlink(struct ext2_inode *dst_link_inode,
+                          char *target)
+{
+    TRACE_SCOPE("copy_to_inode_symlink");
+    int target_len = strlen(target);
+    
+    // Long target still need a datablock
+    if (target_len >= EXT2_FAST_SYMLINK_MAX) {
+        return copy_to_inode_datablock(dst_link_inode, (unsigned char *)target, target_len + 1);
     }
     
-    free(dst_file_i_block_array);
+    // Store target inline in i_block[], no datablock allocated
+    memset(dst_link_inode->i_block, 0, sizeof(dst_link_inode->i_block));
+    memcpy(dst_link_inode->i_block, target, target_len);
+    dst_link_inode->i_size   = target_len;
+    dst_link_inode->i_blocks = 0;
     return 0;
 }
 
-int new_inode(unsigned short type,
+int new_inode(int parent_inode_num,
+              unsigned short type,
               unsigned int size){
-    // allocate space in inode table
-    int new_inode_num = ialloc();
+    TRACE_SCOPE("new_inode");
+    // allocate space in inode table, next to parent
+    int new_inode_num = ialloc_near(parent_inode_num, 0);
     if (new_inode_num < 0) {
-        return ENOSPC;
+        return -1;
     }
     struct ext2_inode *new_inode = inode_table + (new_inode_num - 1);
     
@@ -788,7 +3414,8 @@ int new_inode(unsigned short type,
     new_inode->i_links_count    = 0;
     new_inode->i_blocks         = 0;
     new_inode->i_flags          = 0;
-    // block[15]
+    // block[15], reused inode may still hold old block numbers
+    memset(new_inode->i_block, 0, sizeof(new_inode->i_block));
     new_inode->osd1             = 0;
     new_inode->i_generation     = 0;
     new_inode->i_file_acl       = 0;
@@ -800,32 +3427,19 @@ int new_inode(unsigned short type,
 }
 
 void free_inode(int inode_num){
-    struct ext2_inode *inode = inode_table +  inode_num - 1;
-    int *inode_datablock_array = read_i_block_into_array(inode);
-    
-    // set del time
-    inode->i_dtime = (unsigned int)time(NULL);
-    
-    // Mark bitmap as free
-    
-    int i = 0;
-    while (inode_datablock_array[i] != -1) {
-        dfree(inode_datablock_array[i]);
-        i++;
-    }
-    if (i >= 12) { // free indirect block
-        dfree(inode->i_block[12]);
-    }
-    
-    // free inode
-    ifree(inode_num);
+    TRACE_SCOPE("free_inode");
+    struct bitmap_batch batch = BITMAP_BATCH_INIT;
     
-    free(inode_datablock_array);
+    // Mark bitmap as free, counters updated once
+    release_inode_into_batch(inode_num, &batch);
+    bitmap_batch_free(&batch);
+    bitmap_batch_destroy(&batch);
 }
 
 int each_checker_rec(int curr_inode_num,
                      int parent_inode_num,
                      unsigned char *ft_type_ptr) {
+    TRACE_SCOPE("each_checker_rec");
     struct ext2_inode *curr_inode = inode_table + curr_inode_num - 1;
     int num_fixed = 0;
     char inode_type;
@@ -906,23 +3520,30 @@ int each_checker_rec(int curr_inode_num,
      *  curr_inode is dir
      */
     i = 0;
+    prefetch_block_array(curr_inode_iblock_array);
     while (curr_inode_iblock_array[i] != -1) {
-        unsigned char *curr_entry_data = disk + EXT2_BLOCK_SIZE * curr_inode_iblock_array[i];
+        unsigned char *curr_entry_data = ext2_block_get(curr_inode_iblock_array[i]);
         int curr_off = 0;
+        int block_fixed = 0;
         struct ext2_dir_entry *entry;
+        EXT2_STATS_ADD(blocks_touched, 1);
         
         while (curr_off < EXT2_BLOCK_SIZE) {
             entry = (struct ext2_dir_entry *)(curr_entry_data + curr_off);
-            if (entry->rec_len == EXT2_BLOCK_SIZE) {
+            if (entry->rec_len == 0) {
                 break;
             }
-            if ((entry->inode != parent_inode_num) &&
+            if (entry->inode != 0 && // unused entry left by remove
+                (entry->inode != parent_inode_num) &&
                 (entry->inode != curr_inode_num)) { // skip "." and ".." and "lost+found"
+                unsigned char file_type = entry->file_type;
                 num_fixed += each_checker_rec(entry->inode, curr_inode_num, &entry->file_type);
+                block_fixed |= file_type != entry->file_type;
             }
             
             curr_off += entry->rec_len;
         }
+        ext2_block_put(curr_inode_iblock_array[i], block_fixed);
         
         i++;
     }
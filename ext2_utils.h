@@ -7,6 +7,165 @@
 
 #define DISK_SIZE 128
 
+/* Symlink target shorter than this is stored inline in i_block[] */
+#define EXT2_FAST_SYMLINK_MAX (15 * 4)
+
+/* Max number of symlink followed in one path resolution */
+#define EXT2_MAX_SYMLINK_HOPS 8
+
+/* Number of resolved symlink targets kept in memory */
+#define EXT2_SYMLINK_CACHE_SIZE 16
+
+/* Number of dirs whose free-space summary kept in memory */
+#define EXT2_DIR_SPACE_CACHE_SIZE 16
+
+/* Space a dir entry with name_len takes, 4 bytes aligned */
+#define EXT2_DIR_REC_LEN(name_len) (((name_len) + sizeof(struct ext2_dir_entry) + 3) & ~3)
+
+/* Bits of a bitmap a thread reserves at once in ialloc()/dalloc(),
+ *  a multiple of 32 */
+#define EXT2_ALLOC_WINDOW_BITS 256
+
+/* Placement regions a single group is split in, region r holds the r-th
+ *  fraction of both bitmaps, like a block group of its own */
+#define EXT2_ALLOC_REGIONS 8
+
+/* Blocks dalloc_grow() reserves past the one it returns, at most */
+#define EXT2_PREALLOC_BLOCKS 8
+
+/* s_state bit, cleared while image is open for writing */
+#define EXT2_VALID_FS 0x0001
+
+/*
+ *  Hot path counters, printed on exit by any tool given "--stats".
+ *      Build with -DEXT2_NO_STATS to compile the counting out. Each
+ *      thread counts into its own copy, own cache line, summed when
+ *      printed.
+ */
+struct ext2_stats {
+    unsigned long ialloc_bits_scanned;   /* inode bitmap bits tested */
+    unsigned long dalloc_bits_scanned;   /* block bitmap bits tested */
+    unsigned long dir_entries_visited;   /* entries compared in name lookups */
+    unsigned long blocks_touched;        /* dir, data and indirect blocks read or written */
+    unsigned long i_block_array_mallocs; /* read_i_block_into_array() calls */
+    unsigned long blocks_read;           /* blocks pread from image (cached backends) */
+    unsigned long blocks_written;        /* blocks pwritten to image (cached backends) */
+    unsigned long io_batches;            /* read/write batches submitted (cached backends) */
+    unsigned long sync_ranges;           /* ranged flushes issued under --sync */
+    unsigned long journal_blocks;        /* metadata blocks committed through journal */
+    unsigned long prealloc_hits;         /* blocks taken from a preallocation window */
+    struct ext2_stats *next;             /* copy of next thread */
+} __attribute__((aligned(64)));
+
+/* Counters of calling thread, NULL until it first counts */
+extern __thread struct ext2_stats *ext2_stats_self;
+
+/*
+ *  Counters of calling thread, set up on first call.
+ */
+struct ext2_stats *ext2_stats_of_thread(void);
+
+/*
+ *  Sum counters of all threads into total.
+ */
+void ext2_stats_sum(struct ext2_stats *total);
+
+#ifdef EXT2_NO_STATS
+#define EXT2_STATS_ADD(counter, n) ((void)0)
+#else
+#define EXT2_STATS_ADD(counter, n) \
+    ((ext2_stats_self ? ext2_stats_self : ext2_stats_of_thread())->counter += (n))
+#endif
+
+/* Number of trace events kept per thread, oldest overwritten first */
+#define EXT2_TRACE_RING_SIZE 65536
+
+/*
+ *  Tracing of ext2_utils entry points (path resolution, allocation, dir
+ *      insert/remove/restore, data copy), off unless the EXT2_TRACE
+ *      environment variable names an output file when ext2_utils_init()
+ *      runs. Each thread records into its own ring, all rings are
+ *      dumped on exit: as JSON lines if the file name ends in ".jsonl",
+ *      as a Chrome trace (chrome://tracing, Perfetto) otherwise.
+ */
+extern int ext2_trace_enabled;
+
+/*
+ *  Write every recorded event to the trace file, called on exit when
+ *      tracing is on.
+ *  Return: int
+ *      -1 if the file can't be written
+ *       0 if success
+ */
+int ext2_trace_dump(void);
+
+/*
+ *  Run of free blocks.
+ */
+struct free_extent {
+    int start;  /* first block number */
+    int len;    /* number of blocks */
+};
+
+/*
+ *  Inodes and blocks whose bitmap bits are updated together,
+ *      superblock and gdt counters are adjusted once per batch.
+ */
+struct bitmap_batch {
+    int *inodes;
+    int  num_inodes;
+    int  inodes_cap;
+    int *blocks;
+    int  num_blocks;
+    int  blocks_cap;
+};
+#define BITMAP_BATCH_INIT {NULL, 0, 0, NULL, 0, 0}
+
+/*
+ *  Deleted dir entry found in the gap of a live dir entry.
+ */
+struct ext2_undelete_entry {
+    char          name[EXT2_NAME_LEN + 1];
+    int           parent_inode_num;   /* dir holding the entry */
+    int           inode_num;          /* inode of deleted entry */
+    int           block_num;          /* dir datablock holding the entry */
+    int           block_off;          /* offset of the entry in datablock */
+    unsigned char file_type;
+    int           recoverable;        /* inode and all its blocks still free */
+};
+
+/*
+ *  Size of the disk image behind fd, used as mmap length. Image smaller
+ *      than DISK_SIZE kb (or fstat failure) gives DISK_SIZE kb.
+ */
+size_t disk_image_size(int fd);
+
+/*
+ *  Take "--stats" out of argv wherever it is. If found, counters and
+ *      page faults taken from now on are printed to stderr on exit.
+ *  Return: int
+ *      1 if flag found
+ *      0 otherwise
+ */
+int ext2_stats_parse_flag(int *argc,
+                          const char *argv[]);
+
+/*
+ *  Take "--locality" out of argv wherever it is. If found, ialloc_near()
+ *      and dalloc_near() place by locality, else they ignore their goal
+ *      and take the next free one as ialloc() and dalloc() do.
+ *  Return: int
+ *      1 if flag found
+ *      0 otherwise
+ */
+int ext2_alloc_parse_flag(int *argc,
+                          const char *argv[]);
+
+/*
+ *  Print counters and page faults since ext2_stats_parse_flag().
+ */
+void ext2_stats_print(FILE *out);
+
 /*
  *  Init function, it *MUSE* be called before any of the rest utils function get called.
  */
@@ -32,6 +191,42 @@ int get_inode_number_by_name(int in_which_dir, char *name);
  */
 int get_inode_number_by_path(char *path);
 
+/*
+ *  Return inode number that ref by path, following symlinks.
+ *      Symlink target is spliced in front of the rest of path, relative
+ *      target is resolved from the dir holding the symlink.
+ *      Resolved targets are cached, see symlink_cache_invalidate().
+ *  Parameters:
+ *      int   in_which_dir  :   inode number for dir that relative path start from
+ *      char *path          :   absolute or relative path
+ *      int   follow_last   :   if 0, a symlink as last component is not followed
+ *  Return: int
+ *      -1 if path not exist, or more than EXT2_MAX_SYMLINK_HOPS symlinks followed
+ */
+int get_inode_number_by_path_follow(int in_which_dir,
+                                    char *path,
+                                    int follow_last);
+
+/*
+ *  Read target of symlink inode into buf, null terminated.
+ *  Parameters:
+ *      struct ext2_inode * :   symlink inode
+ *      char *              :   output buffer
+ *      int                 :   size of output buffer
+ *  Return: int
+ *      length of target
+ *      -1 if buf too small
+ */
+int read_symlink(struct ext2_inode *link_inode,
+                 char *buf,
+                 int buf_size);
+
+/*
+ *  Drop cached target of a symlink inode.
+ *      Must be called when symlink inode freed or rewritten.
+ */
+void symlink_cache_invalidate(int link_inode_num);
+
 /*
  *  Make a new dir in where dir inode.
  *  Parameters:
@@ -39,14 +234,17 @@ int get_inode_number_by_path(char *path);
  *      char *new_dir_name  :   name of the new dir
  *  Return: int
  *      If success return inode number of the new dir,
- *      if dir already exist in in_which_dir return -1;
+ *      if no enought inode or block return -1;
  */
 int inode_mkdir(int where, char *new_dir_name);
 
 /*
  *  Append new entry to given dir entry.
+ *      Entry goes into the first gap large enough in any datablock of
+ *      the dir (found through a per-dir summary of the largest gap in
+ *      each block), a new datablock is allocated only if none fits.
  *  Parameters:
- *      unsigned char *entry_datablock  :   where new entry should be added
+ *      struct ext2_inode *parent_inode :   where new entry should be added
  *      unsigned int inode_num          :   inode number for new entry
  *      char *name                      :   name of the new entry
  *      unsigned char type              :   type of the new entry
@@ -68,13 +266,31 @@ void add_to_dir_entry(struct ext2_inode *parent_inode,
 int remove_from_dir_entry(struct ext2_inode *parent_inode,
                           char *name);
 
+/*
+ *  Remove a dir and everything under it from parent dir.
+ *      Every inode and block in the subtree is collected first, then
+ *      bitmaps are cleared in one sorted sweep and counters updated once.
+ *      Datablocks of removed dirs are left intact for restore.
+ *      File with hard link outside the subtree only lose one link.
+ *  Parameters:
+ *      struct ext2_inode * :   parent dir inode
+ *      char *              :   name of the dir to remove
+ *  Return : int
+ *      -1 if no dir name in parent_inode were found
+ *       0 if success
+ */
+int remove_dir_from_dir_entry(struct ext2_inode *parent_inode,
+                              char *name);
+
 /*
  *  Restore entry bring removed by remove_from_dir_entry(),
  *      this function will search the "gaps" between each
  *      entry.
  *  - If inode being reused(del time == 0), return -1.
+ *  - If any datablock being reallocated, return -1.
  *  - If inode's i_block[] were zeroed out, then recover a file as
  *      an empty file (no data blocks)
+ *  - Dir is not restored, return -1.
  *  Parameters:
  *      int   parent_inode_num  :   where entry should be remove from
  *      char *name              :   name of the entry to remove
@@ -85,6 +301,88 @@ int remove_from_dir_entry(struct ext2_inode *parent_inode,
 int restore_from_dir_entry(struct ext2_inode *parent_inode,
                            char *name);
 
+/*
+ *  Restore a dir removed by recursive remove, with all its contents.
+ *      Dir inode and blocks must not be reused, children are restored
+ *      depth-first from the dir's datablocks, child that can't be
+ *      restored has its entry dropped.
+ *      Bitmaps are updated in one batch at the end.
+ *  Parameters:
+ *      struct ext2_inode * :   parent dir inode
+ *      char *              :   name of the dir to restore
+ *  Return : int
+ *      -1 if restore unsuccess
+ *       0 if success
+ */
+int restore_dir_from_dir_entry(struct ext2_inode *parent_inode,
+                               char *name);
+
+/*
+ *  Scan the gaps of every live dir in the image once, collect all
+ *      deleted entries found.
+ *  Parameters:
+ *      struct ext2_undelete_entry ** : set to malloc'ed index, caller free it
+ *  Return: int
+ *      number of entries in index
+ */
+int build_undelete_index(struct ext2_undelete_entry **index);
+
+/*
+ *  Restore one entry found by build_undelete_index().
+ *      Recoverable is checked again, an earlier restore may
+ *      have taken the same inode. Dir is restored recursively.
+ *  Return: int
+ *      -1 if restore unsuccess
+ *       0 if success
+ */
+int restore_undelete_entry(struct ext2_undelete_entry *found);
+
+/*
+ *  Check if a deleted inode can be restored, its inode and all
+ *      its datablocks are not reused.
+ *  Return: int
+ *      1 if recoverable
+ *      0 otherwise
+ */
+int inode_recoverable(int inode_num);
+
+/*
+ *  Build absolute path of a dir by walking ".." up to root.
+ *  Parameters:
+ *      int   dir_inode_num :   inode number of dir
+ *      char *path          :   output buffer
+ *      int   path_size     :   size of output buffer
+ *  Return: int
+ *      -1 if dir not reachable from root or buffer too small
+ *       0 if success
+ */
+int get_path_by_inode_number(int dir_inode_num,
+                             char *path,
+                             int path_size);
+
+/*
+ *  Repack live entries of a dir densely into the fewest datablocks,
+ *      trailing datablocks are freed. New content is built in memory
+ *      first, then the block map, i_size and i_blocks are updated in
+ *      one step.
+ *  Parameters:
+ *      int dir_inode_num   :   inode number of dir
+ *      int keep_deleted    :   if set, deleted entries that can still
+ *                              be restored are kept in the gaps
+ *  Return: int
+ *      number of datablocks freed
+ */
+int compact_dir(int dir_inode_num,
+                int keep_deleted);
+
+/*
+ *  compact_dir() a dir and every dir under it.
+ *  Return: int
+ *      total number of datablocks freed
+ */
+int compact_dir_rec(int dir_inode_num,
+                    int keep_deleted);
+
 /*
  *  Init a datablock as dir_entry datablock
  *  Parameters:
@@ -96,6 +394,35 @@ void init_dir_entry(unsigned char *entry_datablock,
                     int self_inode_num,
                     int parent_inode_num);
 
+/*
+ *  Free inode and block counts are kept as per-thread deltas by
+ *      ialloc(), dalloc(), ifree(), dfree(), restore_*_bitmap() and
+ *      bitmap batches, so allocating threads don't all write the sb and
+ *      gdt cache lines. Fold them into sb and gdt and give back the
+ *      windows ialloc()/dalloc() reserved, with no allocation running
+ *      in other threads. The block layer does it on commit and close.
+ */
+void ext2_counters_fold(void);
+
+/*
+ *  Free inode or block count, deltas not folded yet included.
+ */
+int ext2_free_inodes_count(void);
+int ext2_free_blocks_count(void);
+
+/*
+ *  Set free counts of sb and gdt from bitmaps, dropping pending deltas.
+ *      Used on open of an image left unclean, counters may be stale.
+ */
+void ext2_counters_recompute(void);
+
+/*
+ *  ialloc() and dalloc() may run concurrently, with each other and with
+ *      frees and restores: a thread reserves a window of
+ *      EXT2_ALLOC_WINDOW_BITS bitmap bits and takes bits from it by
+ *      compare and swap, so threads don't contend on the same words.
+ */
+
 /*
  *  Allocate space on Inode table, return the allocated block number.
  *  Return: int
@@ -112,6 +439,63 @@ int ialloc(void);
  */
 int dalloc(void);
 
+/*
+ *  Like ialloc(), placed Orlov style with "--locality": a dir made in
+ *      root goes to the region with most free blocks among those with
+ *      average free inodes and blocks or more, anything else right after
+ *      its parent. Without the flag, same as ialloc().
+ *  Parameters:
+ *      int :   parent dir inode number, 0 if none (as ialloc())
+ *      int :   set if new inode is a dir
+ *  Return: int
+ *      inode number, -1 if none free
+ */
+int ialloc_near(int parent_inode_num,
+                int is_dir);
+
+/*
+ *  Like dalloc(), placed so consecutive blocks of a file stay together:
+ *      first free block from goal on within the window holding goal,
+ *      then the first free one of the later windows (wrapping around),
+ *      then any free block, blocks before goal included. Goal is
+ *      ignored without "--locality", same as dalloc() then.
+ *  Parameters:
+ *      int :   goal block number, -1 if none (as dalloc())
+ *  Return: int
+ *      block number, -1 if none free
+ */
+int dalloc_near(int goal_block);
+
+/*
+ *  Goal for first block of an inode: start of the block region matching
+ *      the inode region, -1 if inode_num isn't valid.
+ */
+int block_goal_of_inode(int inode_num);
+
+/*
+ *  Allocate the block after last_block for a growing dir or file. The
+ *      free blocks right after it (EXT2_PREALLOC_BLOCKS at most) are
+ *      reserved for the inode, later calls take them in order. The
+ *      reservation is held in memory only, the bitmap never shows it:
+ *      other allocations pass reserved blocks over while any other
+ *      block is free, and after a crash they are simply free. It is
+ *      dropped by ext2_counters_fold(), so on commit and close, or by
+ *      prealloc_discard().
+ *  Parameters:
+ *      int :   inode number
+ *      int :   last datablock of inode, -1 if none
+ *  Return: int
+ *      block number, -1 if none free
+ */
+int dalloc_grow(int inode_num,
+                int last_block);
+
+/*
+ *  Free blocks reserved for an inode by dalloc_grow(), when it is
+ *      released or truncated.
+ */
+void prealloc_discard(int inode_num);
+
 /*
  *  Free inode bitmap for certain inode.
  */
@@ -135,15 +519,74 @@ int restore_inode_bitmap(int inode_num);
 int restore_block_bitmap(int block_num);
 
 /*
- *  Count number of inode in bitmap mark as used
+ *  Add inode, block, or all blocks of an inode (indirect included)
+ *      to a bitmap batch.
+ */
+void bitmap_batch_add_inode(struct bitmap_batch *batch,
+                            int inode_num);
+void bitmap_batch_add_block(struct bitmap_batch *batch,
+                            int block_num);
+void bitmap_batch_add_blocks_of(struct bitmap_batch *batch,
+                                struct ext2_inode *inode);
+
+/*
+ *  Mark every inode and block in batch as used,
+ *      then update superblock and gdt counters once.
+ */
+void bitmap_batch_restore(struct bitmap_batch *batch);
+
+/*
+ *  Mark every inode and block in batch as free,
+ *      then update superblock and gdt counters once.
+ */
+void bitmap_batch_free(struct bitmap_batch *batch);
+
+/*
+ *  Release memory held by batch.
+ */
+void bitmap_batch_destroy(struct bitmap_batch *batch);
+
+/*
+ *  Count number of inode in bitmap mark as free
  */
 int count_inode_bitmap(void);
 
 /*
- *  Count number of block in bitmap mark as used
+ *  Count number of block in bitmap mark as free
  */
 int count_block_bitmap(void);
 
+/*
+ *  Build the list of free block runs from block bitmap, in block order.
+ *  Parameters:
+ *      struct free_extent ** : set to malloc'ed list, caller free it
+ *  Return: int
+ *      number of free runs
+ */
+int build_free_extents(struct free_extent **extents);
+
+/*
+ *  Count contiguous runs of datablocks of an inode. Indirect block
+ *      sitting right after the 12th block does not break a run, one
+ *      elsewhere (after the last block, as a copy places it) is not
+ *      counted.
+ */
+int count_extents(struct ext2_inode *inode);
+
+/*
+ *  Move all blocks of an inode into one free run picked from extents
+ *      (best fit), indirect block placed right after the 12th block.
+ *      The picked run is taken out of extents, old blocks are freed but
+ *      not added back. Inode with a dedup shared block is not moved.
+ *  Return: int
+ *       1 if moved
+ *       0 if already contiguous (one extent per count_extents())
+ *      -1 if no free run is large enough, or blocks are shared
+ */
+int defrag_inode(int inode_num,
+                 struct free_extent *extents,
+                 int num_extents);
+
 /*
  *  Read each block number in struct ext2_inode -> block[] into an array.
  *  Note. Indirect block number will not be include in the output array.
@@ -154,6 +597,14 @@ int count_block_bitmap(void);
  */
 int *read_i_block_into_array(struct ext2_inode *inode);
 
+/*
+ *  Prefetch every block of an array from read_i_block_into_array(),
+ *      ahead of a walk over them (see ext2_io_prefetch()).
+ *  Parameters:
+ *      int * :   array of block number, -1 terminated
+ */
+void prefetch_block_array(int *block_array);
+
 /*
  *  Write each block number in array to struct ext2_inode -> block[] .
  *  Parameters:
@@ -198,16 +649,119 @@ int copy_to_inode_datablock(struct ext2_inode *dst_file_inode,
                             int src_size);
 
 /*
- *  Create an inode.
+ *  Same as copy_to_inode_datablock(), but a block whose content is
+ *      already in the dedup index is shared instead of allocated.
+ *      Falls back to a plain copy if no index loaded.
+ */
+int copy_to_inode_datablock_dedup(struct ext2_inode *dst_file_inode,
+                                  unsigned char *src_file,
+                                  int src_size);
+
+/*
+ *  Write data to a regular file already holding data, in place: its
+ *      block map is reused, only blocks whose content changes are
+ *      written, and only the size delta is allocated or freed. A block
+ *      shared by dedup is copied before it is changed. Appended blocks
+ *      are taken with dalloc_grow(). i_size and i_blocks are updated.
  *  Parameters:
- *      unsigned short : inode type
- *      unsigned int   : file size
+ *      struct ext2_inode * :   file inode
+ *      unsigned char *     :   data
+ *      int                 :   size of data
+ *      int                 :   if set, data goes after i_size (filling
+ *                              slack of last block first), otherwise it
+ *                              replaces the whole content
+ *  Return : int
+ *      ENOSPC if no enought space, inode left unchanged
+ *      0      if success
+ */
+int write_to_inode_datablock(struct ext2_inode *inode,
+                             unsigned char *src,
+                             int src_size,
+                             int append);
+
+/*
+ *  Load block dedup index from "<image_path>.dedup". The index maps
+ *      content hash of shared blocks to block number, with a reference
+ *      count per block. It is saved back on exit if changed.
+ *  Parameters:
+ *      const char * :   path of image file
+ *      int          :   if set, start an empty index when none exists
+ *  Return : int
+ *      -1 if index file is invalid
+ *       0 if success (or no index and create not set)
+ */
+int dedup_load(const char *image_path,
+               int create);
+
+/*
+ *  Write dedup index back to its file, if changed.
+ *  Return : int
+ *      -1 if failed
+ *       0 if success
+ */
+int dedup_save(void);
+
+/*
+ *  Drop one reference to a block.
+ *  Return : int
+ *      1 if block has no more reference and should be freed
+ *      0 if block still shared
+ */
+int dedup_release_block(int block_num);
+
+/*
+ *  Add one reference to a block if it is in the dedup index.
+ */
+void dedup_ref_block(int block_num);
+
+/*
+ *  Check if a block is in the dedup index with live references.
+ */
+int dedup_is_shared(int block_num);
+
+/*
+ *  Recount references of every block in the dedup index from the
+ *      live inodes, fix and report counts that are off.
+ *  Return : int
+ *      number of counts fixed
+ */
+int dedup_check_refs(void);
+
+/*
+ *  Check if inode is a fast symlink (target stored in i_block[]).
+ *  Return : int
+ *      1 if fast symlink
+ *      0 otherwise
+ */
+int is_fast_symlink(struct ext2_inode *inode);
+
+/*
+ *  Store symlink target in a symlink inode.
+ *      Target shorter than EXT2_FAST_SYMLINK_MAX is kept inline
+ *      in i_block[], otherwise it is copied to a datablock.
+ *  Parameters:
+ *      struct ext2_inode * :   symlink inode
+ *      char *              :   target path
  *  Return : int
  *      ENOSPC if no enought space
  *      0      if success
  */
+int copy_to_inode_symlink(struct ext2_inode *dst_link_inode,
+                          char *target);
+
+/*
+ *  Create an inode, placed next to its parent dir.
+ *  Parameters:
+ *      int            : parent dir inode number, 0 if none
+ *      unsigned short : inode type
+ *      unsigned int   : file size
+ *  Return : int
+ *      -1 if no enought space
+ *      inode number of new inode if success
+ */
 
-int new_inode(unsigned short type,
+int new_inode(int parent_inode_num,
+              unsigned short type,
               unsigned int size);
 
 /*